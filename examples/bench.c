@@ -0,0 +1,1056 @@
+/* bench.c - Benchmarks of the ways camtiff can write a file.
+ *
+ * Run as `bench <mode> [pages] [width] [height]`, or with no arguments for
+ * the list of modes. Each mode writes bench.tif in the current directory
+ * once per case and prints one line per case. Frames are smooth with a
+ * little noise, like a camera image, so compression ratios are realistic.
+ *
+ * Copyright GPL V3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <tiffio.h>
+
+#include "../src/ctiff.h"
+#include "../src/ctiff_meta.h"  // Built with CTIFF_TEST for the meta mode.
+
+#define BENCH_FILE "bench.tif"
+
+/** The size of the frames and how many to write. */
+typedef struct {
+  unsigned int pages;
+  unsigned int width;
+  unsigned int height;
+} bench_args;
+
+/** Sets up a CTIFF for one case, before any page is added. */
+typedef int (*bench_setup)(CTIFF ctiff, const void *arg);
+
+/** Seconds on a monotonic clock. */
+static double benchNow(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/** The size of a file in bytes, or 0. */
+static double benchFileSize(const char *file)
+{
+  struct stat info;
+
+  return (stat(file, &info) == 0) ? (double) info.st_size : 0;
+}
+
+/** The number of bytes in a pixel of a CamTIFF pixel type. */
+static unsigned int benchPixelBytes(unsigned int pixel_type)
+{
+  return ((pixel_type & 0x0F) + 1);
+}
+
+/** Make a frame: a smooth gradient with a little noise. */
+static void* benchFrame(const bench_args *args, unsigned int pixel_type,
+                        unsigned int seed)
+{
+  size_t num = (size_t) args->width * args->height;
+  unsigned int bytes = benchPixelBytes(pixel_type);
+  unsigned int type  = pixel_type >> 4;
+  unsigned int x, y;
+  char *frame;
+  double v;
+  size_t i;
+
+  if ((frame = (char*) malloc(num * bytes)) == NULL) return NULL;
+
+  srand(seed);
+  for (i = 0; i < num; i++) {
+    x = (unsigned int) (i % args->width);
+    y = (unsigned int) (i / args->width);
+    v = 0.3 * ((x + seed) % 200) + 0.2 * (y % 300) + (rand() % 4);
+
+    if (type == 3 && bytes == 4){
+      ((float*) frame)[i] = (float) (v / 7);
+    } else if (type == 3){
+      ((double*) frame)[i] = v / 7;
+    } else if (bytes == 1){
+      ((unsigned char*) frame)[i] = (unsigned char) v;
+    } else if (bytes == 2){
+      ((unsigned short*) frame)[i] = (unsigned short) (v * 40);
+    } else {
+      ((unsigned int*) frame)[i] = (unsigned int) (v * 4000);
+    }
+  }
+
+  return frame;
+}
+
+/** Flush a file to the disk. */
+static void benchSync(const char *file)
+{
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0) return;
+  fsync(fd);
+  close(fd);
+}
+
+/** Write the pages of one case to BENCH_FILE and print the result.
+ *
+ * @param name       The name of the case.
+ * @param args       The size of the frames and how many to write.
+ * @param pixel_type The CamTIFF pixel type of the frames.
+ * @param setup      Called to set up the CTIFF, or NULL.
+ * @param arg        Passed to setup.
+ * @param sync       Whether the time to flush the file to the disk counts.
+ * @return           0 on success, the CamTIFF error on failure.
+ */
+static int benchSyncCase(const char *name, const bench_args *args,
+                         unsigned int pixel_type, bench_setup setup,
+                         const void *arg, bool sync)
+{
+  size_t frame_bytes = (size_t) args->width * args->height *
+                       benchPixelBytes(pixel_type);
+  double start, secs, size;
+  unsigned int k;
+  void *frame;
+  CTIFF ctiff;
+  int retval;
+
+  if ((frame = benchFrame(args, pixel_type, 1)) == NULL) return 1;
+
+  if ((ctiff = CTIFFNew(BENCH_FILE)) == NULL){
+    free(frame);
+    return 1;
+  }
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, args->width, args->height, pixel_type, false);
+
+  if (setup != NULL && (retval = setup(ctiff, arg)) != 0){
+    printf("%-28s not available (error %d)\n", name, retval);
+    CTIFFClose(ctiff);
+    free(frame);
+    return 0;
+  }
+
+  start = benchNow();
+  for (k = 0, retval = 0; k < args->pages && retval == 0; k++) {
+    retval = CTIFFAddNewPage(ctiff, frame, NULL, NULL);
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+  if (sync) benchSync(BENCH_FILE);
+  secs = benchNow() - start;
+  size = benchFileSize(BENCH_FILE);
+
+  if (retval == 0){
+    printf("%-28s %8.1f MB/s  %8.2f MB  ratio %5.2f\n", name,
+           frame_bytes * (double) args->pages / secs / 1e6, size / 1e6,
+           frame_bytes * (double) args->pages / size);
+  } else {
+    printf("%-28s failed (error %d)\n", name, retval);
+  }
+
+  free(frame);
+  return retval;
+}
+
+/** Write the pages of one case, as benchSyncCase without the flush. */
+static int benchCase(const char *name, const bench_args *args,
+                     unsigned int pixel_type, bench_setup setup,
+                     const void *arg)
+{
+  return benchSyncCase(name, args, pixel_type, setup, arg, false);
+}
+
+
+/*
+ * Strip size
+ */
+
+typedef struct {
+  unsigned int rows;
+  unsigned int bytes;
+  unsigned int codec;
+} bench_strips;
+
+static int benchStripsSetup(CTIFF ctiff, const void *arg)
+{
+  const bench_strips *strips = (const bench_strips*) arg;
+
+  CTIFFSetCompression(ctiff, strips->codec, 0);
+  if (strips->rows != 0) return CTIFFSetRowsPerStrip(ctiff, strips->rows);
+  return CTIFFSetStripBytes(ctiff, strips->bytes);
+}
+
+/** Rows per strip: one row per strip, as camtiff used to write, against
+ *  strips sized in bytes.
+ */
+static int benchStrips(const bench_args *args)
+{
+  static const bench_strips cases[] = {
+    {1, 0,           CTIFF_COMPRESSION_NONE},
+    {0, 64*1024,     CTIFF_COMPRESSION_NONE},
+    {0, 1024*1024,   CTIFF_COMPRESSION_NONE},
+    {1, 0,           CTIFF_COMPRESSION_LZW},
+    {0, 8*1024,      CTIFF_COMPRESSION_LZW},
+    {0, 64*1024,     CTIFF_COMPRESSION_LZW},
+    {0, 256*1024,    CTIFF_COMPRESSION_LZW},
+    {0, 1024*1024,   CTIFF_COMPRESSION_LZW}
+  };
+  char name[64];
+  unsigned int i;
+  int retval = 0;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]) && retval == 0; i++) {
+    if (cases[i].rows != 0){
+      sprintf(name, "%s, %u row strips",
+              (cases[i].codec == CTIFF_COMPRESSION_LZW) ? "lzw" : "none",
+              cases[i].rows);
+    } else {
+      sprintf(name, "%s, %u KiB strips",
+              (cases[i].codec == CTIFF_COMPRESSION_LZW) ? "lzw" : "none",
+              cases[i].bytes / 1024);
+    }
+    retval = benchCase(name, args, CTIFF_PIXEL_UINT16, benchStripsSetup,
+                       &cases[i]);
+  }
+
+  return retval;
+}
+
+
+/*
+ * Predictor
+ */
+
+/** The name of a CamTIFF pixel type. */
+static const char* benchPixelName(unsigned int pixel_type)
+{
+  switch (pixel_type) {
+    case CTIFF_PIXEL_UINT8:   return "uint8";
+    case CTIFF_PIXEL_UINT16:  return "uint16";
+    case CTIFF_PIXEL_UINT32:  return "uint32";
+    case CTIFF_PIXEL_INT8:    return "int8";
+    case CTIFF_PIXEL_INT16:   return "int16";
+    case CTIFF_PIXEL_INT32:   return "int32";
+    case CTIFF_PIXEL_FLOAT32: return "float32";
+    case CTIFF_PIXEL_FLOAT64: return "float64";
+    default:                  return "unknown";
+  }
+}
+
+static const unsigned int bench_pixel_types[] = {
+  CTIFF_PIXEL_UINT8, CTIFF_PIXEL_UINT16, CTIFF_PIXEL_UINT32,
+  CTIFF_PIXEL_INT8,  CTIFF_PIXEL_INT16,  CTIFF_PIXEL_INT32,
+  CTIFF_PIXEL_FLOAT32, CTIFF_PIXEL_FLOAT64
+};
+
+#define BENCH_NUM_PIXEL_TYPES \
+  (sizeof(bench_pixel_types) / sizeof(bench_pixel_types[0]))
+
+static int benchPredictorSetup(CTIFF ctiff, const void *arg)
+{
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_LZW, 0);
+  return CTIFFSetPredictor(ctiff, *(const unsigned int*) arg);
+}
+
+/** LZW with no predictor against the predictor for each pixel type:
+ *  horizontal for integers, floating point for floats.
+ */
+static int benchPredictor(const bench_args *args)
+{
+  static const unsigned int none = CTIFF_PREDICTOR_NONE;
+  static const unsigned int horizontal = CTIFF_PREDICTOR_HORIZONTAL;
+  static const unsigned int floating = CTIFF_PREDICTOR_FLOATINGPOINT;
+  unsigned int pixel_type;
+  char name[64];
+  unsigned int i;
+  int retval = 0;
+
+  for (i = 0; i < BENCH_NUM_PIXEL_TYPES && retval == 0; i++) {
+    pixel_type = bench_pixel_types[i];
+
+    sprintf(name, "%s, no predictor", benchPixelName(pixel_type));
+    retval = benchCase(name, args, pixel_type, benchPredictorSetup, &none);
+    if (retval != 0) break;
+
+    sprintf(name, "%s, horizontal", benchPixelName(pixel_type));
+    retval = benchCase(name, args, pixel_type, benchPredictorSetup,
+                       &horizontal);
+    if (retval != 0 || (pixel_type >> 4) != 3) continue;
+
+    sprintf(name, "%s, floating point", benchPixelName(pixel_type));
+    retval = benchCase(name, args, pixel_type, benchPredictorSetup,
+                       &floating);
+  }
+
+  return retval;
+}
+
+
+/*
+ * Codec
+ */
+
+typedef struct {
+  const char *name;
+  unsigned int codec;
+  int level;
+} bench_codec;
+
+static int benchCodecSetup(CTIFF ctiff, const void *arg)
+{
+  const bench_codec *codec = (const bench_codec*) arg;
+
+  return CTIFFSetCompression(ctiff, codec->codec, codec->level);
+}
+
+/** Each codec, and Deflate at a few levels, for each pixel type. */
+static int benchCodec(const bench_args *args)
+{
+  static const bench_codec codecs[] = {
+    {"none",      CTIFF_COMPRESSION_NONE,     0},
+    {"packbits",  CTIFF_COMPRESSION_PACKBITS, 0},
+    {"lzw",       CTIFF_COMPRESSION_LZW,      0},
+    {"deflate 1", CTIFF_COMPRESSION_DEFLATE,  1},
+    {"deflate 6", CTIFF_COMPRESSION_DEFLATE,  6},
+    {"deflate 9", CTIFF_COMPRESSION_DEFLATE,  9}
+  };
+  char name[64];
+  unsigned int i, j;
+  int retval = 0;
+
+  for (i = 0; i < BENCH_NUM_PIXEL_TYPES && retval == 0; i++) {
+    for (j = 0; j < sizeof(codecs) / sizeof(codecs[0]) && retval == 0; j++) {
+      sprintf(name, "%s, %s", benchPixelName(bench_pixel_types[i]),
+              codecs[j].name);
+      retval = benchCase(name, args, bench_pixel_types[i], benchCodecSetup,
+                         &codecs[j]);
+    }
+  }
+
+  return retval;
+}
+
+
+/*
+ * Metadata
+ */
+
+/** Make pretty printed metadata of about the given size, like that of a
+ *  camera frame: a few settings and an array of readings.
+ */
+static char* benchMeta(size_t size)
+{
+  char *meta, *pt;
+  unsigned int k;
+
+  if ((meta = (char*) malloc(size + 256)) == NULL) return NULL;
+
+  pt = meta + sprintf(meta, "{\n  \"camera\": {\n    \"model\": \"bench\",\n"
+                            "    \"exposure\": 0.0125,\n"
+                            "    \"gain\": 4,\n    \"cooled\": true\n  },\n"
+                            "  \"readings\": [\n");
+  for (k = 0; (size_t) (pt - meta) < size; k++) {
+    pt += sprintf(pt, "    {\"t\": %u, \"temp\": %.3f, \"note\": "
+                      "\"reading %u\"},\n", k, 20 + k / 1000.0, k);
+  }
+  sprintf(pt, "    null\n  ]\n}\n");
+
+  return meta;
+}
+
+/** Time calls to validate and minify metadata, as done for every page. */
+static void benchMetaCase(const char *name, const char *meta, size_t calls,
+                          bool bytewise)
+{
+  size_t len = strlen(meta);
+  const char *tar;
+  double start, secs;
+  char *out = NULL;
+  size_t k;
+
+  start = benchNow();
+  for (k = 0; k < calls; k++) {
+    if (bytewise){
+      // As the metadata used to be handled: a buffer and checker each call.
+      out = (char*) malloc(len + 1);
+      __CTIFFMinifyJSONBytewise(meta, len, out,
+                                CTIFF_DEFAULT_META_DEPTH + 1);
+      free(out);
+    } else {
+      tar = __CTIFFCreateValidExtMeta(true, CTIFF_DEFAULT_META_DEPTH + 1,
+                                      "bench", meta);
+      free((void*) tar);
+    }
+  }
+  secs = benchNow() - start;
+
+  printf("%-28s %8.2f us/call  %8.1f MB/s\n", name, secs / calls * 1e6,
+         len * (double) calls / secs / 1e6);
+}
+
+/** Validate and minify metadata of a few sizes, a character at a time
+ *  against the fast path. The number of calls is 100 per page.
+ */
+static int benchMetadata(const bench_args *args)
+{
+  static const size_t sizes[] = {256, 4096, 65536};
+  size_t calls;
+  char name[64];
+  unsigned int i;
+  char *meta;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if ((meta = benchMeta(sizes[i])) == NULL) return 1;
+    calls = (size_t) args->pages * 100 * 4096 / sizes[i] + 1;
+
+    sprintf(name, "%lu bytes, bytewise", (unsigned long) strlen(meta));
+    benchMetaCase(name, meta, calls, true);
+    sprintf(name, "%lu bytes, fast path", (unsigned long) strlen(meta));
+    benchMetaCase(name, meta, calls, false);
+
+    free(meta);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Buffered I/O
+ */
+
+/** A file whose reads, writes and seeks are counted. Each is a system
+ *  call, so the counts are the system calls made for the file's data.
+ */
+typedef struct {
+  int fd;
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long seeks;
+} bench_file;
+
+static long long benchRead(void *handle, void *data, size_t size)
+{
+  bench_file *file = (bench_file*) handle;
+
+  file->reads++;
+  return read(file->fd, data, size);
+}
+
+static long long benchWrite(void *handle, const void *data, size_t size)
+{
+  bench_file *file = (bench_file*) handle;
+
+  file->writes++;
+  return write(file->fd, data, size);
+}
+
+static long long benchSeek(void *handle, long long offset, int whence)
+{
+  bench_file *file = (bench_file*) handle;
+
+  file->seeks++;
+  return lseek(file->fd, (off_t) offset, whence);
+}
+
+static long long benchSize(void *handle)
+{
+  struct stat info;
+
+  return (fstat(((bench_file*) handle)->fd, &info) == 0) ? info.st_size : -1;
+}
+
+static int benchClose(void *handle)
+{
+  return close(((bench_file*) handle)->fd);
+}
+
+static const CTIFF_io_procs bench_procs = {
+  benchRead, benchWrite, benchSeek, benchSize, benchClose
+};
+
+// The same, in the form libTIFF's TIFFClientOpen takes.
+static tsize_t benchTIFFRead(thandle_t handle, tdata_t data, tsize_t size)
+{
+  return (tsize_t) benchRead(handle, data, (size_t) size);
+}
+
+static tsize_t benchTIFFWrite(thandle_t handle, tdata_t data, tsize_t size)
+{
+  return (tsize_t) benchWrite(handle, data, (size_t) size);
+}
+
+static toff_t benchTIFFSeek(thandle_t handle, toff_t offset, int whence)
+{
+  return (toff_t) benchSeek(handle, (long long) offset, whence);
+}
+
+static int benchTIFFClose(thandle_t handle)
+{
+  return benchClose(handle);
+}
+
+static toff_t benchTIFFSize(thandle_t handle)
+{
+  return (toff_t) benchSize(handle);
+}
+
+static int benchTIFFMap(thandle_t handle, tdata_t *base, toff_t *size)
+{
+  return 0;
+}
+
+static void benchTIFFUnmap(thandle_t handle, tdata_t base, toff_t size)
+{
+}
+
+/** Print the rate and the system calls made writing one case. */
+static void benchIOReport(const char *name, const bench_args *args,
+                          const bench_file *file, double secs)
+{
+  double bytes = 2.0 * args->width * args->height * args->pages;
+
+  printf("%-28s %8.1f MB/s  %8lu writes %8lu seeks %8lu reads\n", name,
+         bytes / secs / 1e6, file->writes, file->seeks, file->reads);
+}
+
+/** Write the frames with libTIFF alone, straight to the file as
+ *  TIFFOpen does, with the strips and directories camtiff would write.
+ */
+static int benchIOLibTIFF(const bench_args *args, const void *frame)
+{
+  unsigned int rows = CTIFF_DEFAULT_STRIP_BYTES / (2 * args->width);
+  tsize_t strip_bytes;
+  bench_file file = {-1, 0, 0, 0};
+  unsigned int k, row;
+  double start;
+  TIFF *tiff;
+  int retval = 0;
+
+  if (rows == 0) rows = 1;
+
+  file.fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file.fd < 0) return 1;
+
+  start = benchNow();
+  tiff = TIFFClientOpen(BENCH_FILE, "w", (thandle_t) &file,
+                        benchTIFFRead, benchTIFFWrite, benchTIFFSeek,
+                        benchTIFFClose, benchTIFFSize,
+                        benchTIFFMap, benchTIFFUnmap);
+  if (tiff == NULL){
+    close(file.fd);
+    return 1;
+  }
+
+  for (k = 0; k < args->pages && retval == 0; k++) {
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, args->width);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, args->height);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 16);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, rows);
+
+    for (row = 0; row < args->height && retval == 0; row += rows) {
+      strip_bytes = (tsize_t) 2 * args->width *
+                    ((row + rows > args->height) ? args->height - row : rows);
+      if (TIFFWriteEncodedStrip(tiff, row / rows,
+                                (char*) frame + (size_t) 2 * args->width * row,
+                                strip_bytes) < 0) retval = 1;
+    }
+
+    if (retval == 0 && !TIFFWriteDirectory(tiff)) retval = 1;
+  }
+  TIFFClose(tiff);
+
+  benchIOReport("libtiff, unbuffered", args, &file, benchNow() - start);
+  return retval;
+}
+
+/** Write the frames with camtiff through the same counted file. */
+static int benchIOCamTIFF(const bench_args *args, const void *frame)
+{
+  bench_file file = {-1, 0, 0, 0};
+  unsigned int k;
+  double start;
+  CTIFF ctiff;
+  int retval = 0;
+
+  file.fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file.fd < 0) return 1;
+
+  start = benchNow();
+  if ((ctiff = CTIFFNewWithIO(BENCH_FILE, &file, &bench_procs)) == NULL){
+    close(file.fd);
+    return 1;
+  }
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, args->width, args->height, CTIFF_PIXEL_UINT16, false);
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_NONE, 0);
+
+  for (k = 0; k < args->pages && retval == 0; k++) {
+    retval = CTIFFAddNewPage(ctiff, frame, NULL, NULL);
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+
+  benchIOReport("camtiff, buffered", args, &file, benchNow() - start);
+  return retval;
+}
+
+/** System calls and MB/s writing uncompressed uint16 frames, with libTIFF
+ *  writing straight to the file against camtiff's write buffer.
+ */
+static int benchIO(const bench_args *args)
+{
+  void *frame;
+  int retval;
+
+  if ((frame = benchFrame(args, CTIFF_PIXEL_UINT16, 1)) == NULL) return 1;
+
+  retval = benchIOLibTIFF(args, frame);
+  if (retval == 0) retval = benchIOCamTIFF(args, frame);
+
+  free(frame);
+  return retval;
+}
+
+
+/*
+ * Direct I/O
+ */
+
+typedef struct {
+  const char *name;
+  bool direct;
+  unsigned int depth;
+} bench_direct;
+
+static int benchDirectSetup(CTIFF ctiff, const void *arg)
+{
+  const bench_direct *direct = (const bench_direct*) arg;
+  int retval;
+
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_NONE, 0);
+  if (direct->direct && (retval = CTIFFSetDirectIO(ctiff, true)) != 0){
+    return retval;
+  }
+  return CTIFFSetWriteQueueDepth(ctiff, direct->depth);
+}
+
+/** Sustained rate of uncompressed uint16 frames through the page cache
+ *  against direct I/O, counting the time to flush the file to the disk.
+ */
+static int benchDirect(const bench_args *args)
+{
+  static const bench_direct cases[] = {
+    {"buffered",              false, 0},
+    {"buffered, 4 in flight", false, 4},
+    {"direct",                true,  0},
+    {"direct, 4 in flight",   true,  4}
+  };
+  unsigned int i;
+  int retval = 0;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]) && retval == 0; i++) {
+    retval = benchSyncCase(cases[i].name, args, CTIFF_PIXEL_UINT16,
+                           benchDirectSetup, &cases[i], true);
+  }
+
+  return retval;
+}
+
+
+/*
+ * Tiles
+ */
+
+#define BENCH_ROI     256   // The width and height of a region of interest.
+#define BENCH_NUM_ROI 200
+
+static int benchTilesSetup(CTIFF ctiff, const void *arg)
+{
+  unsigned int tile = *(const unsigned int*) arg;
+
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_LZW, 0);
+  CTIFFSetPredictor(ctiff, CTIFF_PREDICTOR_HORIZONTAL);
+  return (tile != 0) ? CTIFFSetTileSize(ctiff, tile, tile) : 0;
+}
+
+/** Time reading regions of interest from the first page of BENCH_FILE,
+ *  decoding only the strips or tiles each region touches.
+ */
+static int benchROI(const char *name, const bench_args *args)
+{
+  unsigned int x, y, tx, ty, k;
+  uint32 rows, tile_w, tile_h;
+  double start, decoded = 0;
+  tsize_t size, got;
+  bool tiled;
+  TIFF *tiff;
+  char *buf;
+  int retval = 0;
+
+  // libTIFF warns of camtiff's own tags, which are not of interest here.
+  TIFFSetWarningHandler(NULL);
+  if ((tiff = TIFFOpen(BENCH_FILE, "r")) == NULL) return 1;
+
+  tiled = TIFFIsTiled(tiff);
+  size  = tiled ? TIFFTileSize(tiff) : TIFFStripSize(tiff);
+  if ((buf = (char*) malloc(size)) == NULL){
+    TIFFClose(tiff);
+    return 1;
+  }
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows);
+  TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tile_w);
+  TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tile_h);
+
+  srand(2);
+  start = benchNow();
+  for (k = 0; k < BENCH_NUM_ROI && retval == 0; k++) {
+    x = (unsigned int) rand() % (args->width  - BENCH_ROI + 1);
+    y = (unsigned int) rand() % (args->height - BENCH_ROI + 1);
+
+    if (tiled){
+      for (ty = y / tile_h; ty <= (y + BENCH_ROI - 1) / tile_h; ty++) {
+        for (tx = x / tile_w; tx <= (x + BENCH_ROI - 1) / tile_w; tx++) {
+          got = TIFFReadEncodedTile(tiff,
+                  TIFFComputeTile(tiff, tx * tile_w, ty * tile_h, 0, 0),
+                  buf, size);
+          if (got < 0) retval = 1;
+          decoded += got;
+        }
+      }
+    } else {
+      for (ty = y / rows; ty <= (y + BENCH_ROI - 1) / rows; ty++) {
+        if ((got = TIFFReadEncodedStrip(tiff, ty, buf, size)) < 0) retval = 1;
+        decoded += got;
+      }
+    }
+  }
+
+  printf("%-28s %8.3f ms/ROI  %8.2f MB decoded/ROI\n", name,
+         (benchNow() - start) / BENCH_NUM_ROI * 1e3,
+         decoded / BENCH_NUM_ROI / 1e6);
+
+  free(buf);
+  TIFFClose(tiff);
+  return retval;
+}
+
+/** Write LZW uint16 frames in strips and in tiles of a few sizes, then
+ *  read random 256x256 regions of interest back from each file. Large
+ *  frames, such as 1 page of 8192x8192, show the difference best.
+ */
+static int benchTiles(const bench_args *args)
+{
+  static const unsigned int tiles[] = {0, 128, 256, 512};
+  char name[64];
+  unsigned int i;
+  int retval = 0;
+
+  if (args->width < BENCH_ROI || args->height < BENCH_ROI){
+    printf("Frames must be at least %ux%u.\n", BENCH_ROI, BENCH_ROI);
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(tiles) / sizeof(tiles[0]) && retval == 0; i++) {
+    if (tiles[i] != 0){
+      sprintf(name, "%ux%u tiles", tiles[i], tiles[i]);
+    } else {
+      sprintf(name, "64 KiB strips");
+    }
+
+    retval = benchCase(name, args, CTIFF_PIXEL_UINT16, benchTilesSetup,
+                       &tiles[i]);
+    if (retval == 0) retval = benchROI(name, args);
+  }
+
+  return retval;
+}
+
+
+/*
+ * Appending
+ */
+
+/** A file that keeps nothing, so that very many pages can be written. Reads
+ *  are counted and read as zeros; any read means libTIFF walked the chain
+ *  of directories, and the file would not be valid.
+ */
+typedef struct {
+  long long pos;
+  long long size;
+  unsigned long reads;
+} bench_sink;
+
+static long long benchSinkRead(void *handle, void *data, size_t size)
+{
+  bench_sink *sink = (bench_sink*) handle;
+
+  sink->reads++;
+  memset(data, 0, size);
+  sink->pos += (long long) size;
+  return (long long) size;
+}
+
+static long long benchSinkWrite(void *handle, const void *data, size_t size)
+{
+  bench_sink *sink = (bench_sink*) handle;
+
+  sink->pos += (long long) size;
+  if (sink->pos > sink->size) sink->size = sink->pos;
+  return (long long) size;
+}
+
+static long long benchSinkSeek(void *handle, long long offset, int whence)
+{
+  bench_sink *sink = (bench_sink*) handle;
+
+  switch (whence) {
+    case SEEK_SET: sink->pos  = offset;              break;
+    case SEEK_CUR: sink->pos += offset;              break;
+    case SEEK_END: sink->pos  = sink->size + offset; break;
+    default:       return -1;
+  }
+  return sink->pos;
+}
+
+static long long benchSinkSize(void *handle)
+{
+  return ((bench_sink*) handle)->size;
+}
+
+static const CTIFF_io_procs bench_sink_procs = {
+  benchSinkRead, benchSinkWrite, benchSinkSeek, benchSinkSize, NULL
+};
+
+#define BENCH_APPEND_BLOCKS 10
+
+/** Time per page as a file grows, in blocks of a tenth of the pages, with
+ *  the reads made. Adding a page should take the same time however many
+ *  come before it, such as for 100000 pages of 512x512. Past 4 GiB the
+ *  offsets of a classic TIFF wrap, which only matters as nothing is kept.
+ */
+static int benchAppend(const bench_args *args)
+{
+  unsigned int block = (args->pages + BENCH_APPEND_BLOCKS - 1) /
+                       BENCH_APPEND_BLOCKS;
+  bench_sink sink = {0, 0, 0};
+  unsigned long reads = 0;
+  double start, block_start;
+  unsigned int k;
+  void *frame;
+  CTIFF ctiff;
+  int retval = 0;
+
+  if ((frame = benchFrame(args, CTIFF_PIXEL_UINT16, 1)) == NULL) return 1;
+
+  if ((ctiff = CTIFFNewWithIO("sink", &sink, &bench_sink_procs)) == NULL){
+    free(frame);
+    return 1;
+  }
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, args->width, args->height, CTIFF_PIXEL_UINT16, false);
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_NONE, 0);
+
+  start = block_start = benchNow();
+  for (k = 0; k < args->pages && retval == 0; k++) {
+    retval = CTIFFAddNewPage(ctiff, frame, NULL, NULL);
+
+    if ((k + 1) % block == 0 || k + 1 == args->pages){
+      printf("pages %7u-%-7u %8.3f ms/page  %10lu reads\n",
+             k - (k % block) + 1, k + 1,
+             (benchNow() - block_start) / (k % block + 1) * 1e3,
+             sink.reads - reads);
+      reads = sink.reads;
+      block_start = benchNow();
+    }
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+
+  printf("%-28s %8.3f ms/page  %10lu reads\n", "all pages",
+         (benchNow() - start) / args->pages * 1e3, sink.reads);
+
+  free(frame);
+  return retval;
+}
+
+
+/*
+ * CBOR
+ */
+
+#define BENCH_CBOR_READINGS 64
+
+/** Make the metadata of a page: camera settings and readings that change
+ *  from page to page.
+ */
+static void benchCborMeta(char *meta, unsigned int page)
+{
+  char *pt;
+  unsigned int k;
+
+  pt = meta + sprintf(meta, "{\"frame\":%u,\"time\":%.6f,\"exposure\":"
+                            "0.0125,\"gain\":4,\"cooled\":true,\"model\":"
+                            "\"bench\",\"readings\":[", page, page / 1000.0);
+  for (k = 0; k < BENCH_CBOR_READINGS; k++) {
+    pt += sprintf(pt, "%s%u", k ? "," : "", (page * 31 + k * 17) % 4096);
+  }
+  sprintf(pt, "],\"temp\":%.2f}", 20 + (page % 100) / 8.0);
+}
+
+/** Write and read back pages with metadata stored as JSON or as CBOR.
+ *
+ * @param name     The name of the case.
+ * @param args     The number of pages; frames are 64x64 so that the
+ *                 metadata dominates.
+ * @param encoding CTIFF_META_JSON or CTIFF_META_CBOR.
+ * @return         0 on success, the CamTIFF error on failure.
+ */
+static int benchCborCase(const char *name, const bench_args *args,
+                         unsigned int encoding)
+{
+  unsigned char frame[64*64] = {0};
+  char meta[1024], *json;
+  double start, write_secs, read_secs, stored = 0;
+  unsigned int k, num = 0;
+  uint32 len;
+  void *data;
+  CTIFF ctiff;
+  TIFF *tiff;
+  int retval;
+
+  if ((ctiff = CTIFFNew(BENCH_FILE)) == NULL) return 1;
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, 64, 64, CTIFF_PIXEL_UINT8, false);
+  retval = CTIFFSetMetaEncoding(ctiff, encoding);
+
+  start = benchNow();
+  for (k = 0; k < args->pages && retval == 0; k++) {
+    benchCborMeta(meta, k);
+    retval = CTIFFAddNewPage(ctiff, frame, "meta", meta);
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+  write_secs = benchNow() - start;
+  if (retval != 0) return retval;
+
+  // Also registers the CBOR tag with libTIFF.
+  if ((retval = CTIFFReadPageMeta(BENCH_FILE, 0, &json)) != 0) return retval;
+  CTIFFFreeMeta(json);
+
+  // Only the time to turn the stored bytes into JSON text is counted.
+  TIFFSetWarningHandler(NULL);
+  if ((tiff = TIFFOpen(BENCH_FILE, "r")) == NULL) return 1;
+  read_secs = 0;
+  do {
+    if (TIFFGetField(tiff, CTIFFTAG_CBORMETA, &len, &data) == 1){
+      start = benchNow();
+      retval = CTIFFDecodeMeta(data, len, &json);
+      read_secs += benchNow() - start;
+      CTIFFFreeMeta(json);
+    } else if (TIFFGetField(tiff, TIFFTAG_XMLPACKET, &len, &data) == 1){
+      start = benchNow();
+      if ((json = (char*) malloc(len + 1)) != NULL){
+        memcpy(json, data, len);
+        json[len] = '\0';
+      }
+      read_secs += benchNow() - start;
+      free(json);
+    }
+    stored += len;
+    num++;
+  } while (retval == 0 && TIFFReadDirectory(tiff));
+  TIFFClose(tiff);
+
+  printf("%-28s %8.2f us/page write  %8.1f bytes/page  %6.2f us/page read\n",
+         name, write_secs / args->pages * 1e6, stored / num,
+         read_secs / num * 1e6);
+  return retval;
+}
+
+/** Cost of writing and reading metadata as CBOR against JSON, and its
+ *  size, for metadata of mostly numbers.
+ */
+static int benchCbor(const bench_args *args)
+{
+  int retval;
+
+  retval = benchCborCase("json", args, CTIFF_META_JSON);
+  if (retval == 0) retval = benchCborCase("cbor", args, CTIFF_META_CBOR);
+
+  return retval;
+}
+
+
+static const struct {
+  const char *name;
+  int (*run)(const bench_args *args);
+  const char *help;
+} bench_modes[] = {
+  {"strips",    benchStrips,    "MB/s and file size by strip size (uint16)"},
+  {"predictor", benchPredictor, "LZW ratio and MB/s by predictor, pixel type"},
+  {"codec",     benchCodec,     "ratio and MB/s by codec and pixel type"},
+  {"meta",      benchMetadata,  "us per call to validate and minify metadata"},
+  {"io",        benchIO,        "system calls and MB/s, libTIFF vs camtiff"},
+  {"direct",    benchDirect,    "MB/s to disk, page cache against direct I/O"},
+  {"tiles",     benchTiles,     "ROI read latency, strips against tiles"},
+  {"append",    benchAppend,    "ms per page as a file grows to many pages"},
+  {"cbor",      benchCbor,      "metadata as CBOR against JSON, 64x64 frames"}
+};
+
+int main(int argc, char **argv)
+{
+  bench_args args = {100, 1024, 1024};
+  unsigned int i;
+  int retval;
+
+  if (argc > 2) args.pages  = (unsigned int) atoi(argv[2]);
+  if (argc > 3) args.width  = (unsigned int) atoi(argv[3]);
+  if (argc > 4) args.height = (unsigned int) atoi(argv[4]);
+
+  for (i = 0; argc > 1 && i < sizeof(bench_modes) / sizeof(bench_modes[0]);
+       i++) {
+    if (strcmp(argv[1], bench_modes[i].name) != 0) continue;
+
+    printf("%s: %u pages of %ux%u\n", bench_modes[i].name,
+           args.pages, args.width, args.height);
+    retval = bench_modes[i].run(&args);
+    remove(BENCH_FILE);
+    return retval;
+  }
+
+  printf("Usage: %s <mode> [pages] [width] [height]\n", argv[0]);
+  for (i = 0; i < sizeof(bench_modes) / sizeof(bench_modes[0]); i++) {
+    printf("  %-10s %s\n", bench_modes[i].name, bench_modes[i].help);
+  }
+  return 1;
+}
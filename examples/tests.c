@@ -0,0 +1,748 @@
+/* tests.c - Tests of camtiff's internals that are hard to see from outside.
+ *
+ * Run as `tests [test]`, or with no arguments to run every test. Each test
+ * prints its name and either "ok" or the number of failures, with the first
+ * few failures described. The exit status is 0 only if every test passed.
+ *
+ * Copyright GPL V3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <tiffio.h>
+
+#ifdef TIFF_VERSION_BIG  // Only defined by libTIFF 4.0+
+#define CTIFF_BIGTIFF
+#endif
+
+#include "../src/ctiff.h"
+#include "../src/ctiff_meta.h"  // Built with CTIFF_TEST.
+
+#define TEST_MAX_REPORTS 5  // Failures described per test.
+#define TEST_FILE "tests.tif"
+#define TEST_FILE_CBOR "tests_cbor.tif"
+
+static unsigned long test_failures;
+
+/** Note a failure, describing the first few of each test. */
+static void testFail(const char *what, const char *input, size_t len)
+{
+  if (test_failures++ >= TEST_MAX_REPORTS) return;
+
+  printf("  %s: \"", what);
+  fwrite(input, 1, (len > 60) ? 60 : len, stdout);
+  printf("%s\"\n", (len > 60) ? "..." : "");
+}
+
+/** A small, fixed random number generator, so failures can be repeated on
+ *  any platform (xorshift32).
+ */
+static unsigned int test_seed = 2463534242u;
+
+static unsigned int testRand(void)
+{
+  test_seed ^= test_seed << 13;
+  test_seed ^= test_seed >> 17;
+  test_seed ^= test_seed << 5;
+  return test_seed;
+}
+
+
+/*
+ * JSON
+ */
+
+/** Check the fast path against the character-at-a-time checker.
+ *
+ *  Both must agree on whether the JSON is valid and, if it is, on the
+ *  minified JSON. The fast path is reached through __CTIFFTarValidExtMeta,
+ *  which in strict mode returns NULL for invalid JSON.
+ */
+static void testJSONCase(const char *json)
+{
+  size_t len = strlen(json);
+  const char *fast;
+  char *slow;
+  long slow_len;
+
+  if (len == 0) return;
+  if ((slow = (char*) malloc(len + 1)) == NULL){
+    testFail("out of memory", json, len);
+    return;
+  }
+
+  slow_len = __CTIFFMinifyJSONBytewise(json, len, slow,
+                                       CTIFF_DEFAULT_META_DEPTH + 1);
+  fast = __CTIFFTarValidExtMeta(json, true);
+
+  if ((slow_len < 0) != (fast == NULL)){
+    testFail((fast == NULL) ? "fast path rejected" : "fast path accepted",
+             json, len);
+  } else if (fast != NULL && ((size_t) slow_len != strlen(fast) ||
+                              memcmp(fast, slow, slow_len) != 0)){
+    testFail("minified differently", json, len);
+  }
+
+  free((void*) fast);
+  free(slow);
+}
+
+/** JSON made to land on the edges of the fast path: runs of plain string
+ *  characters of every length around the 16 tested at a time, ending in
+ *  each character that stops a run, and white space in every place.
+ */
+static void testJSONAdversarial(void)
+{
+  static const char *ends[] = {
+    "\"", "\\\"", "\\\\", "\\n", "\\u00e9", "\\x", "\x01", "\x1f", "\x7f",
+    "\x80", "\xc3\xa9", "\t", "\n", " "
+  };
+  static const char *fixed[] = {
+    "{}", "[]", "{ }", "[ ]", " {\"a\" : 1} ", "{\"a\":1,}", "[1,]",
+    "{\"a\"  :  [ 1 ,  2 , { \"b\" : null } ] }", "\"\"", "\"a\"", "1",
+    "-0.5e+10", "01", "[tru]", "[true , false , null]", "{\"a\"\t:\r\n1}",
+    "{\"a\":\"b\"}}", "[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]]",
+    "[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]", "{\"a\":1} x", "{\"a\":1}\x80"
+  };
+  char json[256];
+  unsigned int i, j, k;
+
+  for (i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++) {
+    testJSONCase(fixed[i]);
+  }
+
+  for (i = 0; i < 40; i++) {
+    for (j = 0; j < sizeof(ends) / sizeof(ends[0]); j++) {
+      // A run as a key, as a value and in an array, closed or not.
+      for (k = 0; k < 6; k++) {
+        char run[64];
+
+        memset(run, 'a' + (char) (i % 26), i);
+        run[i] = '\0';
+        switch (k) {
+          case 0: sprintf(json, "{\"%s%s\":1}", run, ends[j]); break;
+          case 1: sprintf(json, "{\"k\" : \"%s%s\"}", run, ends[j]); break;
+          case 2: sprintf(json, "[\"%s%s\", \"%s\"]", run, ends[j], run);
+                  break;
+          case 3: sprintf(json, "[\"%s%s", run, ends[j]); break;
+          case 4: sprintf(json, "{\"k\":\"%s%s\" ,\"%s\":2}", ends[j], run,
+                          run); break;
+          default: sprintf(json, "[%s\"%s\"%s]", ends[j], run, ends[j]);
+                   break;
+        }
+        testJSONCase(json);
+      }
+    }
+  }
+}
+
+/** Random JSON: tokens put together at random, mostly valid, then some
+ *  characters replaced at random.
+ */
+static void testJSONRandom(unsigned int num)
+{
+  static const char *tokens[] = {
+    "{", "}", "[", "]", ",", ":", "\"", "\"key\"", "\"a long string value "
+    "with spaces\"", "\\", "\\\"", "1", "-2.5e3", "true", "false", "null",
+    " ", "  ", "\t", "\n", "\r\n", "\x01", "\x7f", "\xc3\xa9", "u", "0"
+  };
+  static const char bytes[] = " \t\n\"\\{}[],:0aeu\x01\x7f\x80";
+  char json[512];
+  unsigned int i, k, len, num_tok;
+  const char *tok;
+
+  for (i = 0; i < num; i++) {
+    num_tok = 1 + testRand() % 40;
+    len = 0;
+
+    // Half of the cases start from an object, so more of them are valid.
+    if (i % 2 == 0) len = (unsigned int) sprintf(json, "{\"k\": [");
+    for (k = 0; k < num_tok; k++) {
+      tok = tokens[testRand() % (sizeof(tokens) / sizeof(tokens[0]))];
+      if (len + strlen(tok) + 4 >= sizeof(json)) break;
+      memcpy(json + len, tok, strlen(tok));
+      len += (unsigned int) strlen(tok);
+    }
+    if (i % 2 == 0){
+      memcpy(json + len, "]}", 2);
+      len += 2;
+    }
+    json[len] = '\0';
+
+    if (i % 3 == 0 && len > 0){
+      json[testRand() % len] = bytes[testRand() % (sizeof(bytes) - 1)];
+    }
+    testJSONCase(json);
+  }
+}
+
+/** Valid JSON, changed one character at a time. */
+static void testJSONMutated(unsigned int num)
+{
+  static const char base[] =
+    "{\"camera\": {\"model\": \"a sixteen char model name\", \"gain\": 4,\n"
+    "  \"exposure\" : 1.25e-3, \"cooled\": true, \"notes\": null},\n"
+    " \"readings\": [ {\"t\": 1, \"v\": -0.5}, {\"t\": 2, \"v\": \"\\u00e9\"}"
+    " ], \"escaped\": \"tab\\tquote\\\"slash\\\\end\" }";
+  static const char bytes[] = " \t\n\"\\{}[],:0aeu\x01\x7f\x80";
+  char json[sizeof(base)];
+  unsigned int i;
+
+  testJSONCase(base);
+  for (i = 0; i < num; i++) {
+    memcpy(json, base, sizeof(base));
+    json[testRand() % (sizeof(base) - 1)] =
+      bytes[testRand() % (sizeof(bytes) - 1)];
+    if (i % 2) json[testRand() % (sizeof(base) - 1)] = ' ';
+    testJSONCase(json);
+  }
+}
+
+/** The fast JSON checker and minifier gives the same result as checking
+ *  one character at a time.
+ */
+static void testJSON(void)
+{
+  testJSONAdversarial();
+  testJSONRandom(200000);
+  testJSONMutated(50000);
+}
+
+
+/*
+ * Linking directories
+ */
+
+/** A file whose reads are counted. */
+typedef struct {
+  int fd;
+  unsigned long reads;
+} test_file;
+
+static long long testRead(void *handle, void *data, size_t size)
+{
+  test_file *file = (test_file*) handle;
+
+  file->reads++;
+  return read(file->fd, data, size);
+}
+
+static long long testWrite(void *handle, const void *data, size_t size)
+{
+  return write(((test_file*) handle)->fd, data, size);
+}
+
+static long long testSeek(void *handle, long long offset, int whence)
+{
+  return lseek(((test_file*) handle)->fd, (off_t) offset, whence);
+}
+
+static long long testSize(void *handle)
+{
+  struct stat info;
+
+  return (fstat(((test_file*) handle)->fd, &info) == 0) ? info.st_size : -1;
+}
+
+static int testClose(void *handle)
+{
+  return close(((test_file*) handle)->fd);
+}
+
+static const CTIFF_io_procs test_procs = {
+  testRead, testWrite, testSeek, testSize, testClose
+};
+
+/** Write pages through counted callbacks, then read the file back.
+ *
+ *  Linking each directory must read nothing from the file, whatever the
+ *  size of the pages, and every page must be found in the file with its
+ *  own data.
+ */
+static void testLinksCase(const char *name, unsigned int width,
+                          unsigned int height, unsigned int strip_bytes,
+                          unsigned int num_pages)
+{
+  size_t page_bytes = (size_t) width * height * 2;
+  test_file file = {-1, 0};
+  unsigned short *page, *read_back;
+  unsigned int k, num_dirs = 0;
+  CTIFF ctiff;
+  TIFF *tiff;
+  int retval = 0;
+
+  page      = (unsigned short*) malloc(page_bytes);
+  read_back = (unsigned short*) malloc(page_bytes);
+  file.fd   = open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (page == NULL || read_back == NULL || file.fd < 0){
+    testFail("could not start", name, strlen(name));
+    free(page);
+    free(read_back);
+    return;
+  }
+
+  ctiff = CTIFFNewWithIO(TEST_FILE, &file, &test_procs);
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, width, height, CTIFF_PIXEL_UINT16, false);
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_NONE, 0);
+  if (strip_bytes != 0) CTIFFSetStripBytes(ctiff, strip_bytes);
+
+  for (k = 0; k < num_pages && retval == 0; k++) {
+    page[0] = (unsigned short) k;
+    page[width * height - 1] = (unsigned short) (k + 1);
+    retval = CTIFFAddNewPage(ctiff, page, "page", "{\"k\": 1}");
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+
+  if (retval != 0) testFail("could not write", name, strlen(name));
+  if (file.reads != 0) testFail("read while linking", name, strlen(name));
+
+  TIFFSetWarningHandler(NULL);
+  if ((tiff = TIFFOpen(TEST_FILE, "r")) != NULL){
+    do {
+      if (TIFFReadEncodedStrip(tiff, 0, read_back, -1) < 0 ||
+          read_back[0] != num_dirs){
+        testFail("page out of order", name, strlen(name));
+        break;
+      }
+      num_dirs++;
+    } while (TIFFReadDirectory(tiff));
+    TIFFClose(tiff);
+  }
+  if (num_dirs != num_pages) testFail("pages missing", name, strlen(name));
+
+  remove(TEST_FILE);
+  free(page);
+  free(read_back);
+}
+
+/** Directories are linked without reading the file, for pages that stay
+ *  in the write buffer and for pages and strips larger than it.
+ */
+static void testLinks(void)
+{
+  testLinksCase("64x64 pages", 64, 64, 0, 500);
+  testLinksCase("1024x1024 pages, 64 KiB strips", 1024, 1024, 0, 20);
+  testLinksCase("1024x1024 pages, 2 MiB strips", 1024, 1024, 2*1024*1024, 20);
+  testLinksCase("4096x1024 pages, 8 MiB strips", 4096, 1024, 8*1024*1024, 5);
+}
+
+
+/*
+ * CBOR metadata
+ */
+
+/** Decode a JSON string, with its quotes, to UTF-8.
+ *
+ * @param pt  The opening quote, set to the character after the string.
+ * @param out Where to write, at least as long as the JSON string.
+ * @return    The length of the decoded string.
+ */
+static size_t testJSONString(const char **pt, char *out)
+{
+  const char *in = *pt + 1;
+  unsigned long code, low;
+  char *o = out;
+
+  while (*in != '"'){
+    if (*in != '\\'){
+      *o++ = *in++;
+      continue;
+    }
+
+    in++;
+    switch (*in) {
+      case 'b': *o++ = '\b'; break;
+      case 'f': *o++ = '\f'; break;
+      case 'n': *o++ = '\n'; break;
+      case 'r': *o++ = '\r'; break;
+      case 't': *o++ = '\t'; break;
+      case 'u':
+        code = strtoul((char[5]) {in[1], in[2], in[3], in[4], 0}, NULL, 16);
+        in += 4;
+        if (code >= 0xD800 && code < 0xDC00 && in[1] == '\\' && in[2] == 'u'){
+          low  = strtoul((char[5]) {in[3], in[4], in[5], in[6], 0}, NULL, 16);
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          in  += 6;
+        }
+        if (code < 0x80){
+          *o++ = (char) code;
+        } else if (code < 0x800){
+          *o++ = (char) (0xC0 | (code >> 6));
+          *o++ = (char) (0x80 | (code & 0x3F));
+        } else if (code < 0x10000){
+          *o++ = (char) (0xE0 | (code >> 12));
+          *o++ = (char) (0x80 | ((code >> 6) & 0x3F));
+          *o++ = (char) (0x80 | (code & 0x3F));
+        } else {
+          *o++ = (char) (0xF0 | (code >> 18));
+          *o++ = (char) (0x80 | ((code >> 12) & 0x3F));
+          *o++ = (char) (0x80 | ((code >> 6) & 0x3F));
+          *o++ = (char) (0x80 | (code & 0x3F));
+        }
+        break;
+      default: *o++ = *in; break;  // " \ /
+    }
+    in++;
+  }
+
+  *pt = in + 1;
+  return (size_t) (o - out);
+}
+
+/** Compare two minified JSON values, as values rather than as text.
+ *
+ *  Strings are compared once decoded and numbers as doubles, so "\t" and
+ *  "\u0009", or 3.0 and 3, are the same. Members must be in the same order.
+ *
+ * @param a Set to the character after the first value.
+ * @param b Set to the character after the second value.
+ * @return  True if the values are the same.
+ */
+static bool testJSONSame(const char **a, const char **b)
+{
+  char *str_a, *str_b, *end_a, *end_b;
+  size_t len_a, len_b;
+  bool same;
+
+  if (**a == '"' || **b == '"'){
+    if (**a != **b) return false;
+
+    str_a = (char*) malloc(strlen(*a));
+    str_b = (char*) malloc(strlen(*b));
+    len_a = testJSONString(a, str_a);
+    len_b = testJSONString(b, str_b);
+    same  = (len_a == len_b && memcmp(str_a, str_b, len_a) == 0);
+    free(str_a);
+    free(str_b);
+    return same;
+  }
+
+  if (**a == '{' || **a == '['){
+    if (**a != **b) return false;
+    (*a)++;
+    (*b)++;
+
+    while (**a != '}' && **a != ']'){
+      if (!testJSONSame(a, b)) return false;
+      // After a key the colon, after a value the comma or the end.
+      if (**a != **b) return false;
+      if (**a == ':' || **a == ','){
+        (*a)++;
+        (*b)++;
+      }
+    }
+
+    if (**a != **b) return false;
+    (*a)++;
+    (*b)++;
+    return true;
+  }
+
+  if (**a == 't' || **a == 'f' || **a == 'n'){
+    len_a = (**a == 'f') ? 5 : 4;
+    if (strncmp(*a, *b, len_a) != 0) return false;
+    *a += len_a;
+    *b += len_a;
+    return true;
+  }
+
+  // Integers too large for a double are compared as text.
+  same = (strtod(*a, &end_a) == strtod(*b, &end_b));
+  if (same && end_a - *a > 15 && memchr(*a, '.', end_a - *a) == NULL){
+    same = (end_a - *a == end_b - *b && memcmp(*a, *b, end_a - *a) == 0);
+  }
+  *a = end_a;
+  *b = end_b;
+  return same;
+}
+
+/** Metadata of every kind of JSON value that CBOR encodes differently. */
+static const char *test_cbor_meta[] = {
+  "{\"a\":1,\"b\":-2,\"c\":18446744073709551615,\"d\":-9223372036854775808,"
+  "\"e\":23,\"f\":24,\"g\":255,\"h\":256,\"i\":65536,\"j\":4294967296}",
+  "{\"f\":1.5,\"g\":0.1,\"h\":-2.5e-10,\"i\":1e300,\"j\":3.0,\"k\":1E2,"
+  "\"l\":-0.0,\"m\":65504.0,\"n\":5.960464477539063e-08,\"o\":3.4e38}",
+  "{\"s\":\"tab\\tq\\\"s\\\\\\/\\u00e9\\ud83d\\ude00\\u0001\",\"e\":\"\"}",
+  "{\"n\":null,\"t\":true,\"f\":false,\"o\":{},\"a\":[],"
+  "\"x\":[1,[2,{\"y\":[3,{\"z\":{}}]}]]}",
+  "[1,2.5,\"three\",[4],{\"five\":5}]",
+  "{\"frame\":1,\"exposure\":0.0125,\"readings\":[20.125,20.25,20.5,21,"
+  "-273.15,1e-3,12345678901234],\"camera\":\"a long camera model name\"}",
+  "{\"frame\":2,\"exposure\":0.0125,\"readings\":[20.125,20.25,20.5,21,"
+  "-273.15,1e-3,12345678901234],\"camera\":\"a long camera model name\"}"
+};
+
+#define TEST_NUM_CBOR_META \
+  (sizeof(test_cbor_meta) / sizeof(test_cbor_meta[0]))
+
+/** Write each test metadata to a page of a file.
+ *
+ * @param file     The file to write.
+ * @param encoding CTIFF_META_JSON or CTIFF_META_CBOR.
+ * @param dedup    Whether to share metadata between pages.
+ */
+static void testCborWrite(const char *file, unsigned int encoding, bool dedup)
+{
+  unsigned char page[16] = {0};
+  unsigned int i;
+  CTIFF ctiff;
+  int retval;
+
+  if ((ctiff = CTIFFNew(file)) == NULL){
+    testFail("could not create", file, strlen(file));
+    return;
+  }
+
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, 4, 4, CTIFF_PIXEL_UINT8, false);
+  retval = CTIFFSetMetaEncoding(ctiff, encoding);
+  if (retval == 0 && dedup) retval = CTIFFSetMetaDedup(ctiff, true);
+
+  for (i = 0; i < 2 * TEST_NUM_CBOR_META && retval == 0; i++) {
+    retval = CTIFFAddNewPage(ctiff, page, "meta",
+                             test_cbor_meta[i % TEST_NUM_CBOR_META]);
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+
+  if (retval != 0) testFail("could not write", file, strlen(file));
+}
+
+/** Check the CBOR stored for a page decodes as CTIFFReadPageMeta reads it.
+ *
+ *  CTIFFReadPageMeta has registered the CBOR tag with libTIFF by now.
+ */
+static void testCborDecode(unsigned int page, const char *read)
+{
+  char *decoded = NULL;
+  uint32 len;
+  void *data;
+  TIFF *tiff;
+
+  if ((tiff = TIFFOpen(TEST_FILE_CBOR, "r")) == NULL) return;
+
+  if (TIFFSetDirectory(tiff, (tdir_t) page) != 1 ||
+      TIFFGetField(tiff, CTIFFTAG_CBORMETA, &len, &data) != 1){
+    testFail("no CBOR tag", read, strlen(read));
+  } else if (CTIFFDecodeMeta(data, len, &decoded) != 0 ||
+             strcmp(decoded, read) != 0){
+    testFail("decoded differently", read, strlen(read));
+  }
+
+  CTIFFFreeMeta(decoded);
+  TIFFClose(tiff);
+}
+
+/** Write the test metadata as JSON and as CBOR, then read each page back
+ *  from both files and compare the two as JSON values.
+ */
+static void testCborCase(bool dedup)
+{
+  char *json, *cbor;
+  const char *pt_json, *pt_cbor;
+  unsigned int i;
+
+  testCborWrite(TEST_FILE, CTIFF_META_JSON, false);
+  testCborWrite(TEST_FILE_CBOR, CTIFF_META_CBOR, dedup);
+
+  TIFFSetWarningHandler(NULL);
+  for (i = 0; i < 2 * TEST_NUM_CBOR_META; i++) {
+    json = cbor = NULL;
+
+    if (CTIFFReadPageMeta(TEST_FILE, i, &json) != 0 ||
+        CTIFFReadPageMeta(TEST_FILE_CBOR, i, &cbor) != 0){
+      testFail("could not read", test_cbor_meta[i % TEST_NUM_CBOR_META],
+               strlen(test_cbor_meta[i % TEST_NUM_CBOR_META]));
+    } else {
+      pt_json = json;
+      pt_cbor = cbor;
+      if (!testJSONSame(&pt_json, &pt_cbor) || *pt_json || *pt_cbor){
+        testFail("CBOR differs from JSON", cbor, strlen(cbor));
+      }
+      if (!dedup) testCborDecode(i, cbor);
+    }
+
+    CTIFFFreeMeta(json);
+    CTIFFFreeMeta(cbor);
+  }
+
+  remove(TEST_FILE);
+  remove(TEST_FILE_CBOR);
+}
+
+/** Metadata stored as CBOR reads back as the same JSON as metadata stored
+ *  as text, on its own and shared between pages.
+ */
+static void testCbor(void)
+{
+  testCborCase(false);
+  testCborCase(true);
+}
+
+
+#ifdef TIFF_VERSION_BIG  // Only defined by libTIFF 4.0+
+/*
+ * BigTIFF
+ */
+
+#define TEST_BIG_SIDE  8192
+#define TEST_BIG_PAGES 36    // 128 MiB pages, 4.5 GiB in all.
+
+/** Read a strip and check its first and last pixels.
+ *
+ * @return true if the strip has the pixels written for the page.
+ */
+static bool testBigStrip(TIFF *tiff, tstrip_t strip, unsigned short *data,
+                         unsigned int page)
+{
+  tsize_t len = TIFFReadEncodedStrip(tiff, strip, data, -1);
+
+  if (len < 2) return false;
+  if (strip == 0) return data[0] == page;
+  return data[len / 2 - 1] == page + 1;
+}
+
+/** Write a BigTIFF past 4 GiB and read every page back.
+ *
+ *  The pages are not compressed, so that the file, and the offsets of the
+ *  last pages, grow past what classic TIFF can hold. Skipped if the disk
+ *  holding the file has less room than that.
+ */
+static void testBig(void)
+{
+  size_t page_bytes = (size_t) TEST_BIG_SIDE * TEST_BIG_SIDE * 2;
+  unsigned long long file_bytes = (unsigned long long) page_bytes *
+                                  TEST_BIG_PAGES;
+  unsigned short *page, *strip;
+  unsigned int k, num_dirs = 0;
+  bool past_4gib = false;
+  struct statvfs disk;
+  CTIFF ctiff;
+  TIFF *tiff;
+  int retval = 0;
+
+  if (statvfs(".", &disk) != 0 ||
+      (unsigned long long) disk.f_bavail * disk.f_frsize < file_bytes * 9/8){
+    printf("  skipped, needs %llu MiB free\n", file_bytes * 9/8 >> 20);
+    return;
+  }
+
+  if ((page = (unsigned short*) calloc(page_bytes, 1)) == NULL){
+    testFail("could not start", TEST_FILE, strlen(TEST_FILE));
+    return;
+  }
+
+  if ((ctiff = CTIFFNewBig(TEST_FILE)) == NULL){
+    testFail("could not open", TEST_FILE, strlen(TEST_FILE));
+    free(page);
+    return;
+  }
+  CTIFFWriteEvery(ctiff, 1);
+  CTIFFSetStyle(ctiff, TEST_BIG_SIDE, TEST_BIG_SIDE, CTIFF_PIXEL_UINT16,
+                false);
+  CTIFFSetCompression(ctiff, CTIFF_COMPRESSION_NONE, 0);
+
+  for (k = 0; k < TEST_BIG_PAGES && retval == 0; k++) {
+    page[0] = (unsigned short) k;
+    page[page_bytes / 2 - 1] = (unsigned short) (k + 1);
+    retval = CTIFFAddNewPage(ctiff, page, "page", "{\"k\": 1}");
+  }
+  if (retval == 0) retval = CTIFFWrite(ctiff);
+  if (retval == 0){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+  free(page);
+  if (retval != 0) testFail("could not write", TEST_FILE, strlen(TEST_FILE));
+
+  TIFFSetWarningHandler(NULL);
+  if ((tiff = TIFFOpen(TEST_FILE, "r")) != NULL){
+    if (!TIFFIsBigTIFF(tiff)){
+      testFail("not a BigTIFF", TEST_FILE, strlen(TEST_FILE));
+    }
+    if ((strip = (unsigned short*) malloc(TIFFStripSize(tiff))) != NULL){
+      do {
+        if (!testBigStrip(tiff, 0, strip, num_dirs) ||
+            !testBigStrip(tiff, TIFFNumberOfStrips(tiff) - 1, strip,
+                          num_dirs)){
+          testFail("page out of order", TEST_FILE, strlen(TEST_FILE));
+          break;
+        }
+        if (TIFFCurrentDirOffset(tiff) > 0xFFFFFFFFull) past_4gib = true;
+        num_dirs++;
+      } while (TIFFReadDirectory(tiff));
+      free(strip);
+    }
+    TIFFClose(tiff);
+  }
+  if (num_dirs != TEST_BIG_PAGES){
+    testFail("pages missing", TEST_FILE, strlen(TEST_FILE));
+  }
+  if (!past_4gib){
+    testFail("file did not pass 4 GiB", TEST_FILE, strlen(TEST_FILE));
+  }
+
+  remove(TEST_FILE);
+}
+#endif
+
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} tests[] = {
+  {"json",  testJSON},
+  {"links", testLinks},
+  {"cbor",  testCbor},
+#ifdef TIFF_VERSION_BIG  // Only defined by libTIFF 4.0+
+  {"big",   testBig}
+#endif
+};
+
+int main(int argc, char **argv)
+{
+  unsigned int i, num_run = 0, num_failed = 0;
+
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    if (argc > 1 && strcmp(argv[1], tests[i].name) != 0) continue;
+
+    printf("%s\n", tests[i].name);
+    test_failures = 0;
+    tests[i].run();
+    num_run++;
+
+    if (test_failures == 0){
+      printf("  ok\n");
+    } else {
+      printf("  %lu failures\n", test_failures);
+      num_failed++;
+    }
+  }
+
+  if (num_run == 0){
+    printf("Usage: %s [test]\n", argv[0]);
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+      printf("  %s\n", tests[i].name);
+    }
+    return 1;
+  }
+
+  return (num_failed == 0) ? 0 : 1;
+}
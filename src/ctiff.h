@@ -52,7 +52,18 @@ BOOL APIENTRY DllMain( HMODULE hModule,
 #endif
 
 extern CTIFF CTIFFNew(const char*);
+// BigTIFF output, for files past 4 GiB, needs CamTIFF built against
+// libTIFF 4.0+; it is not built against the bundled libTIFF 3.9.5. Define
+// CTIFF_BIGTIFF when using a libTIFF 4 build.
+#ifdef CTIFF_BIGTIFF
+extern CTIFF CTIFFNewBig(const char*);
+#endif
+extern CTIFF CTIFFNewWithIO(const char *name, void *handle,
+                            const CTIFF_io_procs *procs);
+extern CTIFF CTIFFNewMemory(void);
 extern int CTIFFClose(CTIFF);
+extern int CTIFFCloseMemory(CTIFF ctiff, void **data, size_t *size);
+extern void CTIFFFreeBuffer(void *data);
 extern int CTIFFSetBasicMeta(CTIFF ctiff,
                       const char *artist,
                       const char *copyright,
@@ -66,12 +77,52 @@ extern int CTIFFSetStyle(CTIFF ctiff,
                       unsigned  int pixel_type,
                                bool in_color);
 extern int CTIFFSetRes(CTIFF ctiff, unsigned int x_res, unsigned int y_res);
+extern int CTIFFSetRowsPerStrip(CTIFF ctiff, unsigned int rows);
+extern int CTIFFSetStripBytes(CTIFF ctiff, unsigned int bytes);
+extern int CTIFFSetTileSize(CTIFF ctiff, unsigned int tile_width,
+                                        unsigned int tile_height);
+extern int CTIFFSetPredictor(CTIFF ctiff, unsigned int predictor);
+extern int CTIFFSetCompression(CTIFF ctiff, unsigned int codec, int level);
+extern int CTIFFSetMetaDepth(CTIFF ctiff, unsigned int depth);
+extern int CTIFFSetExpectedPages(CTIFF ctiff, unsigned int num_pages);
+extern int CTIFFSetDirectIO(CTIFF ctiff, bool direct);
+extern int CTIFFSetWriteQueueDepth(CTIFF ctiff, unsigned int depth);
+extern int CTIFFSetMetaDedup(CTIFF ctiff, bool dedup);
+extern int CTIFFGetMetaCacheStats(CTIFF ctiff, unsigned long *hits,
+                                               unsigned long *misses);
+extern int CTIFFGetMemoryStats(CTIFF ctiff, unsigned int *live_dirs,
+                               unsigned long long *held_bytes,
+                               unsigned long long *peak_bytes);
+extern int CTIFFSetMetaEncoding(CTIFF ctiff, unsigned int encoding);
+extern int CTIFFReadPageMeta(const char *file, unsigned int page, char **json);
+extern int CTIFFDecodeMeta(const void *cbor, unsigned int len, char **json);
+extern void CTIFFFreeMeta(char *json);
 extern int CTIFFAddNewPage(CTIFF, const void *page,
                                   const char *extended_metadata_name,
                                   const void *extended_metadata);
+extern int CTIFFAddNewPageMetaChunk(CTIFF ctiff, const char *chunk,
+                                    unsigned int len);
+extern int CTIFFAddNewPageMetaFinish(CTIFF ctiff, const void *page,
+                                     const char *ext_name);
+extern int CTIFFMetaBegin(CTIFF ctiff, const char *key);
+extern int CTIFFMetaEnd(CTIFF ctiff);
+extern int CTIFFMetaAddInt(CTIFF ctiff, const char *key, long long value);
+extern int CTIFFMetaAddDouble(CTIFF ctiff, const char *key, double value);
+extern int CTIFFMetaAddString(CTIFF ctiff, const char *key, const char *value);
+extern int CTIFFMetaAddArray(CTIFF ctiff, const char *key, const void *values,
+                             unsigned int count, unsigned int pixel_type);
 extern int CTIFFWrite(CTIFF);
 extern int CTIFFClose(CTIFF);
 extern int CTIFFWriteEvery(CTIFF ctiff, unsigned int num_pages);
 extern int CTIFFSetStrict(CTIFF ctiff, bool strict);
+extern int CTIFFSetRollover(CTIFF ctiff, unsigned long long max_bytes,
+                                         unsigned int max_pages,
+                                         unsigned int max_seconds);
+extern int CTIFFSetAsync(CTIFF ctiff, unsigned int queue_depth, int policy);
+extern int CTIFFGetNumDropped(CTIFF ctiff, unsigned int *num_dropped);
+extern int CTIFFSetCopyPages(CTIFF ctiff, bool copy_pages);
+extern int CTIFFGetPoolStats(CTIFF ctiff, unsigned long *hits,
+                                          unsigned long *misses);
+extern int CTIFFSetThreads(CTIFF ctiff, unsigned int num_threads);
 
 #endif // end CTIFF header lock
@@ -0,0 +1,320 @@
+/**
+ * @file ctiff_async.c
+ * @description Writing CTIFF files to disk from a background thread.
+ *
+ * In asynchronous mode CTIFFAddNewPage only links the new directory onto the
+ * image stack. A writer thread takes unwritten directories from behind the
+ * write pointer and writes them, so the caller never waits for compression
+ * or disk I/O unless the queue is full.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h> // malloc
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_thread.h"
+#include "ctiff_data.h"
+#include "ctiff_write.h"
+#include "ctiff_pool.h"
+
+#include "ctiff_async.h"
+
+/** State shared between the writer thread and the rest of CamTIFF.
+ *
+ *  The lock protects this structure as well as the image stack of the CTIFF
+ *  (ring, ring_size, ring_head, num_dirs and num_unwritten).
+ */
+typedef struct CTIFF_async_s {
+  CTIFF_thread  thread;
+  CTIFF_mutex   lock;
+  CTIFF_cond    added;        // Signalled on new pages or on stop.
+  CTIFF_cond    written;      // Signalled when the writer makes progress.
+  unsigned int  queue_depth;
+  int           policy;
+  unsigned int  num_dropped;
+  int           error;        // First write error, stops the writer.
+  bool          busy;         // A directory is being written.
+  bool          stop;
+} CTIFF_async;
+
+
+/** Body of the writer thread.
+ *
+ *  Writes unwritten directories in order until told to stop. Each directory
+ *  is taken out of the ring before it is written, so that its slot can be
+ *  reused and the page is no longer a candidate to be dropped while libTIFF
+ *  is using it.
+ *
+ * @param arg The CTIFF to write.
+ */
+static CTIFF_THREAD_FUNC(__CTIFFAsyncWriter, arg)
+{
+  CTIFF        ctiff = (CTIFF) arg;
+  CTIFF_async *async = ctiff->async;
+  CTIFF_dir    dir;
+  int          retval;
+
+  __CTIFFMutexLock(&async->lock);
+
+  for (;;) {
+    while (!async->stop &&
+           (ctiff->num_unwritten == 0 || async->error != CTIFFSUCCESS)){
+      __CTIFFCondWait(&async->added, &async->lock);
+    }
+
+    if (ctiff->num_unwritten == 0 || async->error != CTIFFSUCCESS) break;
+
+    dir = *__CTIFFRingFront(ctiff);
+    __CTIFFRingPop(ctiff);
+    async->busy = true;
+
+    // There is space in the queue again.
+    __CTIFFCondBroadcast(&async->written);
+    __CTIFFMutexUnlock(&async->lock);
+
+    retval = __CTIFFWriteDir(ctiff, &dir);
+
+    __CTIFFMutexLock(&async->lock);
+    __CTIFFReleaseDir(ctiff, &dir);
+    async->busy = false;
+    if (retval != CTIFFSUCCESS) async->error = retval;
+    __CTIFFCondBroadcast(&async->written);
+  }
+
+  __CTIFFMutexUnlock(&async->lock);
+  CTIFF_THREAD_RETURN;
+}
+
+/** Queue a directory for the writer thread.
+ *
+ *  If the queue is full the policy of the CTIFF decides whether to wait for
+ *  space, drop the oldest queued page, or fail.
+ * @see CTIFFSetAsync
+ *
+ * @param ctiff The CTIFF to add the directory to.
+ * @param dir   The directory, owned by the CTIFF on success.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ *              The directory is not added on failure.
+ */
+int __CTIFFAsyncAddNode(CTIFF ctiff, const CTIFF_dir *dir)
+{
+  int retval = CTIFFSUCCESS;
+  CTIFF_async *async = ctiff->async;
+
+  __CTIFFMutexLock(&async->lock);
+
+  while (async->error == CTIFFSUCCESS &&
+         ctiff->num_unwritten >= async->queue_depth){
+    if (async->policy == CTIFF_ASYNC_BLOCK){
+      __CTIFFCondWait(&async->written, &async->lock);
+    } else if (async->policy == CTIFF_ASYNC_DROP_OLDEST){
+      __CTIFFDropOldestUnwritten(ctiff);
+      async->num_dropped++;
+    } else {
+      retval = ECTIFFQUEUEFULL;
+      break;
+    }
+  }
+
+  if (retval == CTIFFSUCCESS) retval = async->error;
+
+  if (retval == CTIFFSUCCESS){
+    retval = __CTIFFRingPush(ctiff, dir, async->queue_depth);
+  }
+  if (retval == CTIFFSUCCESS) __CTIFFCondSignal(&async->added);
+
+  __CTIFFMutexUnlock(&async->lock);
+  return retval;
+}
+
+/** Wait until the writer thread has written every queued directory.
+ *
+ * @param ctiff The CTIFF to flush.
+ * @return      CTIFFSUCCESS (0) on success, or the first error the writer
+ *              thread encountered.
+ */
+int __CTIFFAsyncFlush(CTIFF ctiff)
+{
+  int retval;
+  CTIFF_async *async = ctiff->async;
+
+  if (async == NULL) return CTIFFSUCCESS;
+
+  __CTIFFMutexLock(&async->lock);
+
+  while (async->error == CTIFFSUCCESS &&
+         (ctiff->num_unwritten > 0 || async->busy)){
+    __CTIFFCondWait(&async->written, &async->lock);
+  }
+  retval = async->error;
+
+  __CTIFFMutexUnlock(&async->lock);
+  return retval;
+}
+
+/** Flush and stop the writer thread, returning the CTIFF to synchronous mode.
+ *
+ * @param ctiff The CTIFF to stop writing asynchronously.
+ * @return      CTIFFSUCCESS (0) on success, or the first error the writer
+ *              thread encountered.
+ */
+int __CTIFFAsyncStop(CTIFF ctiff)
+{
+  int retval;
+  CTIFF_async *async = ctiff->async;
+
+  if (async == NULL) return CTIFFSUCCESS;
+
+  retval = __CTIFFAsyncFlush(ctiff);
+
+  __CTIFFMutexLock(&async->lock);
+  async->stop = true;
+  __CTIFFCondSignal(&async->added);
+  __CTIFFMutexUnlock(&async->lock);
+
+  __CTIFFThreadJoin(&async->thread);
+
+  __CTIFFCondDestroy(&async->written);
+  __CTIFFCondDestroy(&async->added);
+  __CTIFFMutexDestroy(&async->lock);
+  FREE(ctiff->async);
+
+  return retval;
+}
+
+/** Lock the image stack of a CTIFF against the writer thread.
+ *
+ *  Nothing is done unless the CTIFF writes asynchronously.
+ *
+ * @param ctiff The CTIFF to lock.
+ */
+void __CTIFFAsyncLock(CTIFF ctiff)
+{
+  if (ctiff->async != NULL) __CTIFFMutexLock(&ctiff->async->lock);
+}
+
+/** Unlock the image stack of a CTIFF locked with __CTIFFAsyncLock.
+ *
+ * @param ctiff The CTIFF to unlock.
+ */
+void __CTIFFAsyncUnlock(CTIFF ctiff)
+{
+  if (ctiff->async != NULL) __CTIFFMutexUnlock(&ctiff->async->lock);
+}
+
+/** Write pages to disk from a background thread.
+ *
+ *  With asynchronous writing enabled, CTIFFAddNewPage queues each page and
+ *  returns immediately. A writer thread compresses and writes the queued
+ *  pages in order, so CTIFFWriteEvery has no effect. CTIFFWrite and
+ *  CTIFFClose wait for every queued page to be written.
+ *
+ *  At most queue_depth pages wait to be written at any time. When the queue
+ *  is full, the policy decides what CTIFFAddNewPage does:
+ *    CTIFF_ASYNC_BLOCK        Wait until the writer thread makes space.
+ *    CTIFF_ASYNC_DROP_OLDEST  Discard the oldest queued page.
+ *    CTIFF_ASYNC_ERROR        Return ECTIFFQUEUEFULL, the page is not added.
+ *
+ *  Unless CTIFFSetCopyPages is used, each page must stay allocated until it
+ *  has been written. Calling this function again changes the queue depth and
+ *  policy. A queue depth of 0 flushes the queue, stops the writer thread and
+ *  returns to writing synchronously.
+ * @see CTIFFGetNumDropped
+ *
+ * @param ctiff       The CamTIFF file to set the parameter for.
+ * @param queue_depth The maximum number of pages waiting to be written, or 0.
+ * @param policy      What to do when the queue is full.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetAsync(CTIFF ctiff, unsigned int queue_depth, int policy)
+{
+  CTIFF_async *async;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (queue_depth == 0) return __CTIFFAsyncStop(ctiff);
+
+  if (policy != CTIFF_ASYNC_BLOCK &&
+      policy != CTIFF_ASYNC_DROP_OLDEST &&
+      policy != CTIFF_ASYNC_ERROR){
+    return ECTIFFASYNCPOLICY;
+  }
+
+  // Already running, the writer picks up the new settings.
+  if ((async = ctiff->async) != NULL){
+    __CTIFFMutexLock(&async->lock);
+    async->queue_depth = queue_depth;
+    async->policy      = policy;
+    __CTIFFCondBroadcast(&async->written);
+    __CTIFFMutexUnlock(&async->lock);
+    return CTIFFSUCCESS;
+  }
+
+  async = (CTIFF_async*) malloc(sizeof(CTIFF_async));
+  if (async == NULL) return ECTIFFTHREAD;
+
+  async->queue_depth = queue_depth;
+  async->policy      = policy;
+  async->num_dropped = 0;
+  async->error       = CTIFFSUCCESS;
+  async->busy        = false;
+  async->stop        = false;
+
+  __CTIFFMutexInit(&async->lock);
+  __CTIFFCondInit(&async->added);
+  __CTIFFCondInit(&async->written);
+
+  // Pages may be written at any time from now on.
+  ctiff->strict_lock = true;
+  ctiff->async       = async;
+
+  if (__CTIFFThreadCreate(&async->thread, __CTIFFAsyncWriter, ctiff) != 0){
+    ctiff->async = NULL;
+    __CTIFFCondDestroy(&async->written);
+    __CTIFFCondDestroy(&async->added);
+    __CTIFFMutexDestroy(&async->lock);
+    FREE(async);
+    return ECTIFFTHREAD;
+  }
+
+  return CTIFFSUCCESS;
+}
+
+/** Get the number of pages dropped because the write queue was full.
+ * @see CTIFFSetAsync
+ *
+ * @param ctiff       The CamTIFF file to query.
+ * @param num_dropped Set to the number of dropped pages.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFGetNumDropped(CTIFF ctiff, unsigned int *num_dropped)
+{
+  CTIFF_async *async;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if ((async = ctiff->async) == NULL){
+    *num_dropped = 0;
+    return CTIFFSUCCESS;
+  }
+
+  __CTIFFMutexLock(&async->lock);
+  *num_dropped = async->num_dropped;
+  __CTIFFMutexUnlock(&async->lock);
+
+  return CTIFFSUCCESS;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file ctiff_async.h
+ * @description Writing CTIFF files to disk from a background thread.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_ASYNC_H
+
+#define CTIFF_ASYNC_H
+
+#include "ctiff_types.h"
+
+int CTIFFSetAsync(CTIFF ctiff, unsigned int queue_depth, int policy);
+int CTIFFGetNumDropped(CTIFF ctiff, unsigned int *num_dropped);
+
+int __CTIFFAsyncAddNode(CTIFF ctiff, const CTIFF_dir *dir);
+int __CTIFFAsyncFlush(CTIFF ctiff);
+int __CTIFFAsyncStop(CTIFF ctiff);
+void __CTIFFAsyncLock(CTIFF ctiff);
+void __CTIFFAsyncUnlock(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_ASYNC_H */
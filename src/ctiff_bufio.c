@@ -0,0 +1,869 @@
+/**
+ * @file ctiff_bufio.c
+ * @description Buffered libTIFF I/O to a file or to user callbacks.
+ *
+ * libTIFF passes each strip, tag array and directory to its write procedure
+ * separately, which for a file opened with TIFFOpen means one system call
+ * each. Here writes are collected in a large buffer instead. Writes that
+ * continue or overwrite the buffered range, such as libTIFF linking the
+ * previous directory to a new one, are made in the buffer. It is only passed
+ * on when it is full, when a write lands outside it, or when reading past it.
+ *
+ * libTIFF links each new directory by walking the chain of directories from
+ * the first, which makes writing N pages cost O(N^2) reads. The count of
+ * entries and the link of the first and of the last directory are noted as
+ * they are written, and the walk is served from them with the link of the
+ * first read as pointing straight at the last. Linking a directory then
+ * reads nothing from the file, whatever the number or size of the pages.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE   // fallocate, O_DIRECT
+#define CTIFF_HAVE_FALLOCATE
+#define CTIFF_HAVE_DIRECT
+#endif
+
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy, memset
+#include <stdio.h>  // SEEK_SET
+#include <fcntl.h>  // open
+
+#ifdef __WIN32
+#include <io.h>       // _open, _read, _write, _lseeki64, _close
+#include <sys/stat.h> // _S_IREAD, _S_IWRITE
+#define CTIFF_FD_FLAGS (_O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY)
+#define CTIFF_FD_PERMS (_S_IREAD | _S_IWRITE)
+#define CTIFF_FD_OPEN  _open
+#define CTIFF_FD_READ  _read
+#define CTIFF_FD_WRITE _write
+#define CTIFF_FD_SEEK  _lseeki64
+#define CTIFF_FD_CLOSE _close
+#else
+#include <unistd.h>   // read, write, lseek, close
+#define CTIFF_FD_FLAGS (O_RDWR | O_CREAT | O_TRUNC)
+#define CTIFF_FD_PERMS 0666
+#define CTIFF_FD_OPEN  open
+#define CTIFF_FD_READ  read
+#define CTIFF_FD_WRITE write
+#define CTIFF_FD_SEEK  lseek
+#define CTIFF_FD_CLOSE close
+#endif
+
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_writeq.h"
+
+#include "ctiff_bufio.h"
+
+/** Bytes of each entry of a classic TIFF directory. */
+#define CTIFF_DIR_ENTRY_BYTES 12
+
+/** Where a directory and its link to the next are, noted as it is written.
+ *  The count and link are kept as they are in the file.
+ */
+typedef struct CTIFF_dirlink_s {
+  toff_t dir;      // File offset of the directory, or 0 if none.
+  toff_t link;     // File offset of its link to the next directory.
+  char   count[2]; // Its count of entries.
+  char   next[4];  // Its link to the next directory.
+} CTIFF_dirlink;
+
+/** A file or callbacks, with the writes not yet passed on. */
+typedef struct CTIFF_bufio_s {
+  void           *handle;
+  CTIFF_io_procs  procs;
+  int             fd;    // The handle when writing to a file.
+  char           *buf;
+  size_t          len;   // Bytes waiting in buf.
+  size_t          cap;
+  toff_t          start; // File offset of buf[0].
+  toff_t          pos;   // Current file offset, as libTIFF sees it.
+  toff_t          size;  // Size of the file, including the buffer.
+  bool            error; // Set if passing on writes failed when closing.
+  toff_t          expected;  // Expected size of the file, 0 if unknown.
+  toff_t          allocated; // End of the space reserved for the file.
+  int             direct_fd; // The file opened for direct I/O, or -1.
+  CTIFF_writeq   *queue;     // Writes in flight, or NULL to write in turn.
+  unsigned int    depth;     // The most writes the queue keeps in flight.
+  toff_t          dir_mark;  // Where the next directory goes, or 0.
+  bool            swab;      // Set if the file is not in host byte order.
+  CTIFF_dirlink   first;     // The first directory written.
+  CTIFF_dirlink   last;      // The last directory written.
+} CTIFF_bufio;
+
+
+/*
+ * File descriptors
+ */
+
+static long long __CTIFFFdRead(void *handle, void *data, size_t size)
+{
+  return CTIFF_FD_READ(*(int*) handle, data, size);
+}
+
+static long long __CTIFFFdWrite(void *handle, const void *data, size_t size)
+{
+  return CTIFF_FD_WRITE(*(int*) handle, data, size);
+}
+
+static long long __CTIFFFdSeek(void *handle, long long offset, int whence)
+{
+  return CTIFF_FD_SEEK(*(int*) handle, offset, whence);
+}
+
+static long long __CTIFFFdSize(void *handle)
+{
+  return CTIFF_FD_SEEK(*(int*) handle, 0, SEEK_END);
+}
+
+static int __CTIFFFdClose(void *handle)
+{
+  return CTIFF_FD_CLOSE(*(int*) handle);
+}
+
+static const CTIFF_io_procs __CTIFFFdProcs = {
+  __CTIFFFdRead, __CTIFFFdWrite, __CTIFFFdSeek, __CTIFFFdSize, __CTIFFFdClose
+};
+
+
+/*
+ * Buffering
+ */
+
+/** Reserve space for the file ahead of a write.
+ *
+ *  When the size of the file is expected, space is reserved up to it in
+ *  extents of CTIFF_PREALLOC_BYTES, a step ahead of the writes, so the file
+ *  system can lay the file out in one piece rather than finding blocks for
+ *  every write. The size of the file is not changed, so a file left behind
+ *  by a crash has no trailing zeros. Space not used is given back when the
+ *  file is closed. Nothing is done for callbacks, or where the file system
+ *  cannot reserve space.
+ *
+ * @param io  The buffered I/O.
+ * @param end The end of the next write.
+ */
+static void __CTIFFBufReserve(CTIFF_bufio *io, toff_t end)
+{
+#ifdef CTIFF_HAVE_FALLOCATE
+  toff_t target;
+
+  if (io->fd < 0 || end <= io->allocated || io->allocated >= io->expected){
+    return;
+  }
+
+  target = end + CTIFF_PREALLOC_BYTES;
+  if (target > io->expected) target = io->expected;
+  if (target < end) target = end;
+
+  // Not supported by the file system, so do not try again.
+  if (fallocate(io->fd, FALLOC_FL_KEEP_SIZE, (off_t) io->allocated,
+                (off_t) (target - io->allocated)) != 0){
+    io->expected = 0;
+    return;
+  }
+
+  io->allocated = target;
+#else
+  (void) io; (void) end;
+#endif
+}
+
+/** Wait for the queued writes overlapping a range of the file.
+ *
+ * @param io     The buffered I/O.
+ * @param offset The start of the range.
+ * @param len    The length of the range, (size_t) -1 for the whole file.
+ * @return       0 on success, -1 if a queued write failed.
+ */
+static int __CTIFFBufWait(CTIFF_bufio *io, toff_t offset, size_t len)
+{
+  if (io->queue == NULL) return 0;
+
+#ifdef __WIN32
+  // Queued writes move the file pointer, so none may be in flight.
+  len = (size_t) -1;
+#endif
+
+  return __CTIFFWriteQueueWait(io->queue, (unsigned long long) offset, len);
+}
+
+/** Write bytes at an offset of the file or callbacks.
+ *
+ * @param io     The buffered I/O.
+ * @param offset Where to write.
+ * @param data   The bytes.
+ * @param len    The number of bytes.
+ * @return       0 on success, -1 on failure.
+ */
+static int __CTIFFBufPass(CTIFF_bufio *io, toff_t offset,
+                          const char *data, size_t len)
+{
+  long long written;
+
+  if (__CTIFFBufWait(io, offset, len) != 0) return -1;
+
+  __CTIFFBufReserve(io, offset + len);
+
+#ifndef __WIN32
+  // Files are written in place, without a seek before every write.
+  if (io->fd >= 0) return __CTIFFWriteAt(io->fd, data, len, offset);
+#endif
+
+  if (io->procs.seek(io->handle, (long long) offset, SEEK_SET) < 0) return -1;
+
+  while (len > 0){
+    if ((written = io->procs.write(io->handle, data, len)) <= 0) return -1;
+    data += written;
+    len  -= (size_t) written;
+  }
+
+  return 0;
+}
+
+/** Pass on the whole blocks of the buffer with direct I/O.
+ *
+ *  Direct I/O bypasses the page cache, but only writes whole blocks from
+ *  aligned memory to aligned offsets. Bytes before the first block boundary
+ *  of the buffer are written as usual, and the buffer moved down so that it
+ *  starts at the boundary. Bytes after the last boundary stay buffered.
+ *
+ * @param io The buffered I/O, with direct_fd open.
+ * @return   0 on success, -1 on failure.
+ */
+static int __CTIFFBufFlushDirect(CTIFF_bufio *io)
+{
+#ifdef CTIFF_HAVE_DIRECT
+  size_t head = (size_t) ((CTIFF_DIRECT_ALIGN -
+                           io->start % CTIFF_DIRECT_ALIGN) % CTIFF_DIRECT_ALIGN);
+  size_t body;
+  ssize_t written;
+  char *old;
+
+  if (head > io->len) head = io->len;
+  if (head > 0){
+    if (__CTIFFBufPass(io, io->start, io->buf, head) != 0) return -1;
+    memmove(io->buf, io->buf + head, io->len - head);
+    io->start += head;
+    io->len   -= head;
+  }
+
+  body = io->len - io->len % CTIFF_DIRECT_ALIGN;
+  if (body == 0) return 0;
+
+  __CTIFFBufReserve(io, io->start + body);
+
+  if (io->queue != NULL){
+    // The queue writes the blocks from the old buffer, and the bytes after
+    // them move to the start of the new one.
+    old = io->buf;
+    if (__CTIFFWriteQueueSubmit(io->queue, io->direct_fd, &io->buf, body,
+                                io->start) != 0){
+      return -1;
+    }
+    memcpy(io->buf, old + body, io->len - body);
+  } else {
+    written = pwrite(io->direct_fd, io->buf, body, (off_t) io->start);
+    if (written != (ssize_t) body) return -1;
+
+    memmove(io->buf, io->buf + body, io->len - body);
+  }
+
+  io->start += body;
+  io->len   -= body;
+#else
+  (void) io;
+#endif
+  return 0;
+}
+
+/** Pass on the buffered writes.
+ *
+ *  With a queue, the buffer is handed to it and the writes may still be in
+ *  flight on return.
+ *
+ * @param io The buffered I/O.
+ * @return   0 on success, -1 on failure, in which case the writes stay
+ *           buffered.
+ */
+static int __CTIFFBufFlush(CTIFF_bufio *io)
+{
+  if (io->direct_fd >= 0 && __CTIFFBufFlushDirect(io) != 0) return -1;
+
+  if (io->len == 0) return 0;
+
+  if (io->queue != NULL && io->direct_fd < 0){
+    __CTIFFBufReserve(io, io->start + io->len);
+    if (__CTIFFWriteQueueSubmit(io->queue, io->fd, &io->buf, io->len,
+                                io->start) != 0){
+      return -1;
+    }
+  } else if (__CTIFFBufPass(io, io->start, io->buf, io->len) != 0){
+    return -1;
+  }
+
+  io->len = 0;
+  return 0;
+}
+
+/** Add an append to the buffer, passing it on as the buffer fills.
+ *
+ *  Used for direct I/O and queued writes, which are only passed on from the
+ *  buffer.
+ *
+ * @param io   The buffered I/O.
+ * @param data The bytes.
+ * @param len  The number of bytes.
+ * @return     0 on success, -1 on failure.
+ */
+static int __CTIFFBufStage(CTIFF_bufio *io, const char *data, size_t len)
+{
+  size_t n;
+
+  while (len > 0){
+    n = io->cap - io->len;
+    if (n > len) n = len;
+
+    memcpy(io->buf + io->len, data, n);
+    io->len += n;
+    data    += n;
+    len     -= n;
+
+    if (io->len < io->cap) continue;
+
+    if (io->direct_fd >= 0){
+      if (__CTIFFBufFlushDirect(io) != 0) return -1;
+    } else {
+      if (__CTIFFBufFlush(io) != 0) return -1;
+      io->start += io->cap;
+    }
+  }
+
+  return 0;
+}
+
+/** Copy a write to the link of a directory where the two overlap.
+ *
+ * @param link The directory.
+ * @param pos  Where the write is.
+ * @param data The bytes written.
+ * @param len  The number of bytes.
+ */
+static void __CTIFFBufLinkUpdate(CTIFF_dirlink *link, toff_t pos,
+                                 const char *data, size_t len)
+{
+  toff_t from = (pos > link->link) ? pos : link->link;
+  toff_t to   = pos + len;
+
+  if (link->dir == 0) return;
+  if (to > link->link + sizeof(link->next)){
+    to = link->link + sizeof(link->next);
+  }
+  if (from >= to) return;
+
+  memcpy(link->next + (from - link->link), data + (from - pos),
+         (size_t) (to - from));
+}
+
+/** Note the count and link of a directory as libTIFF writes it.
+ *
+ *  The directory libTIFF is writing starts with its count of entries, at
+ *  the offset noted by __CTIFFBufMarkDir. From the count follows where its
+ *  link is, whose value is noted from every write to it. Nothing depends on
+ *  the write still being buffered when the next directory is linked.
+ * @see __CTIFFBufReadDir
+ *
+ * @param io   The buffered I/O.
+ * @param pos  Where the write is.
+ * @param data The bytes written.
+ * @param len  The number of bytes.
+ */
+static void __CTIFFBufNoteDir(CTIFF_bufio *io, toff_t pos,
+                              const char *data, size_t len)
+{
+  uint16 count;
+
+  if (io->dir_mark != 0 && pos == io->dir_mark && len >= sizeof(count)){
+    memcpy(&count, data, sizeof(count));
+    memcpy(io->last.count, data, sizeof(count));
+    if (io->swab) TIFFSwabShort(&count);
+
+    io->last.dir  = pos;
+    io->last.link = pos + sizeof(count) + count*CTIFF_DIR_ENTRY_BYTES;
+    memset(io->last.next, 0, sizeof(io->last.next));
+    if (io->first.dir == 0) io->first = io->last;
+    io->dir_mark = 0;
+  }
+
+  __CTIFFBufLinkUpdate(&io->first, pos, data, len);
+  __CTIFFBufLinkUpdate(&io->last,  pos, data, len);
+}
+
+/** Check whether a range of the file overlaps the buffered range.
+ *
+ * @param io  The buffered I/O.
+ * @param pos The start of the range.
+ * @param len The length of the range.
+ * @return    true if any byte of the range is buffered.
+ */
+static bool __CTIFFBufOverlaps(CTIFF_bufio *io, toff_t pos, size_t len)
+{
+  return io->len > 0 && pos < io->start + io->len && pos + len > io->start;
+}
+
+/** Serve libTIFF's walk of the chain of directories from the noted ones.
+ *
+ *  Only the counts and links of the first and last directories are served,
+ *  with the link of the first read as pointing at the last. The walk to
+ *  link the next directory is then two steps, and reads nothing.
+ * @see __CTIFFBufNoteDir
+ *
+ * @param io   The buffered I/O.
+ * @param data Set to the bytes read.
+ * @param size The number of bytes to read.
+ * @return     true if the read was served.
+ */
+static bool __CTIFFBufReadDir(CTIFF_bufio *io, tdata_t data, tsize_t size)
+{
+  CTIFF_dirlink *dir = &io->first;
+  uint32 link;
+
+  if (io->first.dir == 0) return false;
+
+  if (io->pos == io->last.dir || io->pos == io->last.link) dir = &io->last;
+
+  if (io->pos == dir->dir && size == sizeof(dir->count)){
+    memcpy(data, dir->count, sizeof(dir->count));
+  } else if (io->pos == dir->link && size == sizeof(dir->next)){
+    if (dir == &io->first && io->last.dir != io->first.dir){
+      link = (uint32) io->last.dir;
+      if (io->swab) TIFFSwabLong(&link);
+      memcpy(data, &link, sizeof(link));
+    } else {
+      memcpy(data, dir->next, sizeof(dir->next));
+    }
+  } else {
+    return false;
+  }
+
+  io->pos += size;
+  return true;
+}
+
+static tsize_t __CTIFFBufRead(thandle_t fd, tdata_t data, tsize_t size)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) fd;
+  long long got;
+
+  // Walks of the chain of directories, when linking the next.
+  if (__CTIFFBufReadDir(io, data, size)) return size;
+
+  // Reads of buffered bytes, such as the directory libTIFF is linking.
+  if (io->pos >= io->start && io->pos + size <= io->start + io->len){
+    memcpy(data, io->buf + (io->pos - io->start), (size_t) size);
+    io->pos += size;
+    return size;
+  }
+
+  // Bytes before the buffer have already been passed on.
+  if (__CTIFFBufOverlaps(io, io->pos, (size_t) size) &&
+      __CTIFFBufFlush(io) != 0){
+    return -1;
+  }
+
+  if (__CTIFFBufWait(io, io->pos, (size_t) size) != 0) return -1;
+
+#ifndef __WIN32
+  if (io->fd >= 0){
+    got = pread(io->fd, data, (size_t) size, (off_t) io->pos);
+  } else
+#endif
+  {
+    if (io->procs.seek(io->handle, (long long) io->pos, SEEK_SET) < 0){
+      return -1;
+    }
+    got = io->procs.read(io->handle, data, (size_t) size);
+  }
+  if (got < 0) return -1;
+
+  io->pos += (toff_t) got;
+  return (tsize_t) got;
+}
+
+static tsize_t __CTIFFBufWrite(thandle_t fd, tdata_t data, tsize_t size)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) fd;
+  size_t len = (size_t) size;
+  toff_t end;
+  size_t off;
+
+  if (io->len == 0) io->start = io->pos;
+  end = io->start + io->len;
+
+  __CTIFFBufNoteDir(io, io->pos, (const char*) data, len);
+
+  if (io->pos >= io->start && (io->pos <= end || end == io->size) &&
+      (io->pos - io->start) + len <= io->cap){
+    // Continues or overwrites the buffer. A gap past the end of the file,
+    // such as libTIFF aligning a directory, reads back as zeros.
+    off = (size_t) (io->pos - io->start);
+    if (off > io->len) memset(io->buf + io->len, 0, off - io->len);
+    memcpy(io->buf + off, data, len);
+    if (off + len > io->len) io->len = off + len;
+
+  } else if (!__CTIFFBufOverlaps(io, io->pos, len) && io->pos < end){
+    // Earlier in the file, such as linking the last directory written
+    // before the buffer started, so the buffer can be kept.
+    if (__CTIFFBufPass(io, io->pos, (const char*) data, len) != 0) return -1;
+
+  } else if ((io->direct_fd >= 0 || io->queue != NULL) && io->pos == end){
+    // Appends too long for the buffer, such as strips, are passed on as
+    // the buffer fills.
+    if (__CTIFFBufStage(io, (const char*) data, len) != 0) return -1;
+
+  } else {
+    if (__CTIFFBufFlush(io) != 0) return -1;
+
+    if (io->direct_fd >= 0 || io->queue != NULL){
+      io->start = io->pos;
+      if (__CTIFFBufStage(io, (const char*) data, len) != 0) return -1;
+    } else if (len >= io->cap){
+      if (__CTIFFBufPass(io, io->pos, (const char*) data, len) != 0) return -1;
+    } else {
+      memcpy(io->buf, data, len);
+      io->start = io->pos;
+      io->len   = len;
+    }
+  }
+
+  io->pos += size;
+  if (io->pos > io->size) io->size = io->pos;
+
+  return size;
+}
+
+static toff_t __CTIFFBufSeek(thandle_t fd, toff_t off, int whence)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) fd;
+
+  switch (whence) {
+    case SEEK_SET: io->pos  = off;            break;
+    case SEEK_CUR: io->pos += off;            break;
+    case SEEK_END: io->pos  = io->size + off; break;
+    default:       return (toff_t) -1;
+  }
+
+  return io->pos;
+}
+
+static int __CTIFFBufCloseProc(thandle_t fd)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) fd;
+
+  if (__CTIFFBufFlush(io) != 0) io->error = true;
+
+  if (__CTIFFBufWait(io, 0, (size_t) -1) != 0) io->error = true;
+  __CTIFFWriteQueueFree(io->queue);
+  io->queue = NULL;
+
+#ifdef CTIFF_HAVE_FALLOCATE
+  // Give back reserved space that was not written.
+  if (io->allocated > io->size) (void) ftruncate(io->fd, (off_t) io->size);
+#endif
+
+  if (io->direct_fd >= 0 && CTIFF_FD_CLOSE(io->direct_fd) != 0){
+    io->error = true;
+  }
+
+  if (io->procs.close != NULL && io->procs.close(io->handle) != 0){
+    io->error = true;
+  }
+
+  return io->error ? -1 : 0;
+}
+
+static toff_t __CTIFFBufSize(thandle_t fd)
+{
+  return ((CTIFF_bufio*) fd)->size;
+}
+
+static int __CTIFFBufMap(thandle_t fd, tdata_t* pbase, toff_t* psize)
+{
+  (void) fd; (void) pbase; (void) psize;
+  return 0;
+}
+
+static void __CTIFFBufUnmap(thandle_t fd, tdata_t base, toff_t size)
+{
+  (void) fd; (void) base; (void) size;
+}
+
+/** Open a TIFF on buffered I/O.
+ *
+ * @param io   The I/O, with its handle and callbacks set.
+ * @param name The name of the file, for libTIFF's messages.
+ * @param mode The libTIFF open mode.
+ * @param cap  The size of the buffer, 0 to pass every write on at once.
+ * @return     The TIFF, or NULL on failure. The handle is not closed on
+ *             failure.
+ */
+static TIFF* __CTIFFBufOpen(CTIFF_bufio *io, const char *name,
+                            const char *mode, size_t cap)
+{
+  long long size = io->procs.size(io->handle);
+  TIFF *tiff;
+
+  io->buf = NULL;
+  if (cap > 0 && (io->buf = (char*) malloc(cap)) == NULL) return NULL;
+
+  io->len   = 0;
+  io->cap   = cap;
+  io->start = 0;
+  io->pos   = 0;
+  io->size  = (size > 0) ? (toff_t) size : 0;
+  io->error = false;
+  io->expected  = 0;
+  io->allocated = 0;
+  io->direct_fd = -1;
+  io->queue     = NULL;
+  io->depth     = 0;
+  io->dir_mark  = 0;
+  io->swab      = false;
+  memset(&io->first, 0, sizeof(io->first));
+  memset(&io->last,  0, sizeof(io->last));
+
+  tiff = TIFFClientOpen(name, mode, (thandle_t) io,
+                        __CTIFFBufRead, __CTIFFBufWrite,
+                        __CTIFFBufSeek, __CTIFFBufCloseProc,
+                        __CTIFFBufSize,
+                        __CTIFFBufMap, __CTIFFBufUnmap);
+
+  if (tiff == NULL) FREE(io->buf);
+  return tiff;
+}
+
+/** Open a TIFF file for writing, with its writes buffered.
+ *
+ *  Used in place of TIFFOpen, which passes every write straight to the
+ *  file. The file is created, or truncated if it exists.
+ *
+ * @param name The file to write.
+ * @param mode The libTIFF open mode.
+ * @return     The TIFF, or NULL on failure. Close with __CTIFFBufClose.
+ */
+TIFF* __CTIFFFileOpen(const char *name, const char *mode)
+{
+  CTIFF_bufio *io;
+  TIFF *tiff;
+
+  if ((io = (CTIFF_bufio*) malloc(sizeof(CTIFF_bufio))) == NULL) return NULL;
+
+  if ((io->fd = CTIFF_FD_OPEN(name, CTIFF_FD_FLAGS, CTIFF_FD_PERMS)) < 0){
+    FREE(io);
+    return NULL;
+  }
+
+  io->handle = &io->fd;
+  io->procs  = __CTIFFFdProcs;
+
+  if ((tiff = __CTIFFBufOpen(io, name, mode, CTIFF_IO_BUFFER_BYTES)) == NULL){
+    CTIFF_FD_CLOSE(io->fd);
+    FREE(io);
+  }
+
+  return tiff;
+}
+
+/** Open a TIFF for writing through user callbacks, with its writes buffered.
+ *
+ *  Callbacks that write to memory gain nothing from a buffer, and are given
+ *  a size of 0 so that each write is passed on without being copied.
+ * @see CTIFFNewWithIO
+ *
+ * @param name   The name of the file, for libTIFF's messages.
+ * @param mode   The libTIFF open mode.
+ * @param handle Passed to each callback.
+ * @param procs  The callbacks.
+ * @param cap    The size of the buffer, usually CTIFF_IO_BUFFER_BYTES.
+ * @return       The TIFF, or NULL on failure, in which case the handle is not
+ *               closed. Close with __CTIFFBufClose.
+ */
+TIFF* __CTIFFClientOpen(const char *name, const char *mode, void *handle,
+                        const CTIFF_io_procs *procs, size_t cap)
+{
+  CTIFF_bufio *io;
+  TIFF *tiff;
+
+  if (procs->read == NULL || procs->write == NULL ||
+      procs->seek == NULL || procs->size  == NULL){
+    return NULL;
+  }
+
+  if ((io = (CTIFF_bufio*) malloc(sizeof(CTIFF_bufio))) == NULL) return NULL;
+
+  io->handle = handle;
+  io->procs  = *procs;
+  io->fd     = -1;
+
+  if ((tiff = __CTIFFBufOpen(io, name, mode, cap)) == NULL) FREE(io);
+
+  return tiff;
+}
+
+/** Set the size a TIFF opened with buffered I/O is expected to reach.
+ * @see CTIFFSetExpectedPages
+ *
+ * @param tiff  The TIFF.
+ * @param bytes The expected size of the file, 0 if unknown.
+ */
+void __CTIFFBufExpect(TIFF *tiff, unsigned long long bytes)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) TIFFClientdata(tiff);
+
+  io->expected = (toff_t) bytes;
+  if ((unsigned long long) io->expected != bytes) io->expected = (toff_t) -1;
+}
+
+/** Write the image data of a TIFF file with direct I/O, or stop doing so.
+ *
+ *  The file is opened a second time for direct I/O, which whole blocks of
+ *  the buffer are written through. Directories, and anything else libTIFF
+ *  writes outside of the buffer, still go through the page cache.
+ * @see CTIFFSetDirectIO
+ *
+ * @param tiff   A TIFF opened with __CTIFFFileOpen.
+ * @param direct Whether to use direct I/O.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFBufDirect(TIFF *tiff, bool direct)
+{
+#ifdef CTIFF_HAVE_DIRECT
+  CTIFF_bufio *io = (CTIFF_bufio*) TIFFClientdata(tiff);
+  void *buf;
+
+  if (io->fd < 0) return ECTIFFNOFILE;
+
+  if (!direct){
+    if (__CTIFFBufWait(io, 0, (size_t) -1) != 0) return ECTIFFWRITE;
+    if (io->direct_fd >= 0 && CTIFF_FD_CLOSE(io->direct_fd) != 0){
+      io->direct_fd = -1;
+      return ECTIFFWRITE;
+    }
+    io->direct_fd = -1;
+    return CTIFFSUCCESS;
+  }
+
+  if (io->direct_fd >= 0) return CTIFFSUCCESS;
+
+  // Direct I/O needs the buffer on a block boundary.
+  if (posix_memalign(&buf, CTIFF_DIRECT_ALIGN, CTIFF_DIRECT_BUFFER_BYTES) != 0){
+    return ECTIFFMEMORY;
+  }
+
+  // Unsupported by some file systems, such as tmpfs.
+  io->direct_fd = open(TIFFFileName(tiff), O_WRONLY | O_DIRECT);
+  if (io->direct_fd < 0){
+    free(buf);
+    return ECTIFFDIRECTIO;
+  }
+
+  memcpy(buf, io->buf, io->len);
+  FREE(io->buf);
+  io->buf = (char*) buf;
+  io->cap = CTIFF_DIRECT_BUFFER_BYTES;
+
+  // The buffers of the queue are exchanged with this one, so must match.
+  if (io->queue != NULL) return __CTIFFBufQueue(tiff, io->depth);
+
+  return CTIFFSUCCESS;
+#else
+  (void) tiff;
+  return direct ? ECTIFFDIRECTIO : CTIFFSUCCESS;
+#endif
+}
+
+/** Keep writes of a TIFF file in flight, or write them in turn.
+ *
+ *  Each time the buffer fills, it is handed to a queue of writer threads,
+ *  and filling carries on in another. Before libTIFF reads or rewrites part
+ *  of the file, such as the directory it is linking, the queued writes to
+ *  that part are waited for.
+ * @see CTIFFSetWriteQueueDepth
+ *
+ * @param tiff  A TIFF opened with __CTIFFFileOpen.
+ * @param depth The most writes to keep in flight, 0 to write in turn.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFBufQueue(TIFF *tiff, unsigned int depth)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) TIFFClientdata(tiff);
+  int retval = CTIFFSUCCESS;
+
+  if (io->fd < 0) return ECTIFFNOFILE;
+
+  if (__CTIFFBufWait(io, 0, (size_t) -1) != 0) retval = ECTIFFWRITE;
+  __CTIFFWriteQueueFree(io->queue);
+  io->queue = NULL;
+  io->depth = 0;
+
+  if (retval != CTIFFSUCCESS || depth == 0) return retval;
+
+  retval = __CTIFFWriteQueueNew(&io->queue, depth, io->cap,
+                                (io->direct_fd >= 0) ? CTIFF_DIRECT_ALIGN : 0);
+  if (retval == CTIFFSUCCESS) io->depth = depth;
+
+  return retval;
+}
+
+/** Note that libTIFF is about to write a directory.
+ *
+ *  libTIFF places each new directory at the end of the file, on a word
+ *  boundary, so its count and link can be noted as they are written.
+ * @see __CTIFFBufNoteDir
+ *
+ * @param tiff The TIFF.
+ */
+void __CTIFFBufMarkDir(TIFF *tiff)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) TIFFClientdata(tiff);
+
+#ifdef TIFF_VERSION_BIG  // Only defined by libTIFF 4.0+
+  // BigTIFF directories are laid out differently, and are walked as usual.
+  if (TIFFIsBigTIFF(tiff)) return;
+#endif
+
+  io->dir_mark = (io->size + 1) & ~((toff_t) 1);
+  io->swab     = (TIFFIsByteSwapped(tiff) != 0);
+}
+
+/** Close a TIFF opened with buffered I/O, passing on what is buffered.
+ *
+ * @param tiff The TIFF to close.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFBufClose(TIFF *tiff)
+{
+  CTIFF_bufio *io = (CTIFF_bufio*) TIFFClientdata(tiff);
+  bool error;
+
+  TIFFClose(tiff);
+
+  error = io->error;
+  FREE(io->buf);
+  FREE(io);
+
+  return error ? ECTIFFWRITE : CTIFFSUCCESS;
+}
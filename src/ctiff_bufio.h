@@ -0,0 +1,48 @@
+/**
+ * @file ctiff_bufio.h
+ * @description Buffered libTIFF I/O to a file or to user callbacks.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_BUFIO_H
+
+#define CTIFF_BUFIO_H
+
+#include <tiffio.h>  // libTIFF (preferably 3.9.5+)
+
+#include "ctiff_types.h"
+
+/** Bytes of writes collected before they are passed on. */
+#define CTIFF_IO_BUFFER_BYTES (1024*1024)
+
+/** Block size that direct I/O writes are aligned to. */
+#define CTIFF_DIRECT_ALIGN 4096
+
+/** Bytes of writes collected before they are passed on with direct I/O. */
+#define CTIFF_DIRECT_BUFFER_BYTES (8*1024*1024)
+
+/** Bytes reserved at a time for a file of expected size. */
+#define CTIFF_PREALLOC_BYTES (64*1024*1024)
+
+TIFF* __CTIFFFileOpen(const char *name, const char *mode);
+TIFF* __CTIFFClientOpen(const char *name, const char *mode, void *handle,
+                        const CTIFF_io_procs *procs, size_t cap);
+void __CTIFFBufExpect(TIFF *tiff, unsigned long long bytes);
+int __CTIFFBufDirect(TIFF *tiff, bool direct);
+int __CTIFFBufQueue(TIFF *tiff, unsigned int depth);
+void __CTIFFBufMarkDir(TIFF *tiff);
+int __CTIFFBufClose(TIFF *tiff);
+
+#endif /* end of include guard: CTIFF_BUFIO_H */
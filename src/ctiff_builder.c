@@ -0,0 +1,469 @@
+/**
+ * @file ctiff_builder.c
+ * @description Building page metadata from values instead of JSON text.
+ *
+ * Metadata built with CTIFFMetaBegin, the CTIFFMetaAdd functions and
+ * CTIFFMetaEnd is written as minified JSON straight into a buffer kept by
+ * the CTIFF. It is valid by construction, so unlike metadata passed as text
+ * it is neither formatted by the caller nor parsed again to be validated.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>  // malloc
+#include <string.h>  // strlen
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_meta.h"
+
+#include "ctiff_builder.h"
+
+/** The metadata of the next page, as it is built.
+ *
+ *  The buffer is kept between pages, so building the metadata of every page
+ *  only allocates once the buffer has grown to the largest size.
+ */
+typedef struct CTIFF_meta_builder_s {
+  char         *buf;
+  size_t        len;
+  size_t        cap;
+  unsigned int  depth;     // Objects open, including the outermost.
+  bool          complete;  // The outermost object is closed.
+} CTIFF_meta_builder;
+
+/** The most characters a number takes, including a NUL. */
+#define CTIFF_NUM_SIZE 32
+
+
+/** Read a character from UTF-8.
+ *
+ * @param str The character, moved past it.
+ * @return    The code point, or U+FFFD if the byte does not start a valid
+ *            character.
+ */
+static long __CTIFFReadUTF8(const unsigned char **str)
+{
+  const unsigned char *pt = *str;
+  int extra, i;
+  long code;
+
+  if      (pt[0] >= 0xC2 && pt[0] <= 0xDF) { extra = 1; code = pt[0] & 0x1F; }
+  else if (pt[0] >= 0xE0 && pt[0] <= 0xEF) { extra = 2; code = pt[0] & 0x0F; }
+  else if (pt[0] >= 0xF0 && pt[0] <= 0xF4) { extra = 3; code = pt[0] & 0x07; }
+  else { *str = pt + 1; return 0xFFFD; }
+
+  // A NUL is not a continuation byte, so this stops at the end.
+  for (i = 1; i <= extra; i++) {
+    if ((pt[i] & 0xC0) != 0x80){ *str = pt + 1; return 0xFFFD; }
+    code = (code << 6) | (pt[i] & 0x3F);
+  }
+
+  // Overlong forms, surrogates and code points past Unicode.
+  if ((extra == 2 && code < 0x800) || (extra == 3 && code < 0x10000) ||
+      (code >= 0xD800 && code < 0xE000) || code > 0x10FFFF){
+    *str = pt + 1;
+    return 0xFFFD;
+  }
+
+  *str = pt + 1 + extra;
+  return code;
+}
+
+/** Write a \u escape. */
+static char* __CTIFFBuildEscape(char *pt, long code)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  *pt++ = '\\';
+  *pt++ = 'u';
+  *pt++ = hex[(code >> 12) & 0x0F];
+  *pt++ = hex[(code >> 8) & 0x0F];
+  *pt++ = hex[(code >> 4) & 0x0F];
+  *pt++ = hex[code & 0x0F];
+  return pt;
+}
+
+/** Write a string as a JSON string, escaping where needed.
+ *
+ *  Control characters, DEL and characters outside ASCII are written as \u
+ *  escapes, since strict mode only accepts printable ASCII metadata.
+ *
+ * @param builder The builder to append to.
+ * @param str     The NUL terminated UTF-8 string.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFBuildString(CTIFF_meta_builder *builder, const char *str)
+{
+  const unsigned char *in = (const unsigned char*) str;
+  size_t len = strlen(str);
+  long code;
+  char *pt;
+  int retval;
+
+  // At worst each byte becomes a six character \u escape.
+  retval = __CTIFFReserve(&builder->buf, &builder->cap,
+                          builder->len + 6*len + 2);
+  if (retval != CTIFFSUCCESS) return retval;
+
+  pt = builder->buf + builder->len;
+  *pt++ = '"';
+
+  while (*in != '\0') {
+    if (*in == '"' || *in == '\\'){
+      *pt++ = '\\';
+      *pt++ = (char) *in++;
+    } else if (*in < 0x20 || *in == 0x7F){
+      pt = __CTIFFBuildEscape(pt, *in++);
+    } else if (*in < 0x80){
+      *pt++ = (char) *in++;
+    } else if ((code = __CTIFFReadUTF8(&in)) < 0x10000){
+      pt = __CTIFFBuildEscape(pt, code);
+    } else {
+      code -= 0x10000;
+      pt = __CTIFFBuildEscape(pt, 0xD800 + (code >> 10));
+      pt = __CTIFFBuildEscape(pt, 0xDC00 + (code & 0x3FF));
+    }
+  }
+
+  *pt++ = '"';
+  builder->len = pt - builder->buf;
+  return CTIFFSUCCESS;
+}
+
+/** Start a member of the open object: the comma and key.
+ *
+ * @param ctiff The CTIFF whose metadata is being built.
+ * @param key   The key of the member.
+ * @param size  Characters to reserve for the value.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFBuildKey(CTIFF ctiff, const char *key, size_t size)
+{
+  CTIFF_meta_builder *builder = ctiff->meta_builder;
+  int retval;
+
+  if (key == NULL) return ECTIFFNULL;
+  if (builder == NULL || builder->depth == 0) return ECTIFFMETABUILD;
+
+  if (builder->buf[builder->len - 1] != '{'){
+    retval = __CTIFFReserve(&builder->buf, &builder->cap, builder->len + 1);
+    if (retval != CTIFFSUCCESS) return retval;
+    builder->buf[builder->len++] = ',';
+  }
+
+  if ((retval = __CTIFFBuildString(builder, key)) != CTIFFSUCCESS){
+    return retval;
+  }
+
+  retval = __CTIFFReserve(&builder->buf, &builder->cap,
+                          builder->len + 1 + size);
+  if (retval != CTIFFSUCCESS) return retval;
+
+  builder->buf[builder->len++] = ':';
+  return CTIFFSUCCESS;
+}
+
+
+/** Start building the metadata of the next page, or an object within it.
+ *
+ *  With a NULL key, starts the metadata of the next page, which is a JSON
+ *  object. With a key, starts an object with that key within the object
+ *  being built. Each object is closed with CTIFFMetaEnd, and once the
+ *  outermost is closed the page is added with CTIFFAddNewPageMetaFinish.
+ *
+ *  For example, {"exposure":0.01,"stage":{"x":12,"y":-3}} is built with
+ *
+ *    CTIFFMetaBegin(ctiff, NULL);
+ *    CTIFFMetaAddDouble(ctiff, "exposure", 0.01);
+ *    CTIFFMetaBegin(ctiff, "stage");
+ *    CTIFFMetaAddInt(ctiff, "x", 12);
+ *    CTIFFMetaAddInt(ctiff, "y", -3);
+ *    CTIFFMetaEnd(ctiff);
+ *    CTIFFMetaEnd(ctiff);
+ *    CTIFFAddNewPageMetaFinish(ctiff, page, "acquisition");
+ *
+ *  Objects can be nested as deeply as CTIFFSetMetaDepth allows. Keys are
+ *  not checked for duplicates.
+ * @see CTIFFMetaEnd
+ * @see CTIFFAddNewPageMetaFinish
+ *
+ * @param ctiff The CTIFF the page will be added to.
+ * @param key   NULL for the page's metadata, or the key of the object.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFMetaBegin(CTIFF ctiff, const char *key)
+{
+  CTIFF_meta_builder *builder;
+  int retval;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (ctiff->meta_builder == NULL){
+    builder = (CTIFF_meta_builder*) calloc(1, sizeof(CTIFF_meta_builder));
+    if (builder == NULL) return ECTIFFMEMORY;
+    ctiff->meta_builder = builder;
+  }
+  builder = ctiff->meta_builder;
+
+  if ((key == NULL) != (builder->depth == 0)) return ECTIFFMETABUILD;
+
+  // The JSON checker counts the document itself as a level too.
+  if (builder->depth + 1 >= ctiff->meta_depth) return ECTIFFMETADEPTH;
+
+  if (key == NULL){
+    retval = __CTIFFReserve(&builder->buf, &builder->cap, 1);
+    builder->len      = 0;
+    builder->complete = false;
+  } else {
+    retval = __CTIFFBuildKey(ctiff, key, 1);
+  }
+  if (retval != CTIFFSUCCESS) return retval;
+
+  builder->buf[builder->len++] = '{';
+  builder->depth++;
+  return CTIFFSUCCESS;
+}
+
+/** Close the object last started with CTIFFMetaBegin.
+ * @see CTIFFMetaBegin
+ *
+ * @param ctiff The CTIFF whose metadata is being built.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFMetaEnd(CTIFF ctiff)
+{
+  CTIFF_meta_builder *builder;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  builder = ctiff->meta_builder;
+  if (builder == NULL || builder->depth == 0) return ECTIFFMETABUILD;
+
+  if (__CTIFFReserve(&builder->buf, &builder->cap,
+                     builder->len + 1) != CTIFFSUCCESS){
+    return ECTIFFMEMORY;
+  }
+
+  builder->buf[builder->len++] = '}';
+  if (--builder->depth == 0) builder->complete = true;
+
+  return CTIFFSUCCESS;
+}
+
+/** Add an integer to the object being built.
+ *
+ * @param ctiff The CTIFF whose metadata is being built.
+ * @param key   The key of the value.
+ * @param value The value.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFMetaAddInt(CTIFF ctiff, const char *key, long long value)
+{
+  CTIFF_meta_builder *builder;
+  int retval;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+  if ((retval = __CTIFFBuildKey(ctiff, key, CTIFF_NUM_SIZE)) != CTIFFSUCCESS){
+    return retval;
+  }
+
+  builder = ctiff->meta_builder;
+  builder->len += __CTIFFPrintInt(builder->buf + builder->len, value);
+  return CTIFFSUCCESS;
+}
+
+/** Add a number to the object being built.
+ *
+ *  The number is written with as few digits as read back the same double.
+ *  Infinities and NaN, which JSON cannot hold, are written as null.
+ *
+ * @param ctiff The CTIFF whose metadata is being built.
+ * @param key   The key of the value.
+ * @param value The value.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFMetaAddDouble(CTIFF ctiff, const char *key, double value)
+{
+  CTIFF_meta_builder *builder;
+  int retval;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+  if ((retval = __CTIFFBuildKey(ctiff, key, CTIFF_NUM_SIZE)) != CTIFFSUCCESS){
+    return retval;
+  }
+
+  builder = ctiff->meta_builder;
+  builder->len += __CTIFFPrintDouble(builder->buf + builder->len, value,
+                                     false);
+  return CTIFFSUCCESS;
+}
+
+/** Add a string to the object being built.
+ *
+ *  The string should be UTF-8. Quotes, backslashes, control characters and
+ *  characters outside printable ASCII are escaped, and bytes that are not
+ *  UTF-8 are written as U+FFFD.
+ *
+ * @param ctiff The CTIFF whose metadata is being built.
+ * @param key   The key of the value.
+ * @param value The NUL terminated value.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFMetaAddString(CTIFF ctiff, const char *key, const char *value)
+{
+  int retval;
+
+  if (ctiff == NULL || value == NULL) return ECTIFFNULL;
+  if ((retval = __CTIFFBuildKey(ctiff, key, 0)) != CTIFFSUCCESS){
+    return retval;
+  }
+
+  return __CTIFFBuildString(ctiff->meta_builder, value);
+}
+
+/** Add an array of numbers to the object being built.
+ *
+ *  The type of the numbers is given as a CamTIFF pixel type, so that, for
+ *  example, a line of a page can be added as it is. Floats are written as
+ *  by CTIFFMetaAddDouble, single precision floats with as few digits as
+ *  read back the same float.
+ * @see CTIFFMetaAddDouble
+ *
+ * @param ctiff      The CTIFF whose metadata is being built.
+ * @param key        The key of the array.
+ * @param values     The numbers.
+ * @param count      The number of numbers.
+ * @param pixel_type The type of the numbers, from pixel_type_e.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFMetaAddArray(CTIFF ctiff, const char *key, const void *values,
+                      unsigned int count, unsigned int pixel_type)
+{
+  CTIFF_meta_builder *builder;
+  unsigned int i;
+  char *pt;
+  int retval;
+
+  if (ctiff == NULL || (values == NULL && count != 0)) return ECTIFFNULL;
+
+  switch (pixel_type) {
+    case CTIFF_PIXEL_UINT8:  case CTIFF_PIXEL_INT8:
+    case CTIFF_PIXEL_UINT16: case CTIFF_PIXEL_INT16:
+    case CTIFF_PIXEL_UINT32: case CTIFF_PIXEL_INT32:
+    case CTIFF_PIXEL_FLOAT32: case CTIFF_PIXEL_FLOAT64:
+      break;
+    default:
+      return ECTIFFPIXELTYPE;
+  }
+
+  if (ctiff->meta_builder != NULL &&
+      ctiff->meta_builder->depth + 1 >= ctiff->meta_depth){
+    return ECTIFFMETADEPTH;
+  }
+
+  if ((unsigned long long) count * (CTIFF_NUM_SIZE + 1) + 2 > (size_t) -1){
+    return ECTIFFMEMORY;
+  }
+
+  // The brackets, and each number with a comma.
+  retval = __CTIFFBuildKey(ctiff, key,
+                           2 + (size_t) count * (CTIFF_NUM_SIZE + 1));
+  if (retval != CTIFFSUCCESS) return retval;
+
+  builder = ctiff->meta_builder;
+  pt = builder->buf + builder->len;
+  *pt++ = '[';
+
+  for (i = 0; i < count; i++) {
+    if (i > 0) *pt++ = ',';
+
+    switch (pixel_type) {
+      case CTIFF_PIXEL_UINT8:
+        pt += __CTIFFPrintInt(pt, ((const unsigned char*) values)[i]);
+        break;
+      case CTIFF_PIXEL_INT8:
+        pt += __CTIFFPrintInt(pt, ((const signed char*) values)[i]);
+        break;
+      case CTIFF_PIXEL_UINT16:
+        pt += __CTIFFPrintInt(pt, ((const unsigned short*) values)[i]);
+        break;
+      case CTIFF_PIXEL_INT16:
+        pt += __CTIFFPrintInt(pt, ((const short*) values)[i]);
+        break;
+      case CTIFF_PIXEL_UINT32:
+        pt += __CTIFFPrintInt(pt, ((const unsigned int*) values)[i]);
+        break;
+      case CTIFF_PIXEL_INT32:
+        pt += __CTIFFPrintInt(pt, ((const int*) values)[i]);
+        break;
+      case CTIFF_PIXEL_FLOAT32:
+        pt += __CTIFFPrintDouble(pt, ((const float*) values)[i], true);
+        break;
+      case CTIFF_PIXEL_FLOAT64:
+        pt += __CTIFFPrintDouble(pt, ((const double*) values)[i], false);
+        break;
+    }
+  }
+
+  *pt++ = ']';
+  builder->len = pt - builder->buf;
+  return CTIFFSUCCESS;
+}
+
+/** Whether the metadata of the next page is being built.
+ *
+ * @param ctiff The CTIFF the page will be added to.
+ * @return      ECTIFFMETABUILD if objects are still open, CTIFFSUCCESS (0)
+ *              otherwise.
+ */
+int __CTIFFMetaBuilding(CTIFF ctiff)
+{
+  if (ctiff->meta_builder != NULL && ctiff->meta_builder->depth != 0){
+    return ECTIFFMETABUILD;
+  }
+
+  return CTIFFSUCCESS;
+}
+
+/** Take the built metadata of the next page and add the CTIFF header.
+ *
+ * @param ctiff The CTIFF the page is added to.
+ * @param name  The key of the metadata.
+ * @param built Set to whether metadata was built for the page.
+ * @return      JSON string, to be freed by the caller.
+ */
+const char* __CTIFFMetaBuildFinish(CTIFF ctiff, const char *name, bool *built)
+{
+  CTIFF_meta_builder *builder = ctiff->meta_builder;
+
+  *built = (builder != NULL && builder->complete);
+  if (!*built) return NULL;
+
+  builder->complete = false;
+  return __CTIFFWrapExtMeta(ctiff->strict, name, builder->buf, builder->len);
+}
+
+/** Free the metadata builder of a CTIFF.
+ *
+ * @param ctiff The CTIFF whose builder to free.
+ */
+void __CTIFFFreeMetaBuilder(CTIFF ctiff)
+{
+  if (ctiff->meta_builder == NULL) return;
+
+  FREE(ctiff->meta_builder->buf);
+  FREE(ctiff->meta_builder);
+}
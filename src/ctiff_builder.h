@@ -0,0 +1,37 @@
+/**
+ * @file ctiff_builder.h
+ * @description Building page metadata from values instead of JSON text.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_BUILDER_H
+
+#define CTIFF_BUILDER_H
+
+#include "ctiff_types.h"
+
+int CTIFFMetaBegin(CTIFF ctiff, const char *key);
+int CTIFFMetaEnd(CTIFF ctiff);
+int CTIFFMetaAddInt(CTIFF ctiff, const char *key, long long value);
+int CTIFFMetaAddDouble(CTIFF ctiff, const char *key, double value);
+int CTIFFMetaAddString(CTIFF ctiff, const char *key, const char *value);
+int CTIFFMetaAddArray(CTIFF ctiff, const char *key, const void *values,
+                      unsigned int count, unsigned int pixel_type);
+
+int __CTIFFMetaBuilding(CTIFF ctiff);
+const char* __CTIFFMetaBuildFinish(CTIFF ctiff, const char *name, bool *built);
+void __CTIFFFreeMetaBuilder(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_BUILDER_H */
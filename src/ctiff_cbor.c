@@ -0,0 +1,817 @@
+/**
+ * @file ctiff_cbor.c
+ * @description Storing page metadata as CBOR instead of JSON text.
+ *
+ * With CTIFFSetMetaEncoding(ctiff, CTIFF_META_CBOR) the validated metadata is
+ * transcoded to CBOR (RFC 7049) when the page is written, and stored in the
+ * private tag CTIFFTAG_CBORMETA instead of TIFFTAG_XMLPACKET. Numbers are
+ * stored in binary, and readers do not need to parse text. CTIFFReadPageMeta
+ * and CTIFFDecodeMeta turn the CBOR back into JSON.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>   // sprintf
+#include <stdlib.h>  // malloc, strtod
+#include <string.h>  // memcpy
+#include <tiffio.h>  // libTIFF (preferably 3.9.5+)
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_meta.h"
+#include "ctiff_write.h"
+#include "ctiff_dedup.h"
+
+#include "ctiff_cbor.h"
+
+/** The buffer metadata is transcoded into, reused between pages. */
+typedef struct CTIFF_cbor_s {
+  char   *buf;
+  size_t  len;
+  size_t  cap;
+} CTIFF_cbor;
+
+/** CBOR major types (the top three bits of the initial byte). */
+#define CBOR_UINT   0
+#define CBOR_NINT   1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+#define CBOR_INDEFINITE 31   // Additional information for unknown lengths.
+#define CBOR_FALSE      0xF4
+#define CBOR_TRUE       0xF5
+#define CBOR_NULL       0xF6
+#define CBOR_FLOAT32    0xFA
+#define CBOR_FLOAT64    0xFB
+#define CBOR_BREAK      0xFF
+
+static TIFFExtendProc __CTIFFParentExtender = NULL;
+static bool           __CTIFFExtenderSet    = false;
+
+/** Register the CamTIFF tags for each file libTIFF opens. */
+static void __CTIFFTagExtender(TIFF *tiff)
+{
+  __CTIFFRegisterTags(tiff);
+  if (__CTIFFParentExtender != NULL) __CTIFFParentExtender(tiff);
+}
+
+/** Register the CamTIFF tags before files are opened for reading.
+ *
+ *  libTIFF reads the first directory on opening, and would otherwise warn
+ *  about the unknown tag.
+ */
+static void __CTIFFSetTagExtender(void)
+{
+  if (__CTIFFExtenderSet) return;
+
+  __CTIFFExtenderSet    = true;
+  __CTIFFParentExtender = TIFFSetTagExtender(__CTIFFTagExtender);
+}
+
+
+/*
+ * Encoding
+ */
+
+static int __CTIFFCborPut(CTIFF_cbor *cbor, const void *bytes, size_t len)
+{
+  int retval = __CTIFFReserve(&cbor->buf, &cbor->cap, cbor->len + len);
+  if (retval != CTIFFSUCCESS) return retval;
+
+  memcpy(cbor->buf + cbor->len, bytes, len);
+  cbor->len += len;
+  return CTIFFSUCCESS;
+}
+
+static int __CTIFFCborByte(CTIFF_cbor *cbor, unsigned char byte)
+{
+  return __CTIFFCborPut(cbor, &byte, 1);
+}
+
+/** Write the initial bytes of an item: its major type and argument. */
+static int __CTIFFCborHead(CTIFF_cbor *cbor, unsigned char major,
+                           unsigned long long val)
+{
+  unsigned char head[9];
+  size_t len, i;
+
+  if      (val < 24)          { head[0] = (unsigned char) val; len = 1; }
+  else if (val <= 0xFF)       { head[0] = 24; len = 2; }
+  else if (val <= 0xFFFF)     { head[0] = 25; len = 3; }
+  else if (val <= 0xFFFFFFFF) { head[0] = 26; len = 5; }
+  else                        { head[0] = 27; len = 9; }
+
+  head[0] |= major << 5;
+  for (i = len - 1; i > 0; i--, val >>= 8) head[i] = val & 0xFF;
+
+  return __CTIFFCborPut(cbor, head, len);
+}
+
+static int __CTIFFHexDigit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/** Read the four hex digits of a \\u escape, or -1 if they are not. */
+static long __CTIFFHex4(const char *pt)
+{
+  long code = 0;
+  int i, digit;
+
+  for (i = 0; i < 4; i++) {
+    if ((digit = __CTIFFHexDigit(pt[i])) < 0) return -1;
+    code = (code << 4) | digit;
+  }
+
+  return code;
+}
+
+/** Transcode a JSON string to a CBOR text string.
+ *
+ *  Escapes are decoded into UTF-8, which is never longer than the escape.
+ *  The text is decoded past room for the largest head, then moved down
+ *  once the head is written.
+ *
+ * @param cbor The buffer to append to.
+ * @param pt   The opening quote.
+ * @return     The character after the closing quote, or NULL if invalid.
+ */
+static const char* __CTIFFCborString(CTIFF_cbor *cbor, const char *pt)
+{
+  const char *end;
+  size_t start = cbor->len, n = 0;
+  long code, low;
+  char *out;
+
+  for (end = pt + 1; *end != '"'; end++) {
+    if (*end == '\0') return NULL;
+    if (*end == '\\' && *++end == '\0') return NULL;
+  }
+
+  if (__CTIFFReserve(&cbor->buf, &cbor->cap,
+                     start + 9 + (end - pt)) != CTIFFSUCCESS){
+    return NULL;
+  }
+  out = cbor->buf + start + 9;
+
+  for (pt++; pt < end; pt++) {
+    if (*pt != '\\'){
+      out[n++] = *pt;
+      continue;
+    }
+
+    switch (*++pt) {
+      case '"': case '\\': case '/': out[n++] = *pt; break;
+      case 'b': out[n++] = '\b'; break;
+      case 'f': out[n++] = '\f'; break;
+      case 'n': out[n++] = '\n'; break;
+      case 'r': out[n++] = '\r'; break;
+      case 't': out[n++] = '\t'; break;
+      case 'u':
+        if ((code = __CTIFFHex4(pt + 1)) < 0) return NULL;
+        pt += 4;
+
+        // Combine a surrogate pair into one code point.
+        if (code >= 0xD800 && code < 0xDC00 && pt[1] == '\\' &&
+            pt[2] == 'u' && (low = __CTIFFHex4(pt + 3)) >= 0xDC00 &&
+            low < 0xE000){
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          pt += 6;
+        }
+
+        // Text must be UTF-8, which has no surrogates.
+        if (code >= 0xD800 && code < 0xE000) code = 0xFFFD;
+
+        if (code < 0x80){
+          out[n++] = (char) code;
+        } else if (code < 0x800){
+          out[n++] = (char) (0xC0 | (code >> 6));
+          out[n++] = (char) (0x80 | (code & 0x3F));
+        } else if (code < 0x10000){
+          out[n++] = (char) (0xE0 | (code >> 12));
+          out[n++] = (char) (0x80 | ((code >> 6) & 0x3F));
+          out[n++] = (char) (0x80 | (code & 0x3F));
+        } else {
+          out[n++] = (char) (0xF0 | (code >> 18));
+          out[n++] = (char) (0x80 | ((code >> 12) & 0x3F));
+          out[n++] = (char) (0x80 | ((code >> 6) & 0x3F));
+          out[n++] = (char) (0x80 | (code & 0x3F));
+        }
+        break;
+      default:
+        return NULL;
+    }
+  }
+
+  // The head is at most 9 bytes, so it cannot overwrite the text.
+  if (__CTIFFCborHead(cbor, CBOR_TEXT, n) != CTIFFSUCCESS) return NULL;
+  memmove(cbor->buf + cbor->len, cbor->buf + start + 9, n);
+  cbor->len += n;
+
+  return end + 1;
+}
+
+/** Transcode a JSON number to a CBOR integer or float.
+ *
+ *  Numbers without a fraction or exponent that fit 64 bits become integers.
+ *  Other numbers become single precision floats if that is exact, and
+ *  double precision floats otherwise.
+ *
+ * @param cbor The buffer to append to.
+ * @param pt   The first character of the number.
+ * @return     The character after the number, or NULL if invalid.
+ */
+static const char* __CTIFFCborNumber(CTIFF_cbor *cbor, const char *pt)
+{
+  const char *start = pt;
+  unsigned long long val = 0;
+  bool negative, integer = true;
+  unsigned char bytes[9];
+  unsigned long long bits;
+  unsigned int bits32, digit;
+  double d;
+  float f;
+  int i;
+
+  if ((negative = (*pt == '-'))) pt++;
+  if (*pt < '0' || *pt > '9') return NULL;
+
+  if (*pt == '0'){
+    pt++;
+  } else {
+    for (; *pt >= '0' && *pt <= '9'; pt++) {
+      digit = *pt - '0';
+      if (val > (~0ULL - digit) / 10) integer = false;
+      val = 10*val + digit;
+    }
+  }
+
+  if (*pt == '.'){
+    integer = false;
+    if (*++pt < '0' || *pt > '9') return NULL;
+    while (*pt >= '0' && *pt <= '9') pt++;
+  }
+
+  if (*pt == 'e' || *pt == 'E'){
+    integer = false;
+    if (*++pt == '+' || *pt == '-') pt++;
+    if (*pt < '0' || *pt > '9') return NULL;
+    while (*pt >= '0' && *pt <= '9') pt++;
+  }
+
+  if (integer){
+    if (!negative || val == 0){
+      if (__CTIFFCborHead(cbor, CBOR_UINT, val) != CTIFFSUCCESS) return NULL;
+    } else {
+      if (__CTIFFCborHead(cbor, CBOR_NINT, val-1) != CTIFFSUCCESS) return NULL;
+    }
+    return pt;
+  }
+
+  d = strtod(start, NULL);
+  f = (float) d;
+
+  if ((double) f == d){
+    memcpy(&bits32, &f, 4);
+    bytes[0] = CBOR_FLOAT32;
+    for (i = 4; i > 0; i--, bits32 >>= 8) bytes[i] = bits32 & 0xFF;
+    if (__CTIFFCborPut(cbor, bytes, 5) != CTIFFSUCCESS) return NULL;
+  } else {
+    memcpy(&bits, &d, 8);
+    bytes[0] = CBOR_FLOAT64;
+    for (i = 8; i > 0; i--, bits >>= 8) bytes[i] = bits & 0xFF;
+    if (__CTIFFCborPut(cbor, bytes, 9) != CTIFFSUCCESS) return NULL;
+  }
+
+  return pt;
+}
+
+/** Transcode valid, minified JSON to CBOR.
+ *
+ *  Objects and arrays are written with indefinite lengths, so every JSON
+ *  token maps directly to CBOR and no nesting needs to be tracked. The JSON
+ *  must already be valid; anything unexpected is still rejected safely.
+ *
+ * @param cbor The buffer to fill.
+ * @param json The metadata.
+ * @return     CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFEncodeCbor(CTIFF_cbor *cbor, const char *json)
+{
+  const char *pt = json;
+  int retval = CTIFFSUCCESS;
+
+  cbor->len = 0;
+
+  while (*pt != '\0' && retval == CTIFFSUCCESS) {
+    switch (*pt) {
+      case '{': retval = __CTIFFCborByte(cbor, 0xA0 | CBOR_INDEFINITE); pt++;
+                break;
+      case '[': retval = __CTIFFCborByte(cbor, 0x80 | CBOR_INDEFINITE); pt++;
+                break;
+      case '}':
+      case ']': retval = __CTIFFCborByte(cbor, CBOR_BREAK); pt++; break;
+      case ':':
+      case ',': pt++; break;
+      case '"':
+        pt = __CTIFFCborString(cbor, pt);
+        if (pt == NULL) return ECTIFFINVALIDEXTMETA;
+        break;
+      case 't':
+        if (strncmp(pt, "true", 4) != 0) return ECTIFFINVALIDEXTMETA;
+        retval = __CTIFFCborByte(cbor, CBOR_TRUE); pt += 4;
+        break;
+      case 'f':
+        if (strncmp(pt, "false", 5) != 0) return ECTIFFINVALIDEXTMETA;
+        retval = __CTIFFCborByte(cbor, CBOR_FALSE); pt += 5;
+        break;
+      case 'n':
+        if (strncmp(pt, "null", 4) != 0) return ECTIFFINVALIDEXTMETA;
+        retval = __CTIFFCborByte(cbor, CBOR_NULL); pt += 4;
+        break;
+      default:
+        pt = __CTIFFCborNumber(cbor, pt);
+        if (pt == NULL) return ECTIFFINVALIDEXTMETA;
+    }
+  }
+
+  return retval;
+}
+
+/** Write a page's metadata as CBOR, if the file uses CBOR.
+ *
+ *  Metadata that is not valid JSON (only kept when not strict) cannot be
+ *  transcoded, and is left for the caller to write as text.
+ *
+ * @param ctiff The CamTIFF file being written.
+ * @param json  The metadata, as it would be written to TIFFTAG_XMLPACKET.
+ * @param tiff  The file to set the tag in.
+ * @return      True if the metadata was set as CBOR.
+ */
+bool __CTIFFWriteCborMeta(CTIFF ctiff, const char *json, TIFF *tiff)
+{
+  CTIFF_cbor *cbor = ctiff->cbor;
+
+  if (cbor == NULL) return false;
+  if (!ctiff->strict && !__CTIFFIsValidJSON(json)) return false;
+  if (__CTIFFEncodeCbor(cbor, json) != CTIFFSUCCESS) return false;
+
+  __CTIFFRegisterTags(tiff);
+  return TIFFSetField(tiff, CTIFFTAG_CBORMETA, (uint32) cbor->len,
+                      cbor->buf) == 1;
+}
+
+
+/*
+ * Decoding
+ */
+
+/** A CBOR array or map being decoded. */
+typedef struct CTIFF_cbor_nest_s {
+  bool               map;
+  bool               indefinite;
+  unsigned long long remaining; // Items left, counting keys and values,
+                                // or 1 until the break if indefinite.
+  unsigned long long index;     // Items decoded so far.
+} CTIFF_cbor_nest;
+
+/** JSON text being built from CBOR. */
+typedef struct CTIFF_json_out_s {
+  char   *buf;
+  size_t  len;
+  size_t  cap;
+} CTIFF_json_out;
+
+static int __CTIFFJSONPut(CTIFF_json_out *out, const char *str, size_t len)
+{
+  int retval = __CTIFFReserve(&out->buf, &out->cap, out->len + len + 1);
+  if (retval != CTIFFSUCCESS) return retval;
+
+  memcpy(out->buf + out->len, str, len);
+  out->len += len;
+  out->buf[out->len] = '\0';
+  return CTIFFSUCCESS;
+}
+
+/** Write text into a JSON string, escaping quotes and control characters.
+ *
+ *  The surrounding quotes are left to the caller.
+ */
+static int __CTIFFJSONEscape(CTIFF_json_out *out, const unsigned char *text,
+                             size_t len)
+{
+  char escape[7];
+  size_t i, run;
+  int retval;
+
+  for (i = 0; i < len; i += run) {
+    for (run = 0; i + run < len && text[i+run] >= 0x20 &&
+                  text[i+run] != '"' && text[i+run] != '\\'; run++);
+
+    if (run > 0){
+      retval = __CTIFFJSONPut(out, (const char*) text + i, run);
+    } else {
+      if (text[i] == '"' || text[i] == '\\'){
+        escape[0] = '\\'; escape[1] = (char) text[i];
+        retval = __CTIFFJSONPut(out, escape, 2);
+      } else {
+        sprintf(escape, "\\u%04x", text[i]);
+        retval = __CTIFFJSONPut(out, escape, 6);
+      }
+      run = 1;
+    }
+    if (retval != CTIFFSUCCESS) return retval;
+  }
+
+  return CTIFFSUCCESS;
+}
+
+/** Write a float as a JSON number.
+ *
+ *  Single precision floats are only written for values they hold exactly,
+ *  so all floats are written as doubles, which is how JSON is read.
+ */
+static int __CTIFFJSONFloat(CTIFF_json_out *out, double d)
+{
+  char num[32];
+
+  return __CTIFFJSONPut(out, num, __CTIFFPrintDouble(num, d, false));
+}
+
+/** Decode a half precision float by widening it to single precision. */
+static double __CTIFFHalf(unsigned int half)
+{
+  unsigned int exp  = (half >> 10) & 0x1F;
+  unsigned int mant = half & 0x3FF;
+  unsigned int bits32;
+  float f;
+
+  if (exp == 0){
+    // Subnormal: mant * 2^-24, exact in a double.
+    return ((half & 0x8000) ? -1.0 : 1.0) * mant * 5.9604644775390625e-08;
+  }
+
+  bits32 = ((half & 0x8000) << 16) | (mant << 13) |
+           ((exp == 31) ? 0x7F800000 : (exp - 15 + 127) << 23);
+  memcpy(&f, &bits32, 4);
+  return f;
+}
+
+/** Decode CBOR metadata to JSON text.
+ *
+ *  Any well formed CBOR that has a JSON equivalent is accepted, not only
+ *  what CamTIFF writes: definite and indefinite lengths, tags (which are
+ *  ignored) and half, single and double precision floats. Byte strings and
+ *  map keys that are not text are rejected.
+ *
+ * @param cbor The CBOR data.
+ * @param len  The length of the data in bytes.
+ * @param json Set to the JSON text, to be freed with CTIFFFreeMeta.
+ * @return     CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFDecodeMeta(const void *cbor, unsigned int len, char **json)
+{
+  const unsigned char *data = (const unsigned char*) cbor;
+  CTIFF_json_out out = { NULL, 0, 0 };
+  CTIFF_cbor_nest *nest = NULL, *new_nest, *top;
+  size_t depth = 0, nest_cap = 0, pos = 0, arg_len, i;
+  unsigned long long val;
+  unsigned char initial, major, info;
+  unsigned int bits32;
+  unsigned long long bits;
+  char num[24];
+  float f;
+  double d;
+  int retval = CTIFFSUCCESS;
+
+  if (json == NULL) return ECTIFFNULL;
+  *json = NULL;
+  if (cbor == NULL) return ECTIFFNULL;
+
+#define CBOR_FAIL(err) do { retval = (err); goto done; } while (0)
+#define CBOR_EMIT(str, n) \
+  do { if ((retval = __CTIFFJSONPut(&out, (str), (n))) != CTIFFSUCCESS) \
+         goto done; } while (0)
+
+  for (;;) {
+    // Close finished containers and write the separator before the item.
+    if (depth > 0){
+      top = &nest[depth-1];
+
+      if (pos < len && top->indefinite && data[pos] == CBOR_BREAK){
+        pos++;
+        if (top->map && top->index % 2 != 0) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+        top->remaining = 0;
+      }
+
+      if (top->remaining == 0){
+        CBOR_EMIT(top->map ? "}" : "]", 1);
+        if (--depth == 0) break;
+        continue;
+      }
+
+      if (pos >= len) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+      if (top->map && top->index % 2 == 0 && (data[pos] >> 5) != CBOR_TEXT){
+        CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+      }
+
+      if (top->index > 0){
+        CBOR_EMIT((top->map && top->index % 2 != 0) ? ":" : ",", 1);
+      }
+      top->index++;
+      if (!top->indefinite) top->remaining--;
+    }
+
+    // Read the item's initial byte and argument, skipping any tags.
+    do {
+      if (pos >= len) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+      initial = data[pos++];
+      major   = initial >> 5;
+      info    = initial & 0x1F;
+
+      if (info < 24){
+        val = info;
+      } else if (info <= 27){
+        arg_len = (size_t) 1 << (info - 24);
+        if (len - pos < arg_len) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+        for (val = 0, i = 0; i < arg_len; i++) val = (val << 8) | data[pos++];
+      } else if (info == CBOR_INDEFINITE && major >= CBOR_BYTES &&
+                 major <= CBOR_MAP){
+        val = 0;
+      } else {
+        CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+      }
+    } while (major == CBOR_TAG);
+
+    switch (major) {
+      case CBOR_UINT:
+        sprintf(num, "%llu", val);
+        CBOR_EMIT(num, strlen(num));
+        break;
+      case CBOR_NINT:
+        if (val == ~0ULL){
+          CBOR_EMIT("-18446744073709551616", 21);
+        } else {
+          sprintf(num, "-%llu", val + 1);
+          CBOR_EMIT(num, strlen(num));
+        }
+        break;
+      case CBOR_TEXT:
+        if (info != CBOR_INDEFINITE){
+          if (len - pos < val) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+          CBOR_EMIT("\"", 1);
+          retval = __CTIFFJSONEscape(&out, data + pos, (size_t) val);
+          if (retval != CTIFFSUCCESS) goto done;
+          CBOR_EMIT("\"", 1);
+          pos += (size_t) val;
+          break;
+        }
+
+        // Join the chunks of an indefinite length string.
+        CBOR_EMIT("\"", 1);
+        for (;;) {
+          if (pos >= len) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+          if (data[pos] == CBOR_BREAK){ pos++; break; }
+          if ((data[pos] >> 5) != CBOR_TEXT || (data[pos] & 0x1F) > 27){
+            CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+          }
+          info = data[pos++] & 0x1F;
+          if (info < 24){
+            val = info;
+          } else {
+            arg_len = (size_t) 1 << (info - 24);
+            if (len - pos < arg_len) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+            for (val = 0, i = 0; i < arg_len; i++) val = (val<<8) | data[pos++];
+          }
+          if (len - pos < val) CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+
+          retval = __CTIFFJSONEscape(&out, data + pos, (size_t) val);
+          if (retval != CTIFFSUCCESS) goto done;
+          pos += (size_t) val;
+        }
+        CBOR_EMIT("\"", 1);
+        break;
+      case CBOR_ARRAY:
+      case CBOR_MAP:
+        // Each item takes at least a byte, which bounds definite lengths.
+        if (info != CBOR_INDEFINITE && val > len - pos) {
+          CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+        }
+
+        if (depth == nest_cap){
+          nest_cap = (nest_cap != 0) ? 2*nest_cap : 16;
+          new_nest = (CTIFF_cbor_nest*) realloc(nest,
+                                         nest_cap * sizeof(CTIFF_cbor_nest));
+          if (new_nest == NULL) CBOR_FAIL(ECTIFFMEMORY);
+          nest = new_nest;
+        }
+
+        top = &nest[depth++];
+        top->map        = (major == CBOR_MAP);
+        top->indefinite = (info == CBOR_INDEFINITE);
+        top->remaining  = top->indefinite ? 1 : top->map ? 2*val : val;
+        top->index      = 0;
+        CBOR_EMIT(top->map ? "{" : "[", 1);
+        continue;
+      case CBOR_SIMPLE:
+        switch (info) {
+          case CBOR_FALSE & 0x1F: CBOR_EMIT("false", 5); break;
+          case CBOR_TRUE  & 0x1F: CBOR_EMIT("true", 4);  break;
+          case CBOR_NULL  & 0x1F:
+          case 23:                CBOR_EMIT("null", 4);  break; // undefined
+          case 25:
+            retval = __CTIFFJSONFloat(&out, __CTIFFHalf((unsigned int) val));
+            break;
+          case CBOR_FLOAT32 & 0x1F:
+            bits32 = (unsigned int) val;
+            memcpy(&f, &bits32, 4);
+            retval = __CTIFFJSONFloat(&out, f);
+            break;
+          case CBOR_FLOAT64 & 0x1F:
+            bits = val;
+            memcpy(&d, &bits, 8);
+            retval = __CTIFFJSONFloat(&out, d);
+            break;
+          default:
+            CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+        }
+        if (retval != CTIFFSUCCESS) goto done;
+        break;
+      default:
+        CBOR_FAIL(ECTIFFINVALIDEXTMETA);
+    }
+
+    if (depth == 0) break;
+  }
+
+  if (pos != len) retval = ECTIFFINVALIDEXTMETA;
+
+done:
+#undef CBOR_FAIL
+#undef CBOR_EMIT
+  free(nest);
+
+  if (retval != CTIFFSUCCESS){
+    free(out.buf);
+    return retval;
+  }
+
+  *json = out.buf;
+  return CTIFFSUCCESS;
+}
+
+/** Read the metadata of a directory of a TIFF file as JSON, as stored.
+ *
+ * @param tiff The TIFF file to read.
+ * @param page The directory to read the metadata of, from 0.
+ * @param json Set to the JSON text, to be freed with free.
+ * @return     CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFReadDirMeta(TIFF *tiff, unsigned int page, char **json)
+{
+  uint32 len;
+  void *data;
+
+  if (TIFFSetDirectory(tiff, (tdir_t) page) != 1) return ECTIFFREADMETA;
+
+  if (TIFFGetField(tiff, CTIFFTAG_CBORMETA, &len, &data) == 1){
+    return CTIFFDecodeMeta(data, len, json);
+  }
+
+  if (TIFFGetField(tiff, TIFFTAG_XMLPACKET, &len, &data) != 1){
+    return ECTIFFREADMETA;
+  }
+
+  if ((*json = (char*) malloc(len + 1)) == NULL) return ECTIFFMEMORY;
+  memcpy(*json, data, len);
+  (*json)[len] = '\0';
+  return CTIFFSUCCESS;
+}
+
+/** Read the metadata of a page of a TIFF file as JSON.
+ *
+ *  CBOR metadata is decoded to JSON, and JSON metadata in TIFFTAG_XMLPACKET
+ *  is returned as is, so readers need not know how the file was written.
+ *  Metadata shared with an earlier page, as described for
+ *  CTIFFSetMetaDedup, is merged with the earlier page's, so the page's
+ *  full metadata is returned either way.
+ * @see CTIFFDecodeMeta
+ *
+ * @param file The TIFF file to read.
+ * @param page The page to read the metadata of, from 0.
+ * @param json Set to the JSON text, to be freed with CTIFFFreeMeta.
+ * @return     CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFReadPageMeta(const char *file, unsigned int page, char **json)
+{
+  TIFF *tiff;
+  unsigned int base_page;
+  char *base = NULL, *stored;
+  int retval;
+
+  if (json == NULL) return ECTIFFNULL;
+  *json = NULL;
+  if (file == NULL) return ECTIFFNULL;
+
+  __CTIFFSetTagExtender();
+  if ((tiff = TIFFOpen(file, "r")) == NULL) return ECTIFFOPEN;
+
+  retval = __CTIFFReadDirMeta(tiff, page, json);
+
+  // Bases are earlier pages of the same file.
+  if (retval == CTIFFSUCCESS && __CTIFFDedupBaseOf(*json, &base_page)){
+    stored = *json;
+    *json  = NULL;
+
+    if (base_page >= page){
+      retval = ECTIFFREADMETA;
+    } else if ((retval = __CTIFFReadDirMeta(tiff, base_page, &base)) ==
+               CTIFFSUCCESS){
+      retval = __CTIFFDedupMerge(base, stored, json);
+    }
+
+    free(base);
+    free(stored);
+  }
+
+  TIFFClose(tiff);
+  return retval;
+}
+
+/** Free metadata returned by CTIFFReadPageMeta or CTIFFDecodeMeta.
+ *
+ * @param json The metadata to free.
+ */
+void CTIFFFreeMeta(char *json)
+{
+  free(json);
+}
+
+/** Free the CBOR buffer of a CTIFF file.
+ *
+ * @param ctiff The CTIFF file being freed.
+ */
+void __CTIFFFreeCbor(CTIFF ctiff)
+{
+  if (ctiff->cbor == NULL) return;
+
+  FREE(ctiff->cbor->buf);
+  FREE(ctiff->cbor);
+}
+
+/** Set how page metadata is stored.
+ *
+ *  CTIFF_META_JSON (the default) stores metadata as JSON text in
+ *  TIFFTAG_XMLPACKET, which any TIFF reader can show. CTIFF_META_CBOR
+ *  stores it as CBOR in CTIFFTAG_CBORMETA, which is smaller when the
+ *  metadata holds many numbers and quicker to read, but needs a CBOR
+ *  decoder such as CTIFFReadPageMeta. Metadata that is not valid JSON is
+ *  always stored as text.
+ *
+ *  The encoding can only be changed before the first page is added.
+ *
+ * @param ctiff    The CamTIFF file to set the parameter for.
+ * @param encoding CTIFF_META_JSON or CTIFF_META_CBOR.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetMetaEncoding(CTIFF ctiff, unsigned int encoding)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (encoding != CTIFF_META_JSON && encoding != CTIFF_META_CBOR){
+    return ECTIFFMETAENCODING;
+  }
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+
+  if (encoding == CTIFF_META_JSON){
+    __CTIFFFreeCbor(ctiff);
+    return CTIFFSUCCESS;
+  }
+
+  if (ctiff->cbor == NULL){
+    ctiff->cbor = (CTIFF_cbor*) calloc(1, sizeof(CTIFF_cbor));
+    if (ctiff->cbor == NULL) return ECTIFFMEMORY;
+  }
+
+  return CTIFFSUCCESS;
+}
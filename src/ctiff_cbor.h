@@ -0,0 +1,33 @@
+/**
+ * @file ctiff_cbor.h
+ * @description Storing page metadata as CBOR instead of JSON text.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_CBOR_H
+
+#define CTIFF_CBOR_H
+
+#include "ctiff_types.h"
+
+int CTIFFSetMetaEncoding(CTIFF ctiff, unsigned int encoding);
+int CTIFFReadPageMeta(const char *file, unsigned int page, char **json);
+int CTIFFDecodeMeta(const void *cbor, unsigned int len, char **json);
+void CTIFFFreeMeta(char *json);
+
+bool __CTIFFWriteCborMeta(CTIFF ctiff, const char *json, struct tiff *tiff);
+void __CTIFFFreeCbor(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_CBOR_H */
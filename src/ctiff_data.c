@@ -27,54 +27,181 @@
 #include "ctiff_error.h"
 #include "ctiff_meta.h"
 #include "ctiff_vers.h"
+#include "ctiff_async.h"
+#include "ctiff_pool.h"
+#include "ctiff_workers.h"
+#include "ctiff_rollover.h"
+#include "ctiff_dedup.h"
+#include "ctiff_cbor.h"
+#include "ctiff_builder.h"
+#include "ctiff_memio.h"
+#include "ctiff_bufio.h"
 
 #include "ctiff_data.h"
 
-CTIFF_node __CTIFFNewNode(CTIFF_dir *dir)
+/** Count memory as held, raising the peak if needed.
+ *
+ * @param ctiff The CTIFF holding the memory.
+ * @param bytes The number of bytes now held.
+ */
+static void __CTIFFCountHeld(CTIFF ctiff, size_t bytes)
+{
+  ctiff->held_bytes += bytes;
+  if (ctiff->held_bytes > ctiff->peak_bytes){
+    ctiff->peak_bytes = ctiff->held_bytes;
+  }
+}
+
+/** Make room in the ring for one more unwritten directory.
+ *
+ *  The ring is sized when first used to hold the number of pages kept before
+ *  a write, and after that only grows if more pages are held, such as after
+ *  a failed write or a change of CTIFFWriteEvery. The unwritten directories
+ *  are moved to the start of the new ring.
+ *
+ * @param ctiff    The CTIFF to make room in.
+ * @param capacity The number of directories the ring is expected to hold.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFRingReserve(CTIFF ctiff, unsigned int capacity)
+{
+  CTIFF_dir *ring;
+  unsigned int size, i;
+
+  if (ctiff->num_unwritten < ctiff->ring_size) return CTIFFSUCCESS;
+
+  size = ctiff->ring_size * 2;
+  if (size < capacity) size = capacity;
+  if (size <= ctiff->num_unwritten) size = ctiff->num_unwritten + 1;
+
+  ring = (CTIFF_dir*) malloc(size * sizeof(CTIFF_dir));
+  if (ring == NULL) return ECTIFFMEMORY;
+
+  for (i = 0; i < ctiff->num_unwritten; i++){
+    ring[i] = ctiff->ring[(ctiff->ring_head + i) % ctiff->ring_size];
+  }
+
+  FREE(ctiff->ring);
+  __CTIFFCountHeld(ctiff, (size - ctiff->ring_size) * sizeof(CTIFF_dir));
+  ctiff->ring      = ring;
+  ctiff->ring_size = size;
+  ctiff->ring_head = 0;
+
+  return CTIFFSUCCESS;
+}
+
+/** Append a directory to the end of the CTIFF image stack.
+ *
+ *  The directory is copied into the next free slot of the ring and counted
+ *  as unwritten. No write is performed.
+ *
+ * @param ctiff    The CTIFF to add the directory to.
+ * @param dir      The directory, owned by the CTIFF on success.
+ * @param capacity The number of directories the ring is expected to hold.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFRingPush(CTIFF ctiff, const CTIFF_dir *dir, unsigned int capacity)
+{
+  int retval;
+  unsigned int slot;
+
+  if ((retval = __CTIFFRingReserve(ctiff, capacity)) != CTIFFSUCCESS){
+    return retval;
+  }
+
+  slot = (ctiff->ring_head + ctiff->num_unwritten) % ctiff->ring_size;
+  ctiff->ring[slot] = *dir;
+
+  ctiff->num_dirs++;
+  ctiff->num_unwritten++;
+  ctiff->live_dirs++;
+  __CTIFFCountHeld(ctiff, dir->bytes);
+
+  return CTIFFSUCCESS;
+}
+
+/** Get the oldest unwritten directory of the CTIFF image stack.
+ *
+ * @param ctiff The CTIFF to look in, with at least one unwritten directory.
+ * @return      The directory, valid until the ring is next changed.
+ */
+CTIFF_dir* __CTIFFRingFront(CTIFF ctiff)
 {
-  CTIFF_node new_node = (CTIFF_node) malloc(sizeof(struct CTIFF_node_s));
+  return &ctiff->ring[ctiff->ring_head];
+}
 
-  new_node->dir       = dir;
-  new_node->next_node = NULL;
-  new_node->refs      = 0;
+/** Remove the oldest unwritten directory from the CTIFF image stack.
+ *
+ *  The slot is reused for a later directory, so anything the directory owns
+ *  must be released or taken beforehand.
+ *
+ * @param ctiff The CTIFF to remove the directory from.
+ */
+void __CTIFFRingPop(CTIFF ctiff)
+{
+  ctiff->ring_head = (ctiff->ring_head + 1) % ctiff->ring_size;
+  ctiff->num_unwritten--;
+}
 
-  dir->refs++;
+/** Release a directory once it has been written or dropped.
+ *
+ *  A copied page is returned to the pool and the metadata is freed, so that
+ *  memory does not grow with the number of pages written.
+ *
+ * @param ctiff The CTIFF the directory was added to.
+ * @param dir   The directory, which may be reused afterwards.
+ */
+void __CTIFFReleaseDir(CTIFF ctiff, CTIFF_dir *dir)
+{
+  __CTIFFReleasePage(ctiff, dir);
+  __CTIFFClearDir(dir);
 
-  return new_node;
+  ctiff->live_dirs--;
+  ctiff->held_bytes -= dir->bytes;
+  dir->bytes = 0;
 }
 
+/** Discard the oldest unwritten directory of the CTIFF image stack.
+ *
+ *  The directory's page and metadata are released. Nothing is done if every
+ *  directory has been written.
+ *
+ * @param ctiff The CTIFF to drop the directory from.
+ */
+void __CTIFFDropOldestUnwritten(CTIFF ctiff)
+{
+  if (ctiff->num_unwritten == 0) return;
+
+  __CTIFFReleaseDir(ctiff, __CTIFFRingFront(ctiff));
+  __CTIFFRingPop(ctiff);
+}
 
 /** Add directory to CTIFF image stack.
  *
- *  This is currently implemented as a linked list. Additionally, the write
+ *  This is implemented as a ring of directories, where each slot is reused
+ *  once its directory has been written. Additionally, the write
  *  every setting is used to define if a write operation should be performed on
- *  the addition of the directory.
+ *  the addition of the directory. If the CTIFF writes asynchronously the
+ *  directory is handed to the writer thread instead.
  * @see CTIFFWrite
  * @see CTIFFWriteEvery
+ * @see CTIFFSetAsync
  *
  * @param ctiff The CTIFF to add the directory to.
- * @param dir   The directory.
+ * @param dir   The directory, owned by the CTIFF on success.
  * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
  */
-int __CTIFFAddNode(CTIFF ctiff, CTIFF_dir *dir)
+int __CTIFFAddNode(CTIFF ctiff, const CTIFF_dir *dir)
 {
-  CTIFF_node new_node;
+  int retval;
 
   if (ctiff == NULL) return ECTIFFNULL;
   if (dir == NULL) return ECTIFFNULLDIR;
 
-  new_node = __CTIFFNewNode(dir);
-
-  if (ctiff->first_node == NULL){
-    ctiff->first_node = new_node;
-  } else {
-    ctiff->last_node->next_node = new_node;
-  }
-
-  ctiff->last_node = new_node;
-  new_node->refs++;
+  if (ctiff->async != NULL) return __CTIFFAsyncAddNode(ctiff, dir);
 
-  ctiff->num_unwritten++;
+  retval = __CTIFFRingPush(ctiff, dir, ctiff->write_every_num);
+  if (retval != CTIFFSUCCESS) return retval;
 
   if (ctiff->num_unwritten >= ctiff->write_every_num){
     CTIFFWrite(ctiff);
@@ -89,7 +216,8 @@ int __CTIFFAddNode(CTIFF ctiff, CTIFF_dir *dir)
  *  This function adds a new image to a CamTIFF file. Aditionally it attached
  *  metadata (if it is not null for either the name of the metadata string) to
  *  the image. Additionally the image addition is timestamped with the current
- *  time of the local machine, down to second precision.
+ *  time, down to nanosecond precision.
+ * @see CTIFFTAG_TIMESTAMP
  *
  *  For the metadata addition, this function takes in a metadata string,
  *  validates the string, and adds the metadata to the new image structure if
@@ -98,7 +226,13 @@ int __CTIFFAddNode(CTIFF ctiff, CTIFF_dir *dir)
  *  directory applies to strict rules.
  *
  *  Note that this function can create anomalous results if the image is
- *  deallocated before a write command happens.
+ *  deallocated before a write command happens. This includes asynchronous
+ *  writes, where the page may be written after this function returns. Use
+ *  CTIFFSetCopyPages to have the page copied instead.
+ *
+ *  Metadata too large to hold in one string can instead be passed in parts
+ *  with CTIFFAddNewPageMetaChunk.
+ * @see CTIFFAddNewPageMetaChunk
  *
  * @param ctiff    The CTIFF to add the directory to.
  * @param name     A name tag for the metadata to be attached.
@@ -109,33 +243,127 @@ int __CTIFFAddNode(CTIFF ctiff, CTIFF_dir *dir)
 int CTIFFAddNewPage(CTIFF ctiff, const void *page,
                     const char* ext_name, const char* ext_meta)
 {
-  int retval = CTIFFSUCCESS;
+  if (ctiff == NULL) return ECTIFFNULL;
 
-  CTIFF_dir *new_dir;
-  CTIFF_dir *def_dir;
+  return __CTIFFAddPage(ctiff, page,
+                        __CTIFFCachedExtMeta(ctiff, ext_name, ext_meta));
+}
+
+/** Pass the next part of the metadata of the next page.
+ *
+ *  Metadata can be passed in any number of parts, such as while it is being
+ *  generated, rather than as one string to CTIFFAddNewPage. Each part is
+ *  validated and minified as it arrives, so very large metadata does not
+ *  have to be validated all at once. The parts need not be NUL terminated,
+ *  and may split the JSON anywhere.
+ *
+ *  Once all parts are passed, call CTIFFAddNewPageMetaFinish to add the
+ *  page. If the metadata is already known to be invalid,
+ *  ECTIFFINVALIDEXTMETA is returned. The page can still be finished, and the
+ *  metadata is then handled as invalid metadata is by CTIFFAddNewPage.
+ * @see CTIFFAddNewPageMetaFinish
+ * @see CTIFFSetMetaDepth
+ *
+ * @param ctiff The CTIFF the page will be added to.
+ * @param chunk The next part of the metadata (JSON string).
+ * @param len   The length of the part.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFAddNewPageMetaChunk(CTIFF ctiff, const char *chunk, unsigned int len)
+{
+  if (ctiff == NULL || chunk == NULL) return ECTIFFNULL;
+
+  return __CTIFFMetaStreamFeed(ctiff, chunk, len);
+}
+
+/** Add a new page with the metadata passed in parts or built.
+ *
+ *  The same as CTIFFAddNewPage, with the metadata passed to
+ *  CTIFFAddNewPageMetaChunk since the last page was added, or built with
+ *  CTIFFMetaBegin since then. Built metadata is used in place of any parts.
+ *  If built metadata still has objects open, ECTIFFMETABUILD is returned and
+ *  no page is added.
+ * @see CTIFFAddNewPageMetaChunk
+ * @see CTIFFMetaBegin
+ * @see CTIFFAddNewPage
+ *
+ * @param ctiff    The CTIFF to add the directory to.
+ * @param page     A pointer to the start of the image data.
+ * @param ext_name A name tag for the metadata to be attached.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFAddNewPageMetaFinish(CTIFF ctiff, const void *page,
+                              const char *ext_name)
+{
+  const char *ext_meta;
+  bool built;
+  int retval;
 
   if (ctiff == NULL) return ECTIFFNULL;
 
-  new_dir  = (CTIFF_dir*) malloc(sizeof(struct CTIFF_dir_s));
-  def_dir  = ctiff->def_dir;
+  if ((retval = __CTIFFMetaBuilding(ctiff)) != CTIFFSUCCESS) return retval;
 
-  // Not empty CTIFF
-  if (ctiff->last_node != NULL){
-    if (memcmp(&ctiff->last_node->dir->style,
-               &def_dir->style, sizeof(CTIFF_dir_style))){
-      ctiff->num_page_styles++;
+  ext_meta = __CTIFFMetaBuildFinish(ctiff, ext_name, &built);
+  if (built){
+    __CTIFFMetaStreamDrop(ctiff);
+  } else {
+    ext_meta = __CTIFFMetaStreamFinish(ctiff, ext_name);
+  }
+
+  return __CTIFFAddPage(ctiff, page, ext_meta);
+}
+
+/** Create a new TIFF directory for a page and attach it to a CTIFF.
+ *
+ * @param ctiff    The CTIFF to add the directory to.
+ * @param page     A pointer to the start of the image data.
+ * @param ext_meta The page's finished metadata, freed with the directory.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFAddPage(CTIFF ctiff, const void *page, const char *ext_meta)
+{
+  int retval = CTIFFSUCCESS;
+
+  CTIFF_dir  new_dir;
+  CTIFF_dir *def_dir = ctiff->def_dir;
+
+  new_dir = *def_dir;
+
+  if (ctiff->num_dirs == 0 && ctiff->expected_pages != 0){
+    ctiff->expected_bytes = (unsigned long long) ctiff->expected_pages *
+                            __CTIFFPageSize(&def_dir->style);
+    __CTIFFBufExpect(ctiff->tiff, ctiff->expected_bytes);
+  }
+
+  if (ctiff->copy_pages){
+    if ((retval = __CTIFFCopyPage(ctiff, &new_dir, page)) != CTIFFSUCCESS){
+      FREE(ext_meta);
+      return retval;
     }
+  } else {
+    new_dir.data = page;
   }
 
-  memcpy(new_dir, ctiff->def_dir, sizeof(struct CTIFF_dir_s));
+  __CTIFFGetTime(&new_dir.time_ns, &new_dir.monotonic_ns);
+  new_dir.ext_meta.data = ext_meta;
 
-  new_dir->timestamp = __CTIFFGetTime();
-  new_dir->ext_meta.data = __CTIFFCreateValidExtMeta(ctiff->strict, ext_name,
-                                                     ext_meta);
+  new_dir.bytes = (ext_meta != NULL) ? strlen(ext_meta) + 1 : 0;
+  if (new_dir.data_owned) new_dir.bytes += __CTIFFPageSize(&new_dir.style);
 
-  new_dir->data = page;
+  retval = __CTIFFAddNode(ctiff, &new_dir);
+  if (retval != CTIFFSUCCESS){
+    __CTIFFReleasePage(ctiff, &new_dir);
+    __CTIFFClearDir(&new_dir);
+    return retval;
+  }
+
+  // Not empty CTIFF
+  if (ctiff->num_dirs > 1 && memcmp(&ctiff->last_style, &def_dir->style,
+                                    sizeof(CTIFF_dir_style))){
+    ctiff->num_page_styles++;
+  }
+  ctiff->last_style = def_dir->style;
 
-  retval = __CTIFFAddNode(ctiff, new_dir);
   return retval;
 }
 
@@ -153,38 +381,53 @@ void __CTIFFFreeExtMeta(CTIFF_extended_metadata *ext_meta)
   FREE(ext_meta->data);
 }
 
-/** Free a directory struct.
- * @param dir A pointer to the CTIFF_dir struct to be deallocated
+/** Free what a directory owns, its metadata and any copied page.
+ *
+ *  The directory itself is not freed, as it lives in the ring of its CTIFF
+ *  (or on the stack), and can be reused afterwards.
+ *
+ * @param dir A pointer to the CTIFF_dir struct to clear.
  */
-void __CTIFFFreeDir(CTIFF_dir *dir)
+void __CTIFFClearDir(CTIFF_dir *dir)
 {
   if (dir == NULL) return;
 
-  if (dir->refs > 1){
-    dir->refs--;
-  } else {
-    __CTIFFFreeExtMeta(&dir->ext_meta);
-    FREE(dir->timestamp);
-    FREE(dir);
-  }
+  __CTIFFFreeExtMeta(&dir->ext_meta);
+  if (dir->data_owned) FREE(dir->data);
+  dir->data_owned = false;
 }
 
-/** Free a node struct.
- * @param node A pointer to the CTIFF_node struct to be deallocated
+/** Get how much memory a CamTIFF file holds for pages not yet written.
+ *
+ *  A directory is live from when its page is added until it has been
+ *  written or dropped, after which its metadata is freed and any copied page
+ *  is returned to the pool. The bytes held are the live directories'
+ *  metadata and copied pages, and the ring of directory slots. Buffers
+ *  waiting in the page pool are not counted. A steadily rising count means
+ *  pages are added faster than they are written.
+ * @see CTIFFWriteEvery
+ * @see CTIFFSetAsync
+ * @see CTIFFGetPoolStats
+ *
+ * @param ctiff      The CamTIFF file to query.
+ * @param live_dirs  Set to the number of live directories.
+ * @param held_bytes Set to the number of bytes held.
+ * @param peak_bytes Set to the most bytes held at any time.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
  */
-void __CTIFFFreeNode(CTIFF_node node)
+int CTIFFGetMemoryStats(CTIFF ctiff, unsigned int *live_dirs,
+                        unsigned long long *held_bytes,
+                        unsigned long long *peak_bytes)
 {
-  CTIFF_dir *dir;
-  if (node == NULL) return;
+  if (ctiff == NULL) return ECTIFFNULL;
 
-  dir = node->dir;
+  __CTIFFAsyncLock(ctiff);
+  *live_dirs  = ctiff->live_dirs;
+  *held_bytes = ctiff->held_bytes;
+  *peak_bytes = ctiff->peak_bytes;
+  __CTIFFAsyncUnlock(ctiff);
 
-  if (node->refs > 1){
-    node->refs--;
-  } else {
-    __CTIFFFreeDir(dir);
-    FREE(node);
-  }
+  return CTIFFSUCCESS;
 }
 
 /** Free a CTIFF struct.
@@ -193,16 +436,23 @@ void __CTIFFFreeNode(CTIFF_node node)
  */
 int __CTIFFFree(CTIFF ctiff)
 {
-  CTIFF_node tmp_node;
-
   if (ctiff == NULL) return ECTIFFNULL;
 
-  while (ctiff->first_node != NULL){
-    tmp_node = ctiff->first_node;
-    ctiff->first_node = tmp_node->next_node;
-    __CTIFFFreeNode(tmp_node);
+  while (ctiff->num_unwritten > 0){
+    __CTIFFReleaseDir(ctiff, __CTIFFRingFront(ctiff));
+    __CTIFFRingPop(ctiff);
   }
 
+  __CTIFFFreePool(ctiff);
+  __CTIFFWorkersFree(ctiff);
+  __CTIFFFreeRollover(ctiff);
+  __CTIFFFreeMetaStream(ctiff);
+  __CTIFFFreeDedup(ctiff);
+  __CTIFFFreeCbor(ctiff);
+  __CTIFFFreeMetaBuilder(ctiff);
+  FREE(ctiff->ring);
+  if (ctiff->membuf != NULL) FREE(ctiff->membuf->data);
+  FREE(ctiff->membuf);
   FREE(ctiff->def_dir);
   FREE(ctiff);
 
@@ -26,7 +26,20 @@
 
 int CTIFFAddNewPage(CTIFF ctiff, const void *page,
                     const char* name, const char* ext_meta);
+int CTIFFAddNewPageMetaChunk(CTIFF ctiff, const char *chunk, unsigned int len);
+int CTIFFAddNewPageMetaFinish(CTIFF ctiff, const void *page,
+                              const char *ext_name);
+int CTIFFGetMemoryStats(CTIFF ctiff, unsigned int *live_dirs,
+                        unsigned long long *held_bytes,
+                        unsigned long long *peak_bytes);
+int __CTIFFAddPage(CTIFF ctiff, const void *page, const char *ext_meta);
 int __CTIFFFree(CTIFF ctiff);
+int __CTIFFRingPush(CTIFF ctiff, const CTIFF_dir *dir, unsigned int capacity);
+CTIFF_dir* __CTIFFRingFront(CTIFF ctiff);
+void __CTIFFRingPop(CTIFF ctiff);
+void __CTIFFReleaseDir(CTIFF ctiff, CTIFF_dir *dir);
+void __CTIFFDropOldestUnwritten(CTIFF ctiff);
+void __CTIFFClearDir(CTIFF_dir *dir);
 
 
 #endif /* end of include guard: CTIFF_DATA_H */
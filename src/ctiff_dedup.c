@@ -0,0 +1,817 @@
+/**
+ * @file ctiff_dedup.c
+ * @description Avoiding repeated work and storage for repeated metadata.
+ *
+ * Pages of an acquisition usually carry much the same metadata. Metadata
+ * identical to the previous page's, byte for byte, is not validated again;
+ * metadata that differs at all, if only in a counter, is validated in full.
+ * With CTIFFSetMetaDedup a page whose metadata differs only in a few fields
+ * stores just those fields and refers to an earlier page for the rest.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>  // sprintf
+#include <stdlib.h> // malloc
+#include <string.h> // memcmp
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_meta.h"
+
+#include "ctiff_dedup.h"
+
+/** A member of a minified JSON object: "key":value */
+typedef struct CTIFF_member_s {
+  const char *key;      // Including the quotes.
+  size_t      key_len;
+  const char *val;
+  size_t      val_len;
+} CTIFF_member;
+
+/** A list of the members of a JSON object, reused between pages. */
+typedef struct CTIFF_members_s {
+  CTIFF_member *members;
+  bool         *matched;
+  unsigned int  num;
+  unsigned int  capacity;
+} CTIFF_members;
+
+/** The previous page's metadata, as given and as created.
+ *
+ *  Used when pages are added.
+ */
+typedef struct CTIFF_meta_cache_s {
+  bool          cached;
+  bool          strict;
+  unsigned int  depth;
+  size_t        name_len;
+  size_t        meta_len;
+  char         *key;        // The name followed by the metadata.
+  size_t        key_cap;
+  char         *result;
+  size_t        result_len;
+  size_t        result_cap;
+  unsigned long hits;
+  unsigned long misses;
+} CTIFF_meta_cache;
+
+/** The page that the following pages refer to.
+ *
+ *  Used when pages are written, possibly by the writer thread.
+ */
+typedef struct CTIFF_dedup_s {
+  struct tiff  *tiff;       // The file being written.
+  unsigned int  num_dirs;   // Directories written to the file.
+  bool          has_base;
+  unsigned int  base_dir;   // Index of the base in the file.
+  char         *base;
+  size_t        base_len;
+  size_t        base_cap;
+  CTIFF_members base_top;   // Members of the base metadata.
+  CTIFF_members base_user;  // Members of the base's user object.
+  CTIFF_members top;
+  CTIFF_members user;
+  char         *patch;
+  size_t        patch_cap;
+} CTIFF_dedup;
+
+/** The members of the metadata always written in full. */
+#define CTIFF_DEDUP_HEAD_MEMBERS 3 // ctiff, libctiff, strict
+
+
+/** Validate metadata and add the CTIFF header, reusing the previous result.
+ *
+ *  If the name and metadata are the same as for the previous page, and the
+ *  strict mode and depth have not changed, the previous result is copied
+ *  instead of validating the metadata again. Comparing costs about as much
+ *  as copying, much less than validating. Only identical metadata is a hit:
+ *  metadata with any change, such as a frame counter, is validated in full.
+ * @see __CTIFFCreateValidExtMeta
+ *
+ * @param ctiff    The CTIFF the page is added to.
+ * @param name     The key of the metadata.
+ * @param ext_meta The metadata string.
+ * @return         Compressed JSON string, to be freed by the caller.
+ */
+const char* __CTIFFCachedExtMeta(CTIFF ctiff, const char* name,
+                                              const char* ext_meta)
+{
+  CTIFF_meta_cache *cache = ctiff->meta_cache;
+  size_t name_len, meta_len;
+  const char *result;
+  char *copy;
+
+  // Missing and empty metadata are treated the same.
+  if (name == NULL)     name = "";
+  if (ext_meta == NULL) ext_meta = "";
+  name_len = strlen(name);
+  meta_len = strlen(ext_meta);
+
+  if (cache == NULL){
+    cache = (CTIFF_meta_cache*) calloc(1, sizeof(CTIFF_meta_cache));
+    if (cache == NULL){
+      return __CTIFFCreateValidExtMeta(ctiff->strict, ctiff->meta_depth,
+                                       name, ext_meta);
+    }
+    ctiff->meta_cache = cache;
+  }
+
+  if (cache->cached &&
+      cache->strict   == ctiff->strict &&
+      cache->depth    == ctiff->meta_depth &&
+      cache->name_len == name_len &&
+      cache->meta_len == meta_len &&
+      memcmp(cache->key, name, name_len) == 0 &&
+      memcmp(cache->key + name_len, ext_meta, meta_len) == 0){
+    if ((copy = (char*) malloc(cache->result_len + 1)) == NULL) return NULL;
+    memcpy(copy, cache->result, cache->result_len + 1);
+    cache->hits++;
+    return copy;
+  }
+
+  cache->misses++;
+  result = __CTIFFCreateValidExtMeta(ctiff->strict, ctiff->meta_depth,
+                                     name, ext_meta);
+  if (result == NULL) return NULL;
+
+  // Remember this page for the next, or forget the previous page.
+  cache->cached = false;
+  cache->result_len = strlen(result);
+  if (__CTIFFReserve(&cache->key, &cache->key_cap,
+                     name_len + meta_len) != CTIFFSUCCESS ||
+      __CTIFFReserve(&cache->result, &cache->result_cap,
+                     cache->result_len + 1) != CTIFFSUCCESS){
+    return result;
+  }
+
+  memcpy(cache->key, name, name_len);
+  memcpy(cache->key + name_len, ext_meta, meta_len);
+  memcpy(cache->result, result, cache->result_len + 1);
+  cache->strict   = ctiff->strict;
+  cache->depth    = ctiff->meta_depth;
+  cache->name_len = name_len;
+  cache->meta_len = meta_len;
+  cache->cached   = true;
+
+  return result;
+}
+
+
+/** Skip over a JSON string.
+ *
+ * @param pt The opening quote.
+ * @return   The character after the closing quote.
+ */
+static const char* __CTIFFSkipString(const char *pt)
+{
+  for (pt++; *pt != '"' && *pt != '\0'; pt++) {
+    if (*pt == '\\' && pt[1] != '\0') pt++;
+  }
+
+  return (*pt != '\0') ? pt + 1 : pt;
+}
+
+/** Skip over a JSON value.
+ *
+ * @param pt The start of the value.
+ * @return   The comma or closing bracket after the value.
+ */
+static const char* __CTIFFSkipValue(const char *pt)
+{
+  unsigned int depth = 0;
+
+  for (;;) {
+    switch (*pt) {
+      case '"':
+        pt = __CTIFFSkipString(pt);
+        continue;
+      case '{':
+      case '[':
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) return pt;
+        depth--;
+        break;
+      case ',':
+        if (depth == 0) return pt;
+        break;
+      case '\0':
+        return pt;
+    }
+    pt++;
+  }
+}
+
+/** List the members of a minified JSON object.
+ *
+ *  The object is expected to be valid, but invalid metadata (kept when not
+ *  strict) is rejected safely.
+ *
+ * @param obj     The opening brace of the object.
+ * @param members Set to the members, in order.
+ * @return        CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFListMembers(const char *obj, CTIFF_members *members)
+{
+  const char *pt = obj + 1;
+  CTIFF_member *member, *new_members;
+  bool *new_matched;
+
+  members->num = 0;
+  if (*pt == '}') return CTIFFSUCCESS;
+
+  for (;;) {
+    if (members->num == members->capacity){
+      members->capacity = (members->capacity != 0) ? 2*members->capacity : 16;
+      new_members = (CTIFF_member*) realloc(members->members,
+                                   members->capacity * sizeof(CTIFF_member));
+      if (new_members == NULL) return ECTIFFMEMORY;
+      members->members = new_members;
+
+      new_matched = (bool*) realloc(members->matched,
+                                    members->capacity * sizeof(bool));
+      if (new_matched == NULL) return ECTIFFMEMORY;
+      members->matched = new_matched;
+    }
+
+    if (*pt != '"') return ECTIFFINVALIDEXTMETA;
+
+    member = &members->members[members->num++];
+    member->key     = pt;
+    pt              = __CTIFFSkipString(pt);
+    member->key_len = pt - member->key;
+
+    if (*pt != ':') return ECTIFFINVALIDEXTMETA;
+
+    member->val     = ++pt;
+    pt              = __CTIFFSkipValue(pt);
+    member->val_len = pt - member->val;
+
+    if (*pt == '}') return CTIFFSUCCESS;
+    if (*pt != ',') return ECTIFFINVALIDEXTMETA;
+    pt++;
+  }
+}
+
+/** Find the member of an object with the same key as another.
+ *
+ * @param members The members to search.
+ * @param member  The member whose key to find.
+ * @param hint    Where to look first, as keys are usually in the same order.
+ * @return        The index of the member, or members->num if not found.
+ */
+static unsigned int __CTIFFFindMember(const CTIFF_members *members,
+                                      const CTIFF_member *member,
+                                      unsigned int hint)
+{
+  unsigned int i;
+  const CTIFF_member *other;
+
+  for (i = 0; i < members->num; i++) {
+    other = &members->members[(hint + i) % members->num];
+    if (other->key_len == member->key_len &&
+        memcmp(other->key, member->key, member->key_len) == 0){
+      return (hint + i) % members->num;
+    }
+  }
+
+  return members->num;
+}
+
+/** Whether two members have the same key and value.
+ *
+ * @param a A member.
+ * @param b Another member.
+ * @return  True if they are the same.
+ */
+static bool __CTIFFSameMember(const CTIFF_member *a, const CTIFF_member *b)
+{
+  return a->key_len == b->key_len && a->val_len == b->val_len &&
+         memcmp(a->key, b->key, a->key_len + 1 + a->val_len) == 0;
+}
+
+/** Append to the patch buffer.
+ *
+ * @param dedup The dedup state holding the patch.
+ * @param len   The length of the patch so far, updated.
+ * @param str   The characters to append.
+ * @param n     The number of characters.
+ */
+static void __CTIFFPatchAdd(CTIFF_dedup *dedup, size_t *len,
+                            const char *str, size_t n)
+{
+  memcpy(dedup->patch + *len, str, n);
+  *len += n;
+}
+
+/** Whether metadata was strictly validated, from its top level members.
+ *
+ * @param top The members of the metadata.
+ * @return    True if the strict member is true.
+ */
+static bool __CTIFFIsStrictMeta(const CTIFF_members *top)
+{
+  const CTIFF_member *strict;
+
+  if (top->num < CTIFF_DEDUP_HEAD_MEMBERS) return false;
+
+  strict = &top->members[CTIFF_DEDUP_HEAD_MEMBERS - 1];
+  return strict->val_len == 4 && memcmp(strict->val, "true", 4) == 0;
+}
+
+/** Make metadata the base that the following pages refer to.
+ *
+ * @param dedup The dedup state.
+ * @param meta  The metadata of the page.
+ * @param len   The length of the metadata.
+ * @return      The metadata to write, which is meta itself.
+ */
+static const char* __CTIFFSetBase(CTIFF_dedup *dedup, const char *meta,
+                                  size_t len)
+{
+  const CTIFF_member *user;
+
+  dedup->has_base = false;
+
+  if (__CTIFFReserve(&dedup->base, &dedup->base_cap, len + 1) != CTIFFSUCCESS){
+    return meta;
+  }
+
+  memcpy(dedup->base, meta, len + 1);
+  dedup->base_len = len;
+
+  if (__CTIFFListMembers(dedup->base, &dedup->base_top) != CTIFFSUCCESS ||
+      !__CTIFFIsStrictMeta(&dedup->base_top)){
+    return meta;
+  }
+
+  dedup->base_user.num = 0;
+  if (dedup->base_top.num > CTIFF_DEDUP_HEAD_MEMBERS){
+    user = &dedup->base_top.members[CTIFF_DEDUP_HEAD_MEMBERS];
+    if (*user->val == '{' &&
+        __CTIFFListMembers(user->val, &dedup->base_user) != CTIFFSUCCESS){
+      return meta;
+    }
+  }
+
+  dedup->base_dir = dedup->num_dirs - 1;
+  dedup->has_base = true;
+  return meta;
+}
+
+/** Use a finished patch, if it saves enough of a page's metadata.
+ *
+ * @param dedup     The dedup state holding the patch.
+ * @param patch_len The length of the patch, with its NUL.
+ * @param meta      The page's metadata.
+ * @param len       The length of the metadata.
+ * @return          The metadata to write, the patch or the page as a base.
+ */
+static const char* __CTIFFPatchDone(CTIFF_dedup *dedup, size_t patch_len,
+                                    const char *meta, size_t len)
+{
+  if (patch_len - 1 > len / 2) return __CTIFFSetBase(dedup, meta, len);
+
+  return dedup->patch;
+}
+
+/** Get the metadata to write for a page, referring to an earlier page.
+ *
+ *  Called by the writer for each page, in the order written. The first page
+ *  of each file is a base, written in full. A later page whose metadata
+ *  differs from the base's only in a few members of the user's object is
+ *  written as those members plus a reference to the base:
+ *
+ *    base:  {"ctiff":"0",...,"strict":true,"meta":{"x":1,"y":2,"n":0}}
+ *    page:  {"ctiff":"0",...,"strict":true,"ctiff_base":0,"meta":{"n":1}}
+ *
+ *  ctiff_base is the index of the base page in the same file. The page's
+ *  metadata is the base's with the page's members merged in, replacing
+ *  members of the same name, as with a JSON merge patch (RFC 7386).
+ *  Members the page does not have are given as null. If the user's metadata
+ *  is not an object, it is left out when the same as the base's.
+ *
+ *  A page becomes the new base when this would save less than half of its
+ *  metadata, when the name of the metadata changes, when the metadata is
+ *  not strictly validated, or when a member added or changed is an object
+ *  or null, which a merge patch could not give as is.
+ *
+ * @param ctiff The CTIFF being written.
+ * @param meta  The page's metadata, or NULL if it has none.
+ * @return      The metadata to write, valid until the next call.
+ */
+const char* __CTIFFDedupExtMeta(CTIFF ctiff, const char* meta)
+{
+  CTIFF_dedup *dedup = ctiff->dedup;
+  size_t len;
+  size_t patch_len = 0;
+  const CTIFF_member *user, *base_user, *member;
+  unsigned int i, j;
+  char number[16];
+  bool same_user;
+
+  if (dedup == NULL) return meta;
+
+  // Each file has its own bases.
+  if (dedup->tiff != ctiff->tiff){
+    dedup->tiff     = ctiff->tiff;
+    dedup->num_dirs = 0;
+    dedup->has_base = false;
+  }
+  dedup->num_dirs++;
+
+  if (meta == NULL) return NULL;
+  len = strlen(meta);
+
+  if (!dedup->has_base) return __CTIFFSetBase(dedup, meta, len);
+
+  // Only strictly validated metadata can be taken apart.
+  if (__CTIFFListMembers(meta, &dedup->top) != CTIFFSUCCESS ||
+      !__CTIFFIsStrictMeta(&dedup->top) ||
+      dedup->top.num != dedup->base_top.num){
+    return __CTIFFSetBase(dedup, meta, len);
+  }
+
+  // Copy the CamTIFF header.
+  if (__CTIFFReserve(&dedup->patch, &dedup->patch_cap,
+                     len + 32) != CTIFFSUCCESS){
+    return meta;
+  }
+
+  member = &dedup->top.members[CTIFF_DEDUP_HEAD_MEMBERS - 1];
+  __CTIFFPatchAdd(dedup, &patch_len, meta, member->val + member->val_len - meta);
+  __CTIFFPatchAdd(dedup, &patch_len, ",\"ctiff_base\":", 14);
+  sprintf(number, "%u", dedup->base_dir);
+  __CTIFFPatchAdd(dedup, &patch_len, number, strlen(number));
+
+  if (dedup->top.num == CTIFF_DEDUP_HEAD_MEMBERS){
+    __CTIFFPatchAdd(dedup, &patch_len, "}", 2);
+    return __CTIFFPatchDone(dedup, patch_len, meta, len);
+  }
+
+  user      = &dedup->top.members[CTIFF_DEDUP_HEAD_MEMBERS];
+  base_user = &dedup->base_top.members[CTIFF_DEDUP_HEAD_MEMBERS];
+
+  if (user->key_len != base_user->key_len ||
+      memcmp(user->key, base_user->key, user->key_len) != 0){
+    return __CTIFFSetBase(dedup, meta, len);
+  }
+
+  same_user = (user->val_len == base_user->val_len &&
+               memcmp(user->val, base_user->val, user->val_len) == 0);
+
+  if (!same_user){
+    if (*user->val != '{' || *base_user->val != '{' ||
+        __CTIFFListMembers(user->val, &dedup->user) != CTIFFSUCCESS){
+      return __CTIFFSetBase(dedup, meta, len);
+    }
+
+    __CTIFFPatchAdd(dedup, &patch_len, ",", 1);
+    __CTIFFPatchAdd(dedup, &patch_len, user->key, user->key_len + 1);
+    __CTIFFPatchAdd(dedup, &patch_len, "{", 1);
+
+    memset(dedup->base_user.matched, 0, dedup->base_user.num * sizeof(bool));
+
+    // Members added or changed since the base.
+    for (i = 0; i < dedup->user.num; i++) {
+      member = &dedup->user.members[i];
+      j = __CTIFFFindMember(&dedup->base_user, member, i);
+
+      if (j < dedup->base_user.num){
+        dedup->base_user.matched[j] = true;
+        if (__CTIFFSameMember(member, &dedup->base_user.members[j])) continue;
+      }
+
+      // A merge patch merges objects and deletes members given as null,
+      // so neither can be given as a new value.
+      if (*member->val == '{' ||
+          (member->val_len == 4 && memcmp(member->val, "null", 4) == 0)){
+        return __CTIFFSetBase(dedup, meta, len);
+      }
+
+      if (patch_len + member->key_len + member->val_len + 4 > len / 2){
+        return __CTIFFSetBase(dedup, meta, len);
+      }
+
+      if (dedup->patch[patch_len - 1] != '{'){
+        __CTIFFPatchAdd(dedup, &patch_len, ",", 1);
+      }
+      __CTIFFPatchAdd(dedup, &patch_len, member->key,
+                      member->key_len + 1 + member->val_len);
+    }
+
+    // Members removed since the base.
+    for (j = 0; j < dedup->base_user.num; j++) {
+      if (dedup->base_user.matched[j]) continue;
+
+      member = &dedup->base_user.members[j];
+      if (patch_len + member->key_len + 8 > len / 2){
+        return __CTIFFSetBase(dedup, meta, len);
+      }
+
+      if (dedup->patch[patch_len - 1] != '{'){
+        __CTIFFPatchAdd(dedup, &patch_len, ",", 1);
+      }
+      __CTIFFPatchAdd(dedup, &patch_len, member->key, member->key_len);
+      __CTIFFPatchAdd(dedup, &patch_len, ":null", 5);
+    }
+
+    __CTIFFPatchAdd(dedup, &patch_len, "}", 1);
+  }
+
+  __CTIFFPatchAdd(dedup, &patch_len, "}", 2);
+  return __CTIFFPatchDone(dedup, patch_len, meta, len);
+}
+
+
+/** Find the base page that a page's metadata refers to.
+ * @see __CTIFFDedupExtMeta
+ *
+ * @param meta The metadata of the page, as written.
+ * @param base Set to the index of the base page in the file, if any.
+ * @return     True if the metadata refers to a base.
+ */
+bool __CTIFFDedupBaseOf(const char *meta, unsigned int *base)
+{
+  CTIFF_members top = {NULL, NULL, 0, 0};
+  const CTIFF_member *member;
+  bool found = false;
+
+  if (*meta == '{' && __CTIFFListMembers(meta, &top) == CTIFFSUCCESS &&
+      top.num > CTIFF_DEDUP_HEAD_MEMBERS){
+    member = &top.members[CTIFF_DEDUP_HEAD_MEMBERS];
+    if (member->key_len == 12 && memcmp(member->key, "\"ctiff_base\"", 12) == 0){
+      *base = (unsigned int) strtoul(member->val, NULL, 10);
+      found = true;
+    }
+  }
+
+  free(top.members);
+  free(top.matched);
+  return found;
+}
+
+/** Append a member to an object being written.
+ *
+ * @param pt     Where to write, after the opening brace or another member.
+ * @param member The member to write.
+ * @return       The character after the member.
+ */
+static char* __CTIFFMergeAdd(char *pt, const CTIFF_member *member)
+{
+  if (pt[-1] != '{') *pt++ = ',';
+  memcpy(pt, member->key, member->key_len + 1 + member->val_len);
+  return pt + member->key_len + 1 + member->val_len;
+}
+
+/** Merge the user's members of a page's metadata into its base's.
+ *
+ *  Members of the page replace those of the base with the same name, and
+ *  members given as null are removed, as with a JSON merge patch. Members
+ *  of both are written in the base's order.
+ *
+ * @param pt        Where to write the merged object.
+ * @param base_user The base's user object.
+ * @param user      The page's user object.
+ * @return          The character after the object, or NULL on failure.
+ */
+static char* __CTIFFMergeUser(char *pt, const CTIFF_member *base_user,
+                                        const CTIFF_member *user)
+{
+  CTIFF_members base = {NULL, NULL, 0, 0}, page = {NULL, NULL, 0, 0};
+  const CTIFF_member *member;
+  unsigned int i, j;
+
+  if (__CTIFFListMembers(base_user->val, &base) != CTIFFSUCCESS ||
+      __CTIFFListMembers(user->val, &page) != CTIFFSUCCESS){
+    pt = NULL;
+    goto done;
+  }
+
+  if (page.num > 0) memset(page.matched, 0, page.num * sizeof(bool));
+
+  memcpy(pt, user->key, user->key_len + 1);
+  pt += user->key_len + 1;
+  *pt++ = '{';
+
+  for (i = 0; i < base.num; i++) {
+    member = &base.members[i];
+    j = __CTIFFFindMember(&page, member, i);
+
+    if (j < page.num){
+      page.matched[j] = true;
+      member = &page.members[j];
+      if (member->val_len == 4 && memcmp(member->val, "null", 4) == 0){
+        continue;
+      }
+    }
+    pt = __CTIFFMergeAdd(pt, member);
+  }
+
+  for (j = 0; j < page.num; j++) {
+    member = &page.members[j];
+    if (page.matched[j] ||
+        (member->val_len == 4 && memcmp(member->val, "null", 4) == 0)){
+      continue;
+    }
+    pt = __CTIFFMergeAdd(pt, member);
+  }
+
+  *pt++ = '}';
+
+done:
+  free(base.members);
+  free(base.matched);
+  free(page.members);
+  free(page.matched);
+  return pt;
+}
+
+/** Rebuild the full metadata of a page that refers to a base page.
+ *
+ *  The page's CamTIFF header is kept, without ctiff_base, and its user
+ *  members are merged into the base's.
+ * @see __CTIFFDedupExtMeta
+ *
+ * @param base The metadata of the base page, as written.
+ * @param page The metadata of the page, as written.
+ * @param json Set to the full metadata, to be freed with free.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFDedupMerge(const char *base, const char *page, char **json)
+{
+  CTIFF_members base_top = {NULL, NULL, 0, 0}, top = {NULL, NULL, 0, 0};
+  const CTIFF_member *base_user = NULL, *user = NULL, *member;
+  unsigned int dummy;
+  char *out = NULL, *pt;
+  int retval = ECTIFFREADMETA;
+
+  *json = NULL;
+
+  // Bases are always written in full.
+  if (*base != '{' || *page != '{' || __CTIFFDedupBaseOf(base, &dummy) ||
+      __CTIFFListMembers(base, &base_top) != CTIFFSUCCESS ||
+      __CTIFFListMembers(page, &top) != CTIFFSUCCESS ||
+      base_top.num < CTIFF_DEDUP_HEAD_MEMBERS ||
+      top.num <= CTIFF_DEDUP_HEAD_MEMBERS){
+    goto done;
+  }
+
+  if ((out = (char*) malloc(strlen(base) + strlen(page) + 1)) == NULL){
+    retval = ECTIFFMEMORY;
+    goto done;
+  }
+
+  // The page's header, up to ctiff_base.
+  member = &top.members[CTIFF_DEDUP_HEAD_MEMBERS - 1];
+  memcpy(out, page, member->val + member->val_len - page);
+  pt = out + (member->val + member->val_len - page);
+
+  if (base_top.num > CTIFF_DEDUP_HEAD_MEMBERS){
+    base_user = &base_top.members[CTIFF_DEDUP_HEAD_MEMBERS];
+  }
+  if (top.num > CTIFF_DEDUP_HEAD_MEMBERS + 1){
+    user = &top.members[CTIFF_DEDUP_HEAD_MEMBERS + 1];
+  }
+
+  if (user != NULL && base_user != NULL && *user->val == '{' &&
+      *base_user->val == '{' && user->key_len == base_user->key_len &&
+      memcmp(user->key, base_user->key, user->key_len) == 0){
+    *pt++ = ',';
+    if ((pt = __CTIFFMergeUser(pt, base_user, user)) == NULL) goto done;
+  } else if (user != NULL || base_user != NULL){
+    // The user's metadata is the same as the base's when left out.
+    pt = __CTIFFMergeAdd(pt, (user != NULL) ? user : base_user);
+  }
+
+  *pt++ = '}';
+  *pt   = '\0';
+
+  *json  = out;
+  out    = NULL;
+  retval = CTIFFSUCCESS;
+
+done:
+  free(out);
+  free(base_top.members);
+  free(base_top.matched);
+  free(top.members);
+  free(top.matched);
+  return retval;
+}
+
+
+/** Free the shared metadata state of a CTIFF.
+ *
+ * @param ctiff The CTIFF whose state to free.
+ */
+static void __CTIFFFreeBase(CTIFF ctiff)
+{
+  CTIFF_dedup *dedup = ctiff->dedup;
+
+  if (dedup == NULL) return;
+
+  FREE(dedup->base);
+  FREE(dedup->base_top.members);
+  FREE(dedup->base_top.matched);
+  FREE(dedup->base_user.members);
+  FREE(dedup->base_user.matched);
+  FREE(dedup->top.members);
+  FREE(dedup->top.matched);
+  FREE(dedup->user.members);
+  FREE(dedup->user.matched);
+  FREE(dedup->patch);
+  FREE(ctiff->dedup);
+}
+
+/** Free the metadata cache and shared metadata state of a CTIFF.
+ *
+ * @param ctiff The CTIFF whose state to free.
+ */
+void __CTIFFFreeDedup(CTIFF ctiff)
+{
+  CTIFF_meta_cache *cache = ctiff->meta_cache;
+
+  if (cache != NULL){
+    FREE(cache->key);
+    FREE(cache->result);
+    FREE(ctiff->meta_cache);
+  }
+
+  __CTIFFFreeBase(ctiff);
+}
+
+
+/** Store metadata shared between pages once.
+ *
+ *  With dedup on, a page whose metadata differs only in a few fields from
+ *  an earlier page in the same file stores just those fields, with a
+ *  reference to the earlier page. This suits metadata that is the same for
+ *  each page apart from counters or timestamps. Readers must merge the
+ *  fields into the earlier page's metadata, as described for
+ *  __CTIFFDedupExtMeta; CTIFFReadPageMeta does this.
+ *
+ *  Dedup is off by default, so each page's metadata stands alone. It can
+ *  only be changed before the first page is added.
+ * @see __CTIFFDedupExtMeta
+ *
+ * @param ctiff The CamTIFF file to set the parameter for.
+ * @param dedup Whether to share metadata between pages.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetMetaDedup(CTIFF ctiff, bool dedup)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+
+  if (!dedup){
+    __CTIFFFreeBase(ctiff);
+    return CTIFFSUCCESS;
+  }
+
+  if (ctiff->dedup == NULL){
+    ctiff->dedup = (CTIFF_dedup*) calloc(1, sizeof(CTIFF_dedup));
+    if (ctiff->dedup == NULL) return ECTIFFMEMORY;
+  }
+
+  return CTIFFSUCCESS;
+}
+
+/** Get how often a page's metadata was the same as the previous page's.
+ *
+ *  Such metadata is not validated again. Only metadata identical to the
+ *  previous page's, byte for byte, counts as a hit, so metadata with a field
+ *  that changes every page, such as a frame counter or timestamp, never
+ *  hits and is validated in full each time. CTIFFSetMetaDedup still stores
+ *  such metadata once.
+ *
+ * @param ctiff  The CamTIFF file to query.
+ * @param hits   Set to the number of pages with the same metadata.
+ * @param misses Set to the number of pages with new metadata.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFGetMetaCacheStats(CTIFF ctiff, unsigned long *hits,
+                                        unsigned long *misses)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  *hits   = (ctiff->meta_cache != NULL) ? ctiff->meta_cache->hits   : 0;
+  *misses = (ctiff->meta_cache != NULL) ? ctiff->meta_cache->misses : 0;
+  return CTIFFSUCCESS;
+}
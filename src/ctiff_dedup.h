@@ -0,0 +1,36 @@
+/**
+ * @file ctiff_dedup.h
+ * @description Avoiding repeated work and storage for repeated metadata.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_DEDUP_H
+
+#define CTIFF_DEDUP_H
+
+#include "ctiff_types.h"
+
+int CTIFFSetMetaDedup(CTIFF ctiff, bool dedup);
+int CTIFFGetMetaCacheStats(CTIFF ctiff, unsigned long *hits,
+                                        unsigned long *misses);
+
+const char* __CTIFFCachedExtMeta(CTIFF ctiff, const char* name,
+                                              const char* ext_meta);
+const char* __CTIFFDedupExtMeta(CTIFF ctiff, const char* meta);
+bool __CTIFFDedupBaseOf(const char *meta, unsigned int *base);
+int __CTIFFDedupMerge(const char *base, const char *page, char **json);
+void __CTIFFFreeDedup(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_DEDUP_H */
@@ -34,6 +34,23 @@ enum CTIFFERRORS {
   ECTIFFWRITEDIR,
   ECTIFFWRITESTRIP,
   ECTIFFSTRICTLOCK,
+  ECTIFFQUEUEFULL,
+  ECTIFFTHREAD,
+  ECTIFFASYNCPOLICY,
+  ECTIFFMEMORY,
+  ECTIFFPREDICTOR,
+  ECTIFFCOMPRESSION,
+  ECTIFFMETADEPTH,
+  ECTIFFMETAENCODING,
+  ECTIFFREADMETA,
+  ECTIFFMETABUILD,
+  ECTIFFNOFILE,
+  ECTIFFNOTINMEMORY,
+  ECTIFFDIRECTIO,
+  ECTIFFWRITEDEPTH,
+  ECTIFFTILESIZE,
+  ECTIFFWRITETILE,
+  ECTIFFAFTERFIRSTPAGE, // Setting can only be changed before the first page.
   ECTIFFNR
 };
 
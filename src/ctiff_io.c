@@ -25,6 +25,10 @@
 #include "ctiff_settings.h"
 #include "ctiff_write.h"
 #include "ctiff_data.h"
+#include "ctiff_async.h"
+#include "ctiff_rollover.h"
+#include "ctiff_bufio.h"
+#include "ctiff_memio.h"
 
 #include <stdlib.h>  // malloc
 #include <string.h>  // memset
@@ -38,6 +42,12 @@
  *  modify the defaults through the Set functions. One is required to call
  *  CTIFFSetStyle before adding any directories, as the defaults will not
  *  match the image data added.
+ *
+ *  The file is a classic TIFF, which cannot grow past 4 GiB. When built
+ *  against libTIFF 4.0 or newer, use CTIFFNewBig for larger acquisitions.
+ *  Writes to the file are collected in a buffer of
+ *  CTIFF_IO_BUFFER_BYTES rather than made one strip or tag at a time.
+ * @see CTIFFNewBig
  * @see CTIFFSetStyle
  * @see CTIFFWrite
  * @see CTIFFClose
@@ -47,44 +57,190 @@
  */
 CTIFF CTIFFNew(const char* output_file)
 {
-  CTIFF                      ctiff = (CTIFF) malloc(sizeof(struct CTIFF_s));
-  CTIFF_dir               *def_dir = (CTIFF_dir*) malloc(sizeof(CTIFF_dir));
-  CTIFF_dir_style           *style = &def_dir->style;
-  CTIFF_basic_metadata     *b_meta = &def_dir->basic_meta;
-  CTIFF_extended_metadata  *e_meta = &def_dir->ext_meta;
+  return __CTIFFNew(output_file, "w", NULL, NULL);
+}
+
+
+#ifdef TIFF_VERSION_BIG  // Only defined by libTIFF 4.0+
+/** Create a new CTIFF file structure that writes a BigTIFF file.
+ *
+ *  BigTIFF uses 64 bit offsets, so the file may grow past the 4 GiB limit of
+ *  classic TIFF. Readers must support BigTIFF to open it. BigTIFF needs
+ *  libTIFF 4.0 or newer, so this is only built against it; with an older
+ *  libTIFF (such as the bundled 3.9.5) it is neither built nor exported.
+ * @see CTIFFNew
+ *
+ * @param output_file The location where the file will be written.
+ * @return A pointer to the new CTIFF on success, NULL on failure.
+ */
+CTIFF CTIFFNewBig(const char* output_file)
+{
+  return __CTIFFNew(output_file, "w8", NULL, NULL);
+}
+#endif
+
+
+/** Create a new CTIFF file structure that writes through callbacks.
+ *
+ *  Instead of a file, the CamTIFF file is written with the read, write,
+ *  seek and size callbacks, for instance to a socket or a file opened by
+ *  the caller. Reads are only made of data written before. As with
+ *  CTIFFNew, writes are collected in a buffer of CTIFF_IO_BUFFER_BYTES, and
+ *  the callbacks are mostly called with large, sequential writes.
+ *
+ *  The handle is passed to every callback, and closed with the close
+ *  callback by CTIFFClose. If NULL is returned it is not closed. As there is
+ *  no file name to number, CTIFFSetRollover cannot be used.
+ * @see CTIFF_io_procs
+ * @see CTIFFNew
+ *
+ * @param name   A name for the file, used in libTIFF's messages.
+ * @param handle The destination, passed to each callback.
+ * @param procs  The callbacks, copied.
+ * @return A pointer to the new CTIFF on success, NULL on failure.
+ */
+CTIFF CTIFFNewWithIO(const char *name, void *handle,
+                     const CTIFF_io_procs *procs)
+{
+  if (procs == NULL) return NULL;
+  if (name == NULL) name = "CamTIFF";
+
+  return __CTIFFNew(name, "w", handle, procs);
+}
+
+
+/** Create a new CTIFF file structure that is written to memory.
+ *
+ *  The file is built in a buffer that grows as pages are written, with no
+ *  file system involved. Close it with CTIFFCloseMemory to take the
+ *  finished file; CTIFFClose discards it. As there is no file name to
+ *  number, CTIFFSetRollover cannot be used.
+ * @see CTIFFCloseMemory
+ * @see CTIFFNew
+ *
+ * @return A pointer to the new CTIFF on success, NULL on failure.
+ */
+CTIFF CTIFFNewMemory(void)
+{
+  CTIFF_membuf *membuf;
+  CTIFF ctiff;
+
+  membuf = (CTIFF_membuf*) calloc(1, sizeof(CTIFF_membuf));
+  if (membuf == NULL) return NULL;
+
+  if ((ctiff = __CTIFFNew("memory", "w", membuf, &__CTIFFMemProcs)) == NULL){
+    FREE(membuf->data);
+    FREE(membuf);
+    return NULL;
+  }
+
+  ctiff->membuf = membuf;
+  return ctiff;
+}
+
+
+/** Create a new CTIFF file structure writing with the given libTIFF mode.
+ *
+ * @param output_file The location where the file will be written.
+ * @param mode        The libTIFF open mode.
+ * @param handle      Passed to the callbacks.
+ * @param procs       The callbacks to write with, NULL to write output_file.
+ * @return A pointer to the new CTIFF on success, NULL on failure.
+ */
+CTIFF __CTIFFNew(const char* output_file, const char* mode,
+                 void *handle, const CTIFF_io_procs *procs)
+{
+  CTIFF                      ctiff;
+  CTIFF_dir               *def_dir;
+  CTIFF_dir_style           *style;
+  CTIFF_basic_metadata     *b_meta;
+  CTIFF_extended_metadata  *e_meta;
 
   // TODO: If output_file == NULL, write to tmp location?
   if (output_file == NULL) return NULL;
 
-  if ((ctiff->tiff = TIFFOpen(output_file, "w")) == NULL){
+  ctiff   = (CTIFF) malloc(sizeof(struct CTIFF_s));
+  def_dir = (CTIFF_dir*) malloc(sizeof(CTIFF_dir));
+  if (ctiff == NULL || def_dir == NULL){
+    FREE(ctiff);
+    FREE(def_dir);
+    return NULL;
+  }
+
+  style  = &def_dir->style;
+  b_meta = &def_dir->basic_meta;
+  e_meta = &def_dir->ext_meta;
+
+  if (procs == NULL){
+    ctiff->tiff = __CTIFFFileOpen(output_file, mode);
+  } else {
+    // Writes to memory are cheap enough not to need buffering.
+    ctiff->tiff = __CTIFFClientOpen(output_file, mode, handle, procs,
+                                    (procs == &__CTIFFMemProcs) ? 0 :
+                                    CTIFF_IO_BUFFER_BYTES);
+  }
+
+  if (ctiff->tiff == NULL){
     FREE(ctiff);
+    FREE(def_dir);
     return NULL;
   }
 
   // Set root level information
   ctiff->output_file     = output_file;
+  ctiff->open_mode       = mode;
   ctiff->num_dirs        = 0;
   ctiff->num_page_styles = 1;
   ctiff->strict          = true;
+  ctiff->strict_lock     = false;
+  ctiff->meta_depth      = CTIFF_DEFAULT_META_DEPTH + 1;
 
   // Safer to write as soon as possible in case the image data disappears.
   ctiff->write_every_num = 1;
   ctiff->num_unwritten   = 0;
 
-  ctiff->first_node = NULL;
-  ctiff->last_node  = NULL;
-  ctiff->write_ptr  = NULL;
+  ctiff->ring       = NULL;
+  ctiff->ring_size  = 0;
+  ctiff->ring_head  = 0;
+  ctiff->live_dirs  = 0;
+  ctiff->held_bytes = 0;
+  ctiff->peak_bytes = 0;
+  ctiff->async      = NULL;
+  ctiff->pool       = NULL;
+  ctiff->workers    = NULL;
+  ctiff->rollover   = NULL;
+  ctiff->meta_stream = NULL;
+  ctiff->meta_cache  = NULL;
+  ctiff->dedup       = NULL;
+  ctiff->cbor        = NULL;
+  ctiff->meta_builder = NULL;
+  ctiff->copy_pages = false;
+  ctiff->custom_io  = (procs != NULL);
+  ctiff->expected_pages = 0;
+  ctiff->expected_bytes = 0;
+  ctiff->direct_io  = false;
+  ctiff->write_depth = 0;
+  ctiff->membuf     = NULL;
 
   // Set def dir def data pointers
-  def_dir->timestamp   = NULL;
+  def_dir->time_ns      = 0;
+  def_dir->monotonic_ns = 0;
   def_dir->data        = NULL;
-  def_dir->refs        = 0;
+  def_dir->data_owned  = false;
   def_dir->write_count = 0;
+  def_dir->bytes       = 0;
 
   // Set basic def dir style.
   style->black_is_min = true;
+  style->predictor    = CTIFF_PREDICTOR_NONE;
+  style->compression  = CTIFF_COMPRESSION_LZW;
+  style->compression_level = 0;
   style->x_res        = 72;
   style->y_res        = 72;
+  style->rows_per_strip = 0;
+  style->strip_bytes    = CTIFF_DEFAULT_STRIP_BYTES;
+  style->tile_width     = 0;
+  style->tile_height    = 0;
 
   // Set basic metadata
   b_meta->artist     = NULL;
@@ -113,10 +269,85 @@ CTIFF CTIFFNew(const char* output_file)
  */
 int CTIFFClose(CTIFF ctiff)
 {
+  int retval;
+
   if (ctiff == NULL) return ECTIFFNULL;
 
-  TIFFClose(ctiff->tiff);
+  // Waits for any queued pages to be written first.
+  retval = __CTIFFAsyncStop(ctiff);
+
+  if (retval == CTIFFSUCCESS){
+    retval = __CTIFFRolloverFinish(ctiff);
+  } else {
+    __CTIFFRolloverFinish(ctiff);
+  }
+
+  if (retval == CTIFFSUCCESS){
+    retval = __CTIFFBufClose(ctiff->tiff);
+  } else {
+    __CTIFFBufClose(ctiff->tiff);
+  }
+
   __CTIFFFree(ctiff);
 
-  return CTIFFSUCCESS;
+  return retval;
+}
+
+
+/** Close a CTIFF file written to memory, and take the finished file.
+ *
+ *  Pages not yet written are written first, with CTIFFWrite, since a file
+ *  missing them would be of no use once the CTIFF is gone. The file is
+ *  handed over as it is, without being copied, and must be freed with
+ *  CTIFFFreeBuffer. On failure no file is returned.
+ * @see CTIFFWrite
+ * @see CTIFFNewMemory
+ * @see CTIFFFreeBuffer
+ *
+ * @param ctiff The CTIFF file to close, created with CTIFFNewMemory.
+ * @param data  Set to the contents of the file.
+ * @param size  Set to the size of the file in bytes.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFCloseMemory(CTIFF ctiff, void **data, size_t *size)
+{
+  CTIFF_membuf *membuf;
+  int retval;
+
+  if (ctiff == NULL || data == NULL || size == NULL) return ECTIFFNULL;
+
+  *data = NULL;
+  *size = 0;
+
+  if ((membuf = ctiff->membuf) == NULL) return ECTIFFNOTINMEMORY;
+
+  retval = CTIFFWrite(ctiff);
+
+  // Keep the buffer from being freed with the CTIFF.
+  ctiff->membuf = NULL;
+  if (retval == CTIFFSUCCESS){
+    retval = CTIFFClose(ctiff);
+  } else {
+    CTIFFClose(ctiff);
+  }
+
+  if (retval == CTIFFSUCCESS){
+    *data = membuf->data;
+    *size = (size_t) membuf->size;
+  } else {
+    FREE(membuf->data);
+  }
+
+  FREE(membuf);
+  return retval;
+}
+
+/** Free a file returned by CTIFFCloseMemory.
+ * @see CTIFFCloseMemory
+ *
+ * @param data The contents of the file.
+ */
+void CTIFFFreeBuffer(void *data)
+{
+  free(data);
 }
@@ -22,9 +22,21 @@
 
 #define CTIFF_IO_H
 
+#include <tiffio.h>  // libTIFF (preferably 3.9.5+)
+
 #include "ctiff_types.h"
 
 CTIFF CTIFFNew(const char* output_file);
+#ifdef TIFF_VERSION_BIG  // Only defined by libTIFF 4.0+
+CTIFF CTIFFNewBig(const char* output_file);
+#endif
+CTIFF CTIFFNewWithIO(const char *name, void *handle,
+                     const CTIFF_io_procs *procs);
+CTIFF __CTIFFNew(const char* output_file, const char* mode,
+                 void *handle, const CTIFF_io_procs *procs);
+CTIFF CTIFFNewMemory(void);
 int CTIFFClose(CTIFF ctiff);
+int CTIFFCloseMemory(CTIFF ctiff, void **data, size_t *size);
+void CTIFFFreeBuffer(void *data);
 
 #endif /* end of include guard: CTIFF_IO_H */
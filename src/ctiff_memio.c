@@ -0,0 +1,152 @@
+/**
+ * @file ctiff_memio.c
+ * @description libTIFF I/O to a growable memory buffer.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h> // realloc
+#include <string.h> // memcpy, memset
+#include <stdio.h>  // SEEK_SET
+
+#include "ctiff_memio.h"
+
+static tsize_t __CTIFFMemRead(thandle_t fd, tdata_t data, tsize_t size)
+{
+  CTIFF_membuf *buf = (CTIFF_membuf*) fd;
+  tsize_t avail;
+
+  if (buf->pos >= buf->size) return 0;
+
+  avail = (tsize_t) (buf->size - buf->pos);
+  if (size > avail) size = avail;
+
+  memcpy(data, buf->data + buf->pos, (size_t) size);
+  buf->pos += size;
+  return size;
+}
+
+static tsize_t __CTIFFMemWrite(thandle_t fd, tdata_t data, tsize_t size)
+{
+  CTIFF_membuf *buf = (CTIFF_membuf*) fd;
+  toff_t end = buf->pos + size;
+  toff_t capacity;
+  char *grown;
+
+  if (end < buf->pos) return -1;
+
+  if (end > buf->capacity){
+    capacity = buf->capacity ? buf->capacity : 64*1024;
+    while (capacity < end) capacity *= 2;
+
+    if ((grown = (char*) realloc(buf->data, (size_t) capacity)) == NULL){
+      return -1;
+    }
+    buf->data     = grown;
+    buf->capacity = capacity;
+  }
+
+  // Seeking past the end leaves a hole, which reads back as zeros.
+  if (buf->pos > buf->size){
+    memset(buf->data + buf->size, 0, (size_t) (buf->pos - buf->size));
+  }
+
+  memcpy(buf->data + buf->pos, data, (size_t) size);
+  buf->pos = end;
+  if (end > buf->size) buf->size = end;
+
+  return size;
+}
+
+static toff_t __CTIFFMemSeek(thandle_t fd, toff_t off, int whence)
+{
+  CTIFF_membuf *buf = (CTIFF_membuf*) fd;
+
+  switch (whence) {
+    case SEEK_SET: buf->pos  = off;             break;
+    case SEEK_CUR: buf->pos += off;             break;
+    case SEEK_END: buf->pos  = buf->size + off; break;
+    default:       return (toff_t) -1;
+  }
+
+  return buf->pos;
+}
+
+// The buffer belongs to the caller, who frees it after closing the TIFF.
+static int __CTIFFMemClose(thandle_t fd)
+{
+  (void) fd;
+  return 0;
+}
+
+static toff_t __CTIFFMemSize(thandle_t fd)
+{
+  return ((CTIFF_membuf*) fd)->size;
+}
+
+static int __CTIFFMemMap(thandle_t fd, tdata_t* pbase, toff_t* psize)
+{
+  (void) fd; (void) pbase; (void) psize;
+  return 0;
+}
+
+static void __CTIFFMemUnmap(thandle_t fd, tdata_t base, toff_t size)
+{
+  (void) fd; (void) base; (void) size;
+}
+
+// The same, as callbacks for __CTIFFClientOpen.
+
+static long long __CTIFFMemProcRead(void *handle, void *data, size_t size)
+{
+  return __CTIFFMemRead((thandle_t) handle, (tdata_t) data, (tsize_t) size);
+}
+
+static long long __CTIFFMemProcWrite(void *handle, const void *data,
+                                     size_t size)
+{
+  return __CTIFFMemWrite((thandle_t) handle, (tdata_t) data, (tsize_t) size);
+}
+
+static long long __CTIFFMemProcSeek(void *handle, long long offset,
+                                    int whence)
+{
+  return __CTIFFMemSeek((thandle_t) handle, (toff_t) offset, whence);
+}
+
+static long long __CTIFFMemProcSize(void *handle)
+{
+  return __CTIFFMemSize((thandle_t) handle);
+}
+
+/** Callbacks writing to a CTIFF_membuf, with the buffer as the handle. */
+const CTIFF_io_procs __CTIFFMemProcs = {
+  __CTIFFMemProcRead, __CTIFFMemProcWrite,
+  __CTIFFMemProcSeek, __CTIFFMemProcSize, NULL
+};
+
+/** Open a TIFF that lives in a memory buffer.
+ *
+ * @param buf  The buffer, zeroed for a new file.
+ * @param mode The libTIFF open mode.
+ * @return     The TIFF, or NULL on failure.
+ */
+TIFF* __CTIFFMemOpen(CTIFF_membuf *buf, const char *mode)
+{
+  return TIFFClientOpen("memory", mode, (thandle_t) buf,
+                        __CTIFFMemRead, __CTIFFMemWrite,
+                        __CTIFFMemSeek, __CTIFFMemClose,
+                        __CTIFFMemSize,
+                        __CTIFFMemMap, __CTIFFMemUnmap);
+}
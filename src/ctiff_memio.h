@@ -0,0 +1,43 @@
+/**
+ * @file ctiff_memio.h
+ * @description libTIFF I/O to a growable memory buffer.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_MEMIO_H
+
+#define CTIFF_MEMIO_H
+
+#include <tiffio.h>  // libTIFF (preferably 3.9.5+)
+
+#include "ctiff_types.h"
+
+/** A growable memory buffer that libTIFF reads and writes like a file.
+ *
+ *  Should be zeroed before use, and its data freed with free once the TIFF
+ *  using it has been closed.
+ */
+typedef struct CTIFF_membuf_s {
+  char   *data;
+  toff_t  size;     // Size of the "file", the end of the furthest write.
+  toff_t  capacity; // Allocated size of data.
+  toff_t  pos;      // Current file offset.
+} CTIFF_membuf;
+
+extern const CTIFF_io_procs __CTIFFMemProcs;
+
+TIFF* __CTIFFMemOpen(CTIFF_membuf *buf, const char *mode);
+
+#endif /* end of include guard: CTIFF_MEMIO_H */
@@ -26,12 +26,22 @@
  */
 
 #include <stdlib.h>
-#include <stdio.h>  // sprintf
-#include <string.h> // memset
+#include <string.h> // memcpy
+
+// SSE2 is always available on x86-64, and on x86 when the compiler uses it.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CTIFF_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h> // _BitScanForward
+#endif
+#endif
 
 #include "ctiff_meta.h"
 #include "ctiff_util.h"
 #include "ctiff_types.h"
+#include "ctiff_error.h"
 #include "ctiff_vers.h"
 
 
@@ -42,6 +52,23 @@ typedef struct JSON_checker_struct {
     int* stack;
 } * JSON_checker;
 
+/** The size of the mode stack for the default nesting depth. Deeper
+ *  metadata needs a stack allocated to size.
+ */
+#define JSON_CHECKER_DEPTH (CTIFF_DEFAULT_META_DEPTH + 1)
+
+/** Turn a macro's value into a string literal. */
+#define __CTIFFSTR(x) #x
+#define CTIFFSTR(x) __CTIFFSTR(x)
+
+/** The CamTIFF information at the start of each page's metadata. */
+#define CTIFF_EXT_HEAD "\"ctiff\":\"" CTIFF_SPECIFICATION "\"," \
+                       "\"libctiff\":\"" CTIFFSTR(CTIFFLIB_MAJOR_VERSION) "." \
+                                          CTIFFSTR(CTIFFLIB_MINOR_VERSION) "." \
+                                          CTIFFSTR(CTIFFLIB_MAINT_VERSION) \
+                                          CTIFFLIB_TESTING_VERSION "\"," \
+                       "\"strict\":"
+
 #define __   -1     /* the universal error code */
 
 /** Define the type of a symbol in a JSON string.
@@ -90,7 +117,7 @@ enum classes {
  *  The remaining Unicode characters should be mapped to C_ETC.
  *  Non-whitespace control characters are errors.
  */
-static int ascii_class[128] = {
+static const int ascii_class[128] = {
     __,      __,      __,      __,      __,      __,      __,      __,
     __,      C_WHITE, C_WHITE, __,      __,      C_WHITE, __,      __,
     __,      __,      __,      __,      __,      __,      __,      __,
@@ -159,7 +186,7 @@ enum states {
  *  negative number. A JSON text is accepted if at the end of the text the
  *  state is OK and if the mode is MODE_DONE.
  */
-static int state_transition_table[NR_STATES][NR_CLASSES] = {
+static const int state_transition_table[NR_STATES][NR_CLASSES] = {
 /*               white                                      1-9                                   ABCDF  etc
              space |  {  }  [  ]  :  ,  "  \  /  +  -  .  0  |  a  b  c  d  e  f  l  n  r  s  t  u  |  E  |*/
 /*start  GO*/ {GO,GO,-6,__,-5,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__,__},
@@ -203,10 +230,10 @@ enum modes {
     MODE_OBJECT,
 };
 
-/** Delete the JSON_checker object.
+/** Reject the JSON string.
  *
- *  Frees the memory associated with the JSON parser if the JSON string is
- *  invalid.
+ *  The JSON_checker and its stack belong to the caller, so there is nothing
+ *  to free.
  *
  * @param jc The JSON_checker automaton structure.
  * @return false always.
@@ -214,8 +241,7 @@ enum modes {
 static int
 reject(JSON_checker jc)
 {
-    free((void*)jc->stack);
-    free((void*)jc);
+    (void) jc;
     return false;
 }
 
@@ -255,32 +281,29 @@ pop(JSON_checker jc, int mode)
 }
 
 
-/** Create new JSON checker object.
+/** Start a JSON checker.
  *
- *  new_JSON_checker starts the checking process by constructing a JSON_checker
- *  object. It takes a depth parameter that restricts the level of maximum
- *  nesting.
+ *  init_JSON_checker starts the checking process by resetting a JSON_checker
+ *  object owned by the caller. The caller also provides the mode stack, whose
+ *  size restricts the level of maximum nesting. Nothing is allocated, so a
+ *  checker on the stack can check any number of strings.
  *
  *  To continue the process, call JSON_checker_char for each character in the
  *  JSON text, and then call JSON_checker_done to obtain the final result.
  *  These functions are fully reentrant.
  *
- *  The JSON_checker object will be deleted by JSON_checker_done.
- *  JSON_checker_char will delete the JSON_checker object if it sees an error.
- *
+ *  @param jc    The JSON_checker to start.
+ *  @param stack The mode stack, of at least depth elements.
  *  @param depth The size of the mode stack.
- *  @return A JSON_checker struct.
  */
-JSON_checker
-new_JSON_checker(int depth)
+static void
+init_JSON_checker(JSON_checker jc, int* stack, int depth)
 {
-    JSON_checker jc = (JSON_checker)malloc(sizeof(struct JSON_checker_struct));
     jc->state = GO;
     jc->depth = depth;
     jc->top = -1;
-    jc->stack = (int*)calloc(depth, sizeof(int));
+    jc->stack = stack;
     push(jc, MODE_DONE);
-    return jc;
 }
 
 
@@ -288,15 +311,15 @@ new_JSON_checker(int depth)
  *
  *  After calling new_JSON_checker, call this function for each character (or
  *  partial character) in your JSON text. It can accept UTF-8, UTF-16, or
- *  UTF-32. It returns true if things are looking ok so far. If it rejects the
- *  text, it deletes the JSON_checker object and returns false.
+ *  UTF-32. It returns true if things are looking ok so far, and false if it
+ *  rejects the text.
  *
  * @param jc        The JSON_checker automaton structure.
  * @param next_char The next character in the string to test.
  * @return          next_char if it is not whitespace. -1 if it is white
  *                  space. 0/false on failure.
  */
-char
+static char
 JSON_checker_char(JSON_checker jc, int next_char)
 {
     int retchar = next_char;
@@ -418,154 +441,526 @@ JSON_checker_char(JSON_checker jc, int next_char)
  *
  *  The JSON_checker_done function should be called after all of the characters
  *  have been processed, but only if every call to JSON_checker_char returned
- *  true. This function deletes the JSON_checker and returns true if the JSON
- *  text was accepted.
+ *  true. This function returns true if the JSON text was accepted.
  *
  * @param jc The JSON_checker automaton structure.
  * @return   True is the JSON is valid, false if not.
  */
-int
+static int
 JSON_checker_done(JSON_checker jc)
 {
-    int result = jc->state == OK && pop(jc, MODE_DONE);
-    reject(jc);
-    return result;
+    return jc->state == OK && pop(jc, MODE_DONE);
 }
 
-/** Validate metadata.
+/** Find the end of a run of plain characters inside a JSON string.
  *
- *  This function validates a metadata string.
+ *  Plain characters are printable ASCII other than the quote and backslash.
+ *  They never change the state of the checker while in a string and are
+ *  copied unchanged, so a whole run can be skipped at once. Sixteen
+ *  characters are tested at a time where SSE2 is available.
  *
- * @param json The metadata string.
- * @return     True if valid string, false if invalid.
+ * @param pt  The first character to test.
+ * @param end The end of the JSON string.
+ * @return    The first character that is not plain, or end.
  */
-int __CTIFFIsValidJSON(const char* json)
+static const char* __CTIFFStringRun(const char* pt, const char* end)
 {
-  int retval = 1;
-  const char *pt = json;
-  JSON_checker jc = new_JSON_checker(20);
-
-  do {
-    char next_char = *pt;
-    if (next_char <= 0) {
-      break;
+#ifdef CTIFF_SSE2
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backs = _mm_set1_epi8('\\');
+  const __m128i del   = _mm_set1_epi8(127);
+  __m128i chars, special;
+  int mask;
+#ifdef _MSC_VER
+  unsigned long first;
+#endif
+
+  while (end - pt >= 16) {
+    chars = _mm_loadu_si128((const __m128i*) pt);
+
+    // Signed compare, so bytes of 128 and above are caught as negative.
+    special = _mm_or_si128(
+                _mm_or_si128(_mm_cmplt_epi8(chars, space),
+                             _mm_cmpeq_epi8(chars, del)),
+                _mm_or_si128(_mm_cmpeq_epi8(chars, quote),
+                             _mm_cmpeq_epi8(chars, backs)));
+
+    if ((mask = _mm_movemask_epi8(special)) != 0){
+#ifdef _MSC_VER
+      _BitScanForward(&first, (unsigned long) mask);
+      return pt + first;
+#else
+      return pt + __builtin_ctz((unsigned int) mask);
+#endif
     }
-    if (!JSON_checker_char(jc, next_char)) {
-      return 0;
-    }
-  } while (*(pt++) != '\0');
+    pt += 16;
+  }
+#endif
 
-  if (!JSON_checker_done(jc)) {
-    return 0;
+  while (pt < end && *pt >= ' ' && *pt != 127 && *pt != '"' && *pt != '\\') {
+    pt++;
   }
 
-  return retval;
+  return pt;
 }
 
-void __CTIFFTarValidExtMetaError(char** ret, const char* json, bool strict)
+/** Feed part of a JSON string to a checker, minifying it.
+ *
+ *  The white space in between the keys and objects is removed in order to
+ *  create the minimal representation of a JSON object. The output is only
+ *  meaningful if the JSON is valid.
+ *
+ *  Every character goes through the checker except runs of plain string
+ *  characters, which are copied in bulk, and white space following white
+ *  space outside of strings, which is skipped. Neither can change the
+ *  checker's state, so the result is the same as checking each character.
+ *
+ *  The checker keeps its state between calls, so a string can be fed in any
+ *  number of parts. Checking stops at a NUL or non-ASCII character, as the
+ *  end of the string.
+ * @see __CTIFFStringRun
+ *
+ * @param jc    The checker, started with init_JSON_checker.
+ * @param json  The next part of the metadata string.
+ * @param len   The length of the part.
+ * @param out   Where the minified JSON is written, or NULL to only validate.
+ *              Must hold at least len characters.
+ * @param ended Set to true if checking stopped before the end of the part.
+ * @return      The length of the minified part, -1 if the JSON is invalid.
+ */
+static long __CTIFFFeedJSON(JSON_checker jc, const char* json, size_t len,
+                            char* out, bool* ended)
 {
-  char* buf;
+  const char *end = json + len;
+  const char *pt, *run_end;
+  char *buf = out;
+  char tmp_char;
+
+  for (pt = json; pt < end && *pt > 0; pt++) {
+    if (jc->state == ST && (run_end = __CTIFFStringRun(pt, end)) != pt){
+      if (buf != NULL){
+        memcpy(buf, pt, run_end - pt);
+        buf += run_end - pt;
+      }
+      pt = run_end - 1;
+      continue;
+    }
+
+    if (!(tmp_char = JSON_checker_char(jc, *pt))) return -1;
+
+    if (tmp_char != -1){
+      if (buf != NULL) *buf++ = tmp_char;
+    } else if (jc->state < ST){
+      // In these states white space leaves the state as it is.
+      while (pt + 1 < end && (pt[1] == ' '  || pt[1] == '\t' ||
+                              pt[1] == '\n' || pt[1] == '\r')) {
+        pt++;
+      }
+    }
+  }
 
-  if (ret == NULL) return;
+  *ended = (pt < end);
+  return (buf != NULL) ? (long) (buf - out) : 0;
+}
 
-  if (strict){
-    FREE(*ret);
+/** Validate and minify a JSON string in one pass.
+ * @see __CTIFFFeedJSON
+ *
+ * @param json  The metadata string.
+ * @param len   The length of the metadata string.
+ * @param out   Where the minified JSON is written, or NULL to only validate.
+ *              Must hold at least len characters.
+ * @param depth The maximum nesting of the JSON, plus one.
+ * @return      The length of the minified JSON, -1 if the JSON is invalid.
+ */
+static long __CTIFFMinifyJSON(const char* json, size_t len, char* out,
+                              unsigned int depth)
+{
+  struct JSON_checker_struct jc;
+  int stack[JSON_CHECKER_DEPTH];
+  int *deep_stack = NULL;
+  bool ended;
+  long tar_len;
+
+  if (depth > JSON_CHECKER_DEPTH){
+    if ((deep_stack = (int*) malloc(depth * sizeof(int))) == NULL) return -1;
+    init_JSON_checker(&jc, deep_stack, (int) depth);
   } else {
-    buf = *ret + strlen(json);
-    memcpy(*ret, json, sizeof(char)*strlen(json));
-    *buf = '\0';
+    init_JSON_checker(&jc, stack, (int) depth);
   }
+
+  tar_len = __CTIFFFeedJSON(&jc, json, len, out, &ended);
+  if (tar_len >= 0 && !JSON_checker_done(&jc)) tar_len = -1;
+
+  if (deep_stack != NULL) FREE(deep_stack);
+  return tar_len;
+}
+
+#ifdef CTIFF_TEST
+/** Validate and minify a JSON string one character at a time.
+ *
+ *  Every character goes through the checker, on a stack allocated for the
+ *  call. This is the plain form of __CTIFFMinifyJSON, built only to test and
+ *  benchmark the fast path against.
+ * @see __CTIFFMinifyJSON
+ *
+ * @param json  The metadata string.
+ * @param len   The length of the metadata string.
+ * @param out   Where the minified JSON is written, or NULL to only validate.
+ *              Must hold at least len characters.
+ * @param depth The maximum nesting of the JSON, plus one.
+ * @return      The length of the minified JSON, -1 if the JSON is invalid.
+ */
+long __CTIFFMinifyJSONBytewise(const char* json, size_t len, char* out,
+                               unsigned int depth)
+{
+  struct JSON_checker_struct jc;
+  const char *pt;
+  char *buf = out;
+  char tmp_char;
+  int *stack;
+  long tar_len = -1;
+
+  if ((stack = (int*) malloc(depth * sizeof(int))) == NULL) return -1;
+  init_JSON_checker(&jc, stack, (int) depth);
+
+  for (pt = json; pt < json + len && *pt > 0; pt++) {
+    if (!(tmp_char = JSON_checker_char(&jc, *pt))) break;
+    if (tmp_char != -1 && buf != NULL) *buf++ = tmp_char;
+  }
+
+  if ((pt == json + len || *pt <= 0) && JSON_checker_done(&jc)){
+    tar_len = (buf != NULL) ? (long) (buf - out) : 0;
+  }
+
+  FREE(stack);
+  return tar_len;
+}
+#endif
+
+/** Validate metadata.
+ *
+ *  This function validates a metadata string.
+ *
+ * @param json The metadata string.
+ * @return     True if valid string, false if invalid.
+ */
+int __CTIFFIsValidJSON(const char* json)
+{
+  return __CTIFFMinifyJSON(json, strlen(json), NULL, JSON_CHECKER_DEPTH) >= 0;
 }
 
 /** Validate metadata and return a compressed version.
  *
  *  This function removes the white space in between the keys and objects in
- *  order to create the minimal representation of a JSON object.
+ *  order to create the minimal representation of a JSON object. Invalid
+ *  metadata is returned as is, or NULL in strict mode.
+ * @see __CTIFFMinifyJSON
  *
- * @param json The metadata string.
- * @return     Compressed JSON string.
+ * @param json   The metadata string.
+ * @param strict Whether to reject invalid metadata.
+ * @return       Compressed JSON string, to be freed by the caller.
  */
 const char* __CTIFFTarValidExtMeta(const char* json, bool strict)
 {
   char *ret;
-  char *buf;
-  char tmp_char;
-  const char *pt;
-  JSON_checker jc;
+  size_t json_len;
+  long tar_len;
 
-  if (!((json != NULL) && (strlen(json) != 0))) return NULL;
+  if (json == NULL || (json_len = strlen(json)) == 0) return NULL;
 
-  ret = (char*) malloc(sizeof(char)*(strlen(json)+1));
-  buf = ret;
-  pt = json;
-  jc = new_JSON_checker(20);
+  if ((ret = (char*) malloc(json_len + 1)) == NULL) return NULL;
 
-  do {
-    char next_char = *pt;
-    if (next_char <= 0) {
-      break;
+  tar_len = __CTIFFMinifyJSON(json, json_len, ret, JSON_CHECKER_DEPTH);
+  if (tar_len < 0){
+    if (strict){
+      FREE(ret);
+      return NULL;
     }
-    if (!(tmp_char = JSON_checker_char(jc, next_char))) {
-      __CTIFFTarValidExtMetaError(&ret,json,strict);
-      return ret;
-    }
-    if (tmp_char != -1) *buf++ = tmp_char;
+    memcpy(ret, json, json_len);
+    tar_len = (long) json_len;
+  }
 
-  } while (*(pt++) != '\0');
+  ret[tar_len] = '\0';
+  return ret;
+}
 
-  if (!JSON_checker_done(jc)) {
-    __CTIFFTarValidExtMetaError(&ret,json,strict);
-    return ret;
+/** Write the start of a page's metadata, up to where the JSON goes.
+ *
+ *  This is the CamTIFF information header followed, if there is a name, by
+ *  the name as a key. The buffer must hold CTIFF_EXT_HEAD_SIZE characters
+ *  plus the length of the name.
+ *
+ * @param buf      Where to write.
+ * @param strict   Whether the metadata is strictly checked.
+ * @param name     The key of the metadata, or NULL.
+ * @param name_len The length of the name.
+ * @return         The number of characters written.
+ */
+static size_t __CTIFFExtMetaHead(char *buf, bool strict,
+                                 const char *name, size_t name_len)
+{
+  static const char head[] = CTIFF_EXT_HEAD;
+  const char *strict_str = strict ? "true" : "false";
+  size_t strict_len = strict ? 4 : 5;
+  char *pt = buf;
+
+  *pt++ = '{';
+  memcpy(pt, head, sizeof(head) - 1);
+  pt += sizeof(head) - 1;
+  memcpy(pt, strict_str, strict_len);
+  pt += strict_len;
+
+  if (name != NULL){
+    *pt++ = ',';
+    *pt++ = '"';
+    memcpy(pt, name, name_len);
+    pt += name_len;
+    *pt++ = '"';
+    *pt++ = ':';
   }
 
-  *buf = '\0';
-  return ret;
+  return pt - buf;
 }
 
+/** The most characters that surround the JSON: the header and strict value,
+ *  the quotes, comma and colon around the name, the closing brace and NUL.
+ */
+#define CTIFF_EXT_HEAD_SIZE (1 + sizeof(CTIFF_EXT_HEAD) - 1 + 5 + 4 + 2)
+
 /** Validate metadata and add CTIFF information header.
  *
  *  This function removes the white space in between the keys and objects in
  *  order to create the minimal representation of a JSON object. Additionally
  *  it adds information about the CamTIFF file.
+ *
+ *  The metadata is minified straight into the returned string, which is the
+ *  only allocation made unless the nesting depth is above the default.
  * @see __CTIFFTarValidExtMeta
  *
- * @param json The metadata string.
- * @return     Compressed JSON string.
+ * @param strict   Whether to drop invalid metadata.
+ * @param depth    The maximum nesting of the metadata, plus one.
+ * @param name     The key of the metadata.
+ * @param ext_meta The metadata string.
+ * @return         Compressed JSON string, to be freed by the caller.
  */
-const char* __CTIFFCreateValidExtMeta(bool strict, const char* name,
-                                      const char* ext_meta)
+const char* __CTIFFCreateValidExtMeta(bool strict, unsigned int depth,
+                                      const char* name, const char* ext_meta)
 {
-  char *buf;
-  char *head_buf = (char*) malloc(sizeof(char)*128);
-  const char* tar_ext_meta;
-  const char *CTIFF_ext_head = "\"ctiff\":\"%s\",\"libctiff\":\"%d.%d.%d%s\","
-                               "\"strict\":%s";
-
-  // Make the head first, can be of variable size
-  sprintf(head_buf, CTIFF_ext_head, CTIFF_SPECIFICATION,
-                                    CTIFFLIB_MAJOR_VERSION,
-                                    CTIFFLIB_MINOR_VERSION,
-                                    CTIFFLIB_MAINT_VERSION,
-                                    CTIFFLIB_TESTING_VERSION,
-                                    strict ? "true" : "false");
-
-  // This must be freed if it is not NULL!
-  tar_ext_meta = __CTIFFTarValidExtMeta(ext_meta, strict);
-
-  // If we have valid metadata and a valid name
-  if ( (tar_ext_meta != NULL) && (name != NULL && strlen(name) != 0) ){
-    buf = (char*) malloc(6 + strlen(head_buf) +
-                             strlen(name) + strlen(tar_ext_meta) + 1);
-    sprintf(buf, "{%s,\"%s\":%s}", head_buf,
-                                   name,
-                                   tar_ext_meta);
+  size_t name_len = (name != NULL)     ? strlen(name)     : 0;
+  size_t meta_len = (ext_meta != NULL) ? strlen(ext_meta) : 0;
+  char *buf, *pt;
+  long tar_len;
+
+  buf = (char*) malloc(CTIFF_EXT_HEAD_SIZE + name_len + meta_len);
+  if (buf == NULL) return NULL;
+
+  // If we have metadata and a valid name
+  if (meta_len != 0 && name_len != 0){
+    pt = buf + __CTIFFExtMetaHead(buf, strict, name, name_len);
+
+    if ((tar_len = __CTIFFMinifyJSON(ext_meta, meta_len, pt, depth)) >= 0){
+      pt += tar_len;
+    } else if (!strict){
+      memcpy(pt, ext_meta, meta_len);
+      pt += meta_len;
+    } else {
+      pt = buf + __CTIFFExtMetaHead(buf, strict, NULL, 0);
+    }
   } else {
-    buf = (char *) malloc(2 + strlen(head_buf) + 1);
-    sprintf(buf, "{%s}", head_buf);
+    pt = buf + __CTIFFExtMetaHead(buf, strict, NULL, 0);
   }
 
+  *pt++ = '}';
+  *pt   = '\0';
+  return buf;
+}
+
+/** Add the CTIFF header to metadata that is already minified.
+ *
+ * @param strict   Whether the metadata is strictly checked.
+ * @param name     The key of the metadata.
+ * @param meta     The metadata, or NULL for none.
+ * @param meta_len The length of the metadata.
+ * @return         JSON string, to be freed by the caller.
+ */
+const char* __CTIFFWrapExtMeta(bool strict, const char *name,
+                               const char *meta, size_t meta_len)
+{
+  size_t name_len = (name != NULL) ? strlen(name) : 0;
+  char *buf, *pt;
+
+  if (meta == NULL || name_len == 0){
+    meta     = NULL;
+    meta_len = 0;
+  }
 
-  if (tar_ext_meta != NULL) FREE(tar_ext_meta);
-  FREE(head_buf);
+  buf = (char*) malloc(CTIFF_EXT_HEAD_SIZE + name_len + meta_len);
+  if (buf == NULL) return NULL;
+
+  pt = buf + __CTIFFExtMetaHead(buf, strict, meta ? name : NULL, name_len);
+  if (meta_len != 0) memcpy(pt, meta, meta_len);
+  pt += meta_len;
+
+  *pt++ = '}';
+  *pt   = '\0';
   return buf;
 }
+
+
+/** Metadata being received in parts, checked as each part arrives.
+ *
+ *  The buffers are kept between pages, so streaming the metadata of every
+ *  page only allocates once the buffers have grown to the largest size.
+ */
+typedef struct CTIFF_meta_stream_s {
+  struct JSON_checker_struct jc;
+  int          *stack;
+  unsigned int  depth;      // Size of the stack.
+  bool          strict;     // Strict mode when the metadata was started.
+  bool          started;    // A page's metadata is being received.
+  bool          rejected;   // The metadata is not valid JSON.
+  bool          ended;      // Checking stopped at a NUL or non-ASCII byte.
+  size_t        in_len;     // Characters received.
+  char         *tar;        // The minified metadata so far.
+  size_t        tar_len;
+  size_t        tar_cap;
+  char         *raw;        // The metadata as received, if not strict.
+  size_t        raw_len;
+  size_t        raw_cap;
+} CTIFF_meta_stream;
+
+
+/** Check and store the next part of a page's metadata.
+ *
+ *  The first part after a page is added starts new metadata, using the
+ *  strict mode and nesting depth of the CTIFF at that time.
+ *
+ * @param ctiff The CTIFF receiving the metadata.
+ * @param chunk The next part of the metadata.
+ * @param len   The length of the part.
+ * @return      CTIFFSUCCESS (0) on success, ECTIFFINVALIDEXTMETA if the
+ *              metadata is already known to be invalid, or another non-zero
+ *              CamTIFF error on failure.
+ */
+int __CTIFFMetaStreamFeed(CTIFF ctiff, const char *chunk, size_t len)
+{
+  CTIFF_meta_stream *stream = ctiff->meta_stream;
+  int *stack;
+  long tar_len;
+
+  if (stream == NULL){
+    stream = (CTIFF_meta_stream*) calloc(1, sizeof(CTIFF_meta_stream));
+    if (stream == NULL) return ECTIFFMEMORY;
+    ctiff->meta_stream = stream;
+  }
+
+  if (!stream->started){
+    if (stream->depth < ctiff->meta_depth){
+      stack = (int*) realloc(stream->stack, ctiff->meta_depth * sizeof(int));
+      if (stack == NULL) return ECTIFFMEMORY;
+      stream->stack = stack;
+      stream->depth = ctiff->meta_depth;
+    }
+
+    init_JSON_checker(&stream->jc, stream->stack, (int) ctiff->meta_depth);
+    stream->strict   = ctiff->strict;
+    stream->started  = true;
+    stream->rejected = false;
+    stream->ended    = false;
+    stream->in_len   = 0;
+    stream->tar_len  = 0;
+    stream->raw_len  = 0;
+  }
+
+  // Invalid metadata is kept as is when not strict.
+  if (!stream->strict){
+    if (__CTIFFReserve(&stream->raw, &stream->raw_cap,
+                                 stream->raw_len + len) != CTIFFSUCCESS){
+      return ECTIFFMEMORY;
+    }
+    memcpy(stream->raw + stream->raw_len, chunk, len);
+    stream->raw_len += len;
+  }
+
+  stream->in_len += len;
+
+  if (stream->rejected) return ECTIFFINVALIDEXTMETA;
+  if (stream->ended)    return CTIFFSUCCESS;
+
+  if (__CTIFFReserve(&stream->tar, &stream->tar_cap,
+                               stream->tar_len + len) != CTIFFSUCCESS){
+    return ECTIFFMEMORY;
+  }
+
+  tar_len = __CTIFFFeedJSON(&stream->jc, chunk, len,
+                            stream->tar + stream->tar_len, &stream->ended);
+  if (tar_len < 0){
+    stream->rejected = true;
+    return ECTIFFINVALIDEXTMETA;
+  }
+
+  stream->tar_len += tar_len;
+  return CTIFFSUCCESS;
+}
+
+/** Finish the metadata received in parts and add the CTIFF header.
+ *
+ *  The same as __CTIFFCreateValidExtMeta for the whole metadata string.
+ * @see __CTIFFCreateValidExtMeta
+ *
+ * @param ctiff The CTIFF receiving the metadata.
+ * @param name  The key of the metadata.
+ * @return      Compressed JSON string, to be freed by the caller.
+ */
+const char* __CTIFFMetaStreamFinish(CTIFF ctiff, const char *name)
+{
+  CTIFF_meta_stream *stream = ctiff->meta_stream;
+  const char *meta = NULL;
+  size_t meta_len = 0;
+  bool strict = ctiff->strict;
+
+  if (stream != NULL && stream->started){
+    strict = stream->strict;
+    stream->started = false;
+
+    if (!stream->rejected && JSON_checker_done(&stream->jc)){
+      meta     = stream->tar;
+      meta_len = stream->tar_len;
+    } else if (!strict){
+      meta     = stream->raw;
+      meta_len = stream->raw_len;
+    }
+
+    // Empty metadata is left out, as with __CTIFFCreateValidExtMeta.
+    if (stream->in_len == 0) meta = NULL;
+  }
+
+  return __CTIFFWrapExtMeta(strict, name, meta, meta_len);
+}
+
+/** Drop any metadata received in parts for the next page.
+ *
+ * @param ctiff The CTIFF receiving the metadata.
+ */
+void __CTIFFMetaStreamDrop(CTIFF ctiff)
+{
+  if (ctiff->meta_stream != NULL) ctiff->meta_stream->started = false;
+}
+
+/** Free the metadata stream of a CTIFF.
+ *
+ * @param ctiff The CTIFF whose metadata stream to free.
+ */
+void __CTIFFFreeMetaStream(CTIFF ctiff)
+{
+  CTIFF_meta_stream *stream = ctiff->meta_stream;
+
+  if (stream == NULL) return;
+
+  FREE(stream->stack);
+  FREE(stream->tar);
+  FREE(stream->raw);
+  FREE(ctiff->meta_stream);
+}
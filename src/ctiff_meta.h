@@ -24,11 +24,25 @@
 
 #define CTIFF_META_H
 
+#include <stddef.h> // size_t
+
 #include "ctiff_types.h"
 
 int __CTIFFIsValidJSON(const char* json);
 const char* __CTIFFTarValidExtMeta(const char* json, bool strict);
-const char* __CTIFFCreateValidExtMeta(bool strict, const char* name,
-                                      const char* ext_meta);
+const char* __CTIFFCreateValidExtMeta(bool strict, unsigned int depth,
+                                      const char* name, const char* ext_meta);
+const char* __CTIFFWrapExtMeta(bool strict, const char *name,
+                               const char *meta, size_t meta_len);
+
+#ifdef CTIFF_TEST
+long __CTIFFMinifyJSONBytewise(const char* json, size_t len, char* out,
+                               unsigned int depth);
+#endif
+
+int __CTIFFMetaStreamFeed(CTIFF ctiff, const char *chunk, size_t len);
+const char* __CTIFFMetaStreamFinish(CTIFF ctiff, const char *name);
+void __CTIFFMetaStreamDrop(CTIFF ctiff);
+void __CTIFFFreeMetaStream(CTIFF ctiff);
 
 #endif /* end of include guard: CTIFF_META_H */
@@ -0,0 +1,255 @@
+/**
+ * @file ctiff_pool.c
+ * @description Copying pages into recycled buffers.
+ *
+ * When a CTIFF copies its pages, each page is copied into a buffer from a
+ * pool. The buffer goes back to the pool as soon as its page has been
+ * written, so a steady acquisition reuses the same few buffers instead of
+ * allocating one per page. All buffers in the pool have the size of a page
+ * of the current style; the pool is emptied when the style changes size.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_thread.h"
+
+#include "ctiff_pool.h"
+
+/** A stack of free page buffers of one size.
+ *
+ *  Locked, as buffers are returned by the writer thread when writing
+ *  asynchronously.
+ */
+typedef struct CTIFF_pool_s {
+  CTIFF_mutex    lock;
+  size_t         frame_size;
+  void         **frames;
+  unsigned int   num_free;
+  unsigned int   capacity;
+  unsigned long  hits;
+  unsigned long  misses;
+} CTIFF_pool;
+
+
+/** Free every buffer waiting in the pool.
+ *
+ *  The pool must be locked.
+ *
+ * @param pool The pool to empty.
+ */
+static void __CTIFFPoolEmpty(CTIFF_pool *pool)
+{
+  while (pool->num_free > 0){
+    pool->num_free--;
+    FREE(pool->frames[pool->num_free]);
+  }
+}
+
+/** Take a buffer from the pool, or allocate one if the pool is empty.
+ *
+ * @param pool The pool to take the buffer from.
+ * @param size The size of the buffer in bytes.
+ * @return     The buffer, or NULL if it could not be allocated.
+ */
+static void* __CTIFFPoolGet(CTIFF_pool *pool, size_t size)
+{
+  void *frame = NULL;
+
+  __CTIFFMutexLock(&pool->lock);
+
+  if (pool->frame_size != size){
+    __CTIFFPoolEmpty(pool);
+    pool->frame_size = size;
+  }
+
+  if (pool->num_free > 0){
+    frame = pool->frames[--pool->num_free];
+    pool->hits++;
+  } else {
+    pool->misses++;
+  }
+
+  __CTIFFMutexUnlock(&pool->lock);
+
+  if (frame == NULL) frame = malloc(size);
+  return frame;
+}
+
+/** Return a buffer to the pool.
+ *
+ *  Buffers that no longer match the pool size, or that cannot be tracked,
+ *  are freed.
+ *
+ * @param pool  The pool to return the buffer to.
+ * @param frame The buffer.
+ * @param size  The size of the buffer in bytes.
+ */
+static void __CTIFFPoolPut(CTIFF_pool *pool, void *frame, size_t size)
+{
+  void **frames;
+
+  __CTIFFMutexLock(&pool->lock);
+
+  if (size == pool->frame_size && pool->num_free == pool->capacity){
+    frames = (void**) realloc(pool->frames,
+                              2*(pool->capacity + 1)*sizeof(void*));
+    if (frames != NULL){
+      pool->frames   = frames;
+      pool->capacity = 2*(pool->capacity + 1);
+    }
+  }
+
+  if (size == pool->frame_size && pool->num_free < pool->capacity){
+    pool->frames[pool->num_free++] = frame;
+    frame = NULL;
+  }
+
+  __CTIFFMutexUnlock(&pool->lock);
+
+  if (frame != NULL) free(frame);
+}
+
+/** Copy a page into a pooled buffer and attach it to a directory.
+ *
+ * @param ctiff The CTIFF whose pool to use.
+ * @param dir   The directory, with its style already set.
+ * @param page  The image data to copy.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFCopyPage(CTIFF ctiff, CTIFF_dir *dir, const void *page)
+{
+  size_t size = __CTIFFPageSize(&dir->style);
+  void *frame;
+
+  if ((frame = __CTIFFPoolGet(ctiff->pool, size)) == NULL) return ECTIFFMEMORY;
+
+  memcpy(frame, page, size);
+
+  dir->data       = frame;
+  dir->data_owned = true;
+  return CTIFFSUCCESS;
+}
+
+/** Return the copied page of a directory to the pool.
+ *
+ *  Called once the page has been written, or when it is dropped. Nothing is
+ *  done if the directory borrows its page from the caller.
+ *
+ * @param ctiff The CTIFF the directory belongs to.
+ * @param dir   The directory.
+ */
+void __CTIFFReleasePage(CTIFF ctiff, CTIFF_dir *dir)
+{
+  if (!dir->data_owned) return;
+
+  __CTIFFPoolPut(ctiff->pool, (void*) dir->data, __CTIFFPageSize(&dir->style));
+
+  dir->data       = NULL;
+  dir->data_owned = false;
+}
+
+/** Free the page pool of a CTIFF.
+ *
+ *  Pages still attached to directories are not part of the pool, and are
+ *  freed with their directory.
+ *
+ * @param ctiff The CTIFF whose pool to free.
+ */
+void __CTIFFFreePool(CTIFF ctiff)
+{
+  CTIFF_pool *pool = ctiff->pool;
+
+  if (pool == NULL) return;
+
+  __CTIFFPoolEmpty(pool);
+  __CTIFFMutexDestroy(&pool->lock);
+  FREE(pool->frames);
+  FREE(ctiff->pool);
+}
+
+/** Set whether pages are copied when they are added to a CamTIFF file.
+ *
+ *  By default CTIFFAddNewPage only keeps a pointer to the page (zero-copy),
+ *  so the page must stay allocated and unchanged until it has been written.
+ *  With copying enabled, each page is copied into a buffer owned by the
+ *  CamTIFF file, which allows the caller to reuse its buffer immediately.
+ *  This makes CTIFFWriteEvery values above one and asynchronous writing safe
+ *  with a single acquisition buffer.
+ *
+ *  Copies are made into buffers recycled from a pool, so no allocation is
+ *  needed per page once the pool holds enough buffers. Only pages added
+ *  after this call are affected.
+ * @see CTIFFGetPoolStats
+ *
+ * @param ctiff      The CamTIFF file to set the parameter for.
+ * @param copy_pages Whether to copy pages or not.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetCopyPages(CTIFF ctiff, bool copy_pages)
+{
+  CTIFF_pool *pool;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (copy_pages && ctiff->pool == NULL){
+    pool = (CTIFF_pool*) malloc(sizeof(CTIFF_pool));
+    if (pool == NULL) return ECTIFFMEMORY;
+
+    __CTIFFMutexInit(&pool->lock);
+    pool->frame_size = 0;
+    pool->frames     = NULL;
+    pool->num_free   = 0;
+    pool->capacity   = 0;
+    pool->hits       = 0;
+    pool->misses     = 0;
+
+    ctiff->pool = pool;
+  }
+
+  ctiff->copy_pages = copy_pages;
+  return CTIFFSUCCESS;
+}
+
+/** Get how often a page copy reused a buffer from the pool.
+ * @see CTIFFSetCopyPages
+ *
+ * @param ctiff  The CamTIFF file to query.
+ * @param hits   Set to the number of copies that reused a pooled buffer.
+ * @param misses Set to the number of copies that allocated a new buffer.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFGetPoolStats(CTIFF ctiff, unsigned long *hits, unsigned long *misses)
+{
+  CTIFF_pool *pool;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  *hits   = 0;
+  *misses = 0;
+
+  if ((pool = ctiff->pool) == NULL) return CTIFFSUCCESS;
+
+  __CTIFFMutexLock(&pool->lock);
+  *hits   = pool->hits;
+  *misses = pool->misses;
+  __CTIFFMutexUnlock(&pool->lock);
+
+  return CTIFFSUCCESS;
+}
@@ -0,0 +1,32 @@
+/**
+ * @file ctiff_pool.h
+ * @description Copying pages into recycled buffers.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_POOL_H
+
+#define CTIFF_POOL_H
+
+#include "ctiff_types.h"
+
+int CTIFFSetCopyPages(CTIFF ctiff, bool copy_pages);
+int CTIFFGetPoolStats(CTIFF ctiff, unsigned long *hits, unsigned long *misses);
+
+int __CTIFFCopyPage(CTIFF ctiff, CTIFF_dir *dir, const void *page);
+void __CTIFFReleasePage(CTIFF ctiff, CTIFF_dir *dir);
+void __CTIFFFreePool(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_POOL_H */
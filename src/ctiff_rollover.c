@@ -0,0 +1,329 @@
+/**
+ * @file ctiff_rollover.c
+ * @description Splitting CTIFF files into a numbered series.
+ *
+ * Once the current file reaches a size, page or time limit the next page is
+ * written to a new file. For an output file of stack.tif the series is
+ * stack.tif, stack_0001.tif, stack_0002.tif and so on. A manifest,
+ * stack_manifest.json, records which pages went to which file.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>   // fopen
+#include <stdlib.h>  // malloc
+#include <string.h>  // strlen
+#include <time.h>    // time
+#include <tiffio.h>  // libTIFF (preferably 3.9.5+)
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_bufio.h"
+
+#include "ctiff_rollover.h"
+
+/** The limits of each file in the series and the pages written so far. */
+typedef struct CTIFF_rollover_s {
+  unsigned long long  max_bytes;    // 0 for no limit.
+  unsigned int        max_pages;    // 0 for no limit.
+  unsigned int        max_seconds;  // 0 for no limit.
+  time_t              opened;       // When the current file was opened.
+  unsigned int       *file_pages;   // Pages written to each file.
+  unsigned int        num_files;
+  unsigned int        capacity;
+} CTIFF_rollover;
+
+
+/** Get the name of a file in the series.
+ *
+ *  The first file keeps the output name, later files have a four digit
+ *  number inserted before the extension.
+ *
+ * @param output_file The name of the first file.
+ * @param index       The position of the file in the series.
+ * @param suffix      If not NULL, replaces the number and extension.
+ * @return            The name, to be freed by the caller, or NULL.
+ */
+static char* __CTIFFRolloverName(const char *output_file, unsigned int index,
+                                 const char *suffix)
+{
+  const char *ext = strrchr(output_file, '.');
+  const char *sep = strrchr(output_file, '/');
+  const char *bsl = strrchr(output_file, '\\');
+  size_t stem_len;
+  char *name;
+
+  // A dot in a directory name is not an extension.
+  if (bsl > sep) sep = bsl;
+  if (ext == NULL || (sep != NULL && ext < sep)){
+    ext = output_file + strlen(output_file);
+  }
+
+  stem_len = ext - output_file;
+
+  // The stem, "_" + up to 10 digits, the extension or suffix and a NUL.
+  name = (char*) malloc(stem_len + 12 + strlen(ext) +
+                        (suffix ? strlen(suffix) : 0));
+  if (name == NULL) return NULL;
+
+  memcpy(name, output_file, stem_len);
+  if (suffix != NULL){
+    strcpy(name + stem_len, suffix);
+  } else if (index == 0){
+    strcpy(name + stem_len, ext);
+  } else {
+    sprintf(name + stem_len, "_%04u%s", index, ext);
+  }
+
+  return name;
+}
+
+/** Write the manifest of the series.
+ *
+ *  The manifest is rewritten whenever a file is completed so that it is
+ *  useful even if the acquisition does not finish cleanly.
+ *
+ * @param ctiff The CamTIFF file whose series to describe.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+static int __CTIFFRolloverManifest(CTIFF ctiff)
+{
+  CTIFF_rollover *rollover = ctiff->rollover;
+  unsigned int first_page = 0;
+  unsigned int i;
+  char *name, *base;
+  FILE *manifest;
+
+  name = __CTIFFRolloverName(ctiff->output_file, 0, "_manifest.json");
+  if (name == NULL) return ECTIFFMEMORY;
+
+  manifest = fopen(name, "w");
+  FREE(name);
+  if (manifest == NULL) return ECTIFFOPEN;
+
+  fputs("{\"files\":[", manifest);
+
+  for (i = 0; i < rollover->num_files; i++) {
+    if ((name = __CTIFFRolloverName(ctiff->output_file, i, NULL)) == NULL){
+      fclose(manifest);
+      return ECTIFFMEMORY;
+    }
+
+    // Files are listed relative to the manifest.
+    base = name;
+    if (strrchr(base, '/')  != NULL) base = strrchr(base, '/') + 1;
+#ifdef __WIN32
+    if (strrchr(base, '\\') != NULL) base = strrchr(base, '\\') + 1;
+#endif
+
+    // Written as a JSON string. Bytes outside ASCII are copied, so a UTF-8
+    // name stays UTF-8.
+    fprintf(manifest, "%s{\"name\":\"", (i == 0) ? "" : ",");
+    for (; *base != '\0'; base++) {
+      if (*base == '"' || *base == '\\'){
+        fputc('\\', manifest);
+        fputc(*base, manifest);
+      } else if ((unsigned char) *base < 0x20){
+        fprintf(manifest, "\\u%04x", (unsigned char) *base);
+      } else {
+        fputc(*base, manifest);
+      }
+    }
+    fprintf(manifest, "\",\"first_page\":%u,\"num_pages\":%u}",
+            first_page, rollover->file_pages[i]);
+
+    first_page += rollover->file_pages[i];
+    FREE(name);
+  }
+
+  fprintf(manifest, "],\"num_pages\":%u}\n", first_page);
+
+  if (fclose(manifest) != 0) return ECTIFFWRITE;
+  return CTIFFSUCCESS;
+}
+
+
+/** Start a new file in the series if the current one is full.
+ *
+ *  Called before each directory is written. A file always holds at least one
+ *  page, so a file can exceed the byte limit by up to one page.
+ *
+ * @param ctiff The CamTIFF file about to be written to.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFRolloverNext(CTIFF ctiff)
+{
+  CTIFF_rollover *rollover = ctiff->rollover;
+  unsigned int pages = rollover->file_pages[rollover->num_files - 1];
+  unsigned int *file_pages;
+  bool full = false;
+  TIFF *tiff;
+  char *name;
+  int retval;
+
+  if (pages == 0) return CTIFFSUCCESS;
+
+  if (rollover->max_pages != 0 && pages >= rollover->max_pages) full = true;
+
+  if (rollover->max_bytes != 0 &&
+      TIFFGetSizeProc(ctiff->tiff)(TIFFClientdata(ctiff->tiff)) >=
+        rollover->max_bytes){
+    full = true;
+  }
+
+  if (rollover->max_seconds != 0 &&
+      difftime(time(NULL), rollover->opened) >= rollover->max_seconds){
+    full = true;
+  }
+
+  if (!full) return CTIFFSUCCESS;
+
+  if (rollover->num_files == rollover->capacity){
+    file_pages = (unsigned int*) realloc(rollover->file_pages,
+                            2 * rollover->capacity * sizeof(unsigned int));
+    if (file_pages == NULL) return ECTIFFMEMORY;
+    rollover->file_pages = file_pages;
+    rollover->capacity  *= 2;
+  }
+
+  name = __CTIFFRolloverName(ctiff->output_file, rollover->num_files, NULL);
+  if (name == NULL) return ECTIFFMEMORY;
+
+  // Keep the old file open if the new one cannot be created.
+  tiff = __CTIFFFileOpen(name, ctiff->open_mode);
+  FREE(name);
+  if (tiff == NULL) return ECTIFFOPEN;
+  __CTIFFBufExpect(tiff, ctiff->expected_bytes);
+
+  // The first file took these, so a failure here is unlikely and the file
+  // is written through the page cache, or in turn, instead.
+  if (ctiff->direct_io) (void) __CTIFFBufDirect(tiff, true);
+  if (ctiff->write_depth > 0) (void) __CTIFFBufQueue(tiff, ctiff->write_depth);
+
+  retval = __CTIFFBufClose(ctiff->tiff);
+  ctiff->tiff = tiff;
+
+  rollover->file_pages[rollover->num_files++] = 0;
+  rollover->opened = time(NULL);
+
+  if (retval != CTIFFSUCCESS) return retval;
+  return __CTIFFRolloverManifest(ctiff);
+}
+
+/** Count a directory written to the current file of the series.
+ *
+ * @param ctiff The CamTIFF file that was written to.
+ */
+void __CTIFFRolloverCount(CTIFF ctiff)
+{
+  CTIFF_rollover *rollover = ctiff->rollover;
+
+  rollover->file_pages[rollover->num_files - 1]++;
+}
+
+/** Write the final manifest of the series, if there is one.
+ *
+ * @param ctiff The CamTIFF file being closed.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFRolloverFinish(CTIFF ctiff)
+{
+  if (ctiff->rollover == NULL) return CTIFFSUCCESS;
+
+  return __CTIFFRolloverManifest(ctiff);
+}
+
+/** Free the rollover state of a CTIFF.
+ *
+ * @param ctiff The CamTIFF file whose rollover state to free.
+ */
+void __CTIFFFreeRollover(CTIFF ctiff)
+{
+  CTIFF_rollover *rollover = ctiff->rollover;
+
+  if (rollover == NULL) return;
+
+  FREE(rollover->file_pages);
+  FREE(ctiff->rollover);
+}
+
+
+/** Split the CamTIFF file into a series of files.
+ *
+ *  When the current file reaches any of the limits, the next page is written
+ *  to a new file: stack.tif is followed by stack_0001.tif, stack_0002.tif,
+ *  etc. Pages are never split between files. Smaller files keep the cost of
+ *  appending directories down and let readers work on several files at
+ *  once.
+ *
+ *  The series is described by stack_manifest.json, which lists each file
+ *  with the global index of its first page and its number of pages:
+ *
+ *    {"files":[{"name":"stack.tif","first_page":0,"num_pages":100},
+ *              {"name":"stack_0001.tif","first_page":100,"num_pages":42}],
+ *     "num_pages":142}
+ *
+ *  The manifest is written on each new file and on CTIFFClose. A limit of 0
+ *  means no limit, and setting every limit to 0 turns the series off. The
+ *  limits can only be changed before the first page is added. A CamTIFF
+ *  file created with CTIFFNewWithIO or CTIFFNewMemory has no file name to
+ *  number, and returns ECTIFFNOFILE.
+ *
+ * @param ctiff       The CamTIFF file to set the parameter for.
+ * @param max_bytes   The size at which a file is complete.
+ * @param max_pages   The number of pages at which a file is complete.
+ * @param max_seconds The time since opening at which a file is complete.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetRollover(CTIFF ctiff, unsigned long long max_bytes,
+                                  unsigned int max_pages,
+                                  unsigned int max_seconds)
+{
+  CTIFF_rollover *rollover;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+  if (ctiff->custom_io) return ECTIFFNOFILE;
+
+  if (max_bytes == 0 && max_pages == 0 && max_seconds == 0){
+    __CTIFFFreeRollover(ctiff);
+    return CTIFFSUCCESS;
+  }
+
+  if ((rollover = ctiff->rollover) == NULL){
+    rollover = (CTIFF_rollover*) malloc(sizeof(CTIFF_rollover));
+    if (rollover == NULL) return ECTIFFMEMORY;
+
+    rollover->capacity   = 16;
+    rollover->file_pages = (unsigned int*) malloc(rollover->capacity *
+                                                  sizeof(unsigned int));
+    if (rollover->file_pages == NULL){
+      FREE(rollover);
+      return ECTIFFMEMORY;
+    }
+
+    rollover->file_pages[0] = 0;
+    rollover->num_files     = 1;
+    rollover->opened        = time(NULL);
+    ctiff->rollover         = rollover;
+  }
+
+  rollover->max_bytes   = max_bytes;
+  rollover->max_pages   = max_pages;
+  rollover->max_seconds = max_seconds;
+
+  return CTIFFSUCCESS;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file ctiff_rollover.h
+ * @description Splitting CTIFF files into a numbered series.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_ROLLOVER_H
+
+#define CTIFF_ROLLOVER_H
+
+#include "ctiff_types.h"
+
+int CTIFFSetRollover(CTIFF ctiff, unsigned long long max_bytes,
+                                  unsigned int max_pages,
+                                  unsigned int max_seconds);
+
+int __CTIFFRolloverNext(CTIFF ctiff);
+void __CTIFFRolloverCount(CTIFF ctiff);
+int __CTIFFRolloverFinish(CTIFF ctiff);
+void __CTIFFFreeRollover(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_ROLLOVER_H */
@@ -19,9 +19,13 @@
  */
 
 #include <stdlib.h>
+#include <tiffio.h>  // TIFFIsCODECConfigured
 
 #include "ctiff_settings.h"
 #include "ctiff_error.h"
+#include "ctiff_util.h"
+#include "ctiff_bufio.h"
+#include "ctiff_writeq.h"
 
 /** Write the added directory to disk after x number of pages added.
  *
@@ -195,3 +199,286 @@ int CTIFFSetRes(CTIFF ctiff, unsigned int x_res, unsigned int y_res)
   def_style->y_res    = y_res;
   return CTIFFSUCCESS;
 }
+
+/** Set the number of rows per strip for subsequent directory additions.
+ *
+ *  Each strip is compressed and written as one unit, so a strip of several
+ *  rows compresses better and needs fewer writes than one row per strip.
+ *  Setting rows to 0 sizes strips using CTIFFSetStripBytes instead, which is
+ *  the default.
+ * @see CTIFFSetStripBytes
+ *
+ * @param ctiff      The CamTIFF file to set the parameter for.
+ * @param rows       The number of image rows in each strip, or 0.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetRowsPerStrip(CTIFF ctiff, unsigned int rows)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  ctiff->def_dir->style.rows_per_strip = rows;
+  return CTIFFSUCCESS;
+}
+
+/** Set the target strip size for subsequent directory additions.
+ *
+ *  The rows per strip are chosen so that each strip holds at most the given
+ *  number of bytes of uncompressed image data (but always at least one row).
+ *  This overrides any value set with CTIFFSetRowsPerStrip. Setting bytes to 0
+ *  uses the libTIFF default strip size. By default CTIFF_DEFAULT_STRIP_BYTES
+ *  is used.
+ * @see CTIFFSetRowsPerStrip
+ *
+ * @param ctiff      The CamTIFF file to set the parameter for.
+ * @param bytes      The target number of bytes in each strip, or 0.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetStripBytes(CTIFF ctiff, unsigned int bytes)
+{
+  CTIFF_dir_style* def_style;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+  def_style = &ctiff->def_dir->style;
+
+  def_style->rows_per_strip = 0;
+  def_style->strip_bytes    = bytes;
+  return CTIFFSUCCESS;
+}
+
+/** Write the pages of a CamTIFF file as tiles rather than strips.
+ *
+ *  A tiled page is split into rectangles of the given size, each
+ *  compressed on its own, so a reader can decode a small region of a large
+ *  page without decoding every row band across it. Tiles on the right and
+ *  bottom edges are padded. Tiles are compressed in parallel when threads
+ *  are set. Setting both sizes to 0 writes strips, which is the default.
+ *  The tile size can only be changed before the first page is added.
+ * @see CTIFFSetThreads
+ *
+ * @param ctiff       The CamTIFF file to set the parameter for.
+ * @param tile_width  The width of each tile, a multiple of 16, or 0.
+ * @param tile_height The height of each tile, a multiple of 16, or 0.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetTileSize(CTIFF ctiff, unsigned int tile_width,
+                                  unsigned int tile_height)
+{
+  CTIFF_dir_style* def_style;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+  def_style = &ctiff->def_dir->style;
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+
+  // TIFF requires both sizes to be multiples of 16.
+  if ((tile_width == 0) != (tile_height == 0) ||
+      tile_width % 16 != 0 || tile_height % 16 != 0){
+    return ECTIFFTILESIZE;
+  }
+
+  def_style->tile_width  = tile_width;
+  def_style->tile_height = tile_height;
+  return CTIFFSUCCESS;
+}
+
+/** Set the predictor for subsequent directory additions to a CamTIFF file.
+ *
+ *  The available predictors are:
+ *    CTIFF_PREDICTOR_NONE           No predictor (default).
+ *    CTIFF_PREDICTOR_HORIZONTAL     Horizontal differencing, for integer
+ *                                     pixels.
+ *    CTIFF_PREDICTOR_FLOATINGPOINT  Floating point differencing, for
+ *                                     CTIFF_PIXEL_FLOAT32 and FLOAT64 pixels.
+ *
+ *  Smooth images compress much better with a predictor. Pages whose pixel
+ *  type cannot use the chosen predictor (for example, horizontal
+ *  differencing on 64 bit pixels) are written without one, as are pages
+ *  that are not compressed with LZW or Deflate.
+ * @see CTIFFSetCompression
+ *
+ * @param ctiff      The CamTIFF file to set the parameter for.
+ * @param predictor  The predictor to use.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetPredictor(CTIFF ctiff, unsigned int predictor)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (predictor != CTIFF_PREDICTOR_NONE &&
+      predictor != CTIFF_PREDICTOR_HORIZONTAL &&
+      predictor != CTIFF_PREDICTOR_FLOATINGPOINT){
+    return ECTIFFPREDICTOR;
+  }
+
+  ctiff->def_dir->style.predictor = (unsigned char) predictor;
+  return CTIFFSUCCESS;
+}
+
+/** Set the compression for subsequent directory additions to a CamTIFF file.
+ *
+ *  The available codecs are:
+ *    CTIFF_COMPRESSION_NONE      No compression, the fastest to write.
+ *    CTIFF_COMPRESSION_LZW       LZW (default).
+ *    CTIFF_COMPRESSION_DEFLATE   Deflate (zlib), with level 1 (fastest) to 9
+ *                                  (smallest).
+ *    CTIFF_COMPRESSION_PACKBITS  Run length encoding, for sparse images such
+ *                                  as masks.
+ *
+ *  The level is only used by Deflate, and 0 selects the codec's default.
+ *  A codec that libTIFF was built without is rejected.
+ * @see CTIFFSetPredictor
+ *
+ * @param ctiff      The CamTIFF file to set the parameter for.
+ * @param codec      The compression codec.
+ * @param level      The compression level, or 0.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetCompression(CTIFF ctiff, unsigned int codec, int level)
+{
+  CTIFF_dir_style* def_style;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+  def_style = &ctiff->def_dir->style;
+
+  if (codec != CTIFF_COMPRESSION_NONE &&
+      codec != CTIFF_COMPRESSION_LZW &&
+      codec != CTIFF_COMPRESSION_DEFLATE &&
+      codec != CTIFF_COMPRESSION_PACKBITS){
+    return ECTIFFCOMPRESSION;
+  }
+
+  if (!TIFFIsCODECConfigured((uint16) codec)) return ECTIFFCOMPRESSION;
+
+  if (level < 0 || level > 9) return ECTIFFCOMPRESSION;
+
+  def_style->compression       = (unsigned short) codec;
+  def_style->compression_level = level;
+  return CTIFFSUCCESS;
+}
+
+/** Set the maximum nesting of metadata for subsequent pages.
+ *
+ *  Metadata is checked with a stack of the objects and arrays it is inside,
+ *  so the nesting is limited. By default up to 19 levels are accepted, and
+ *  metadata nested deeper is treated as invalid.
+ * @see CTIFFSetStrict
+ *
+ * @param ctiff The CamTIFF file to set the parameter for.
+ * @param depth The maximum nesting of objects and arrays, from 1 to
+ *              CTIFF_MAX_META_DEPTH.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetMetaDepth(CTIFF ctiff, unsigned int depth)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (depth == 0 || depth > CTIFF_MAX_META_DEPTH) return ECTIFFMETADEPTH;
+
+  // One extra level for the end of the metadata.
+  ctiff->meta_depth = depth + 1;
+  return CTIFFSUCCESS;
+}
+
+/** Set the number of pages a CamTIFF file is expected to hold.
+ *
+ *  With the style of the first page, the expected number of pages gives the
+ *  size the file will roughly reach, so the style may be set before or
+ *  after the hint. Disk space is then reserved ahead of the writes
+ *  in CTIFF_PREALLOC_BYTES steps, so that the file is laid out in large
+ *  extents rather than grown a strip at a time. Space left over, for example
+ *  because the pages compressed, is given back when the file is closed.
+ *  Each file of a rolled over series is expected to hold as many pages.
+ *
+ *  The hint must be given before the first page is added, and has no effect
+ *  on systems that cannot reserve space or on files written through
+ *  CTIFFNewWithIO. Setting num_pages to 0 removes the hint.
+ * @see CTIFFSetStyle
+ *
+ * @param ctiff     The CamTIFF file to set the parameter for.
+ * @param num_pages The number of pages expected, or 0 if unknown.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetExpectedPages(CTIFF ctiff, unsigned int num_pages)
+{
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+
+  // The size is worked out from the style when the first page is added.
+  ctiff->expected_pages = num_pages;
+  return CTIFFSUCCESS;
+}
+
+/** Write the image data of a CamTIFF file past the page cache.
+ *
+ *  For fast uncompressed capture, the page cache doubles the memory traffic
+ *  of each page and can stall writes while it is flushed. With direct I/O,
+ *  image data is collected in a block aligned buffer and written straight
+ *  to the disk a block at a time. The directories and the few bytes either
+ *  side of the blocks are written through the page cache as usual.
+ *
+ *  This must be set before the first page is added. Direct I/O is only
+ *  available on Linux, for files on a file system that supports it, and
+ *  ECTIFFDIRECTIO is returned otherwise; the file is then written as usual.
+ *  It is not available for CTIFFNewWithIO or CTIFFNewMemory files.
+ *  Compressed pages gain little from it.
+ * @see CTIFFSetExpectedPages
+ *
+ * @param ctiff  The CamTIFF file to set the parameter for.
+ * @param direct Whether to write with direct I/O.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetDirectIO(CTIFF ctiff, bool direct)
+{
+  int retval;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+  if (ctiff->custom_io) return ECTIFFNOFILE;
+
+  if ((retval = __CTIFFBufDirect(ctiff->tiff, direct)) != CTIFFSUCCESS){
+    return retval;
+  }
+
+  ctiff->direct_io = direct;
+  return CTIFFSUCCESS;
+}
+
+/** Set the number of writes of a CamTIFF file kept in flight.
+ *
+ *  By default each full buffer of the file is written before the next is
+ *  filled, so the thread adding pages waits on the disk. With a depth, full
+ *  buffers are handed to as many writer threads and written at their place
+ *  in the file while the next ones fill, so several writes are in flight
+ *  at once, as fast disks need to reach their full speed. Each write holds
+ *  a buffer of CTIFF_IO_BUFFER_BYTES, or CTIFF_DIRECT_BUFFER_BYTES with
+ *  direct I/O.
+ *
+ *  This must be set before the first page is added, and is not available
+ *  for CTIFFNewWithIO or CTIFFNewMemory files.
+ * @see CTIFFSetDirectIO
+ *
+ * @param ctiff The CamTIFF file to set the parameter for.
+ * @param depth The most writes in flight, from 0 (write in turn) to
+ *              CTIFF_MAX_WRITE_DEPTH.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetWriteQueueDepth(CTIFF ctiff, unsigned int depth)
+{
+  int retval;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  if (ctiff->num_dirs != 0) return ECTIFFAFTERFIRSTPAGE;
+  if (ctiff->custom_io) return ECTIFFNOFILE;
+  if (depth > CTIFF_MAX_WRITE_DEPTH) return ECTIFFWRITEDEPTH;
+
+  if ((retval = __CTIFFBufQueue(ctiff->tiff, depth)) != CTIFFSUCCESS){
+    ctiff->write_depth = 0;
+    return retval;
+  }
+
+  ctiff->write_depth = depth;
+  return CTIFFSUCCESS;
+}
@@ -44,4 +44,14 @@ int CTIFFSetStyle(CTIFF ctiff,
                                bool in_color);
 
 int CTIFFSetRes(CTIFF ctiff, unsigned int x_res, unsigned int y_res);
+int CTIFFSetRowsPerStrip(CTIFF ctiff, unsigned int rows);
+int CTIFFSetStripBytes(CTIFF ctiff, unsigned int bytes);
+int CTIFFSetTileSize(CTIFF ctiff, unsigned int tile_width,
+                                 unsigned int tile_height);
+int CTIFFSetPredictor(CTIFF ctiff, unsigned int predictor);
+int CTIFFSetCompression(CTIFF ctiff, unsigned int codec, int level);
+int CTIFFSetMetaDepth(CTIFF ctiff, unsigned int depth);
+int CTIFFSetExpectedPages(CTIFF ctiff, unsigned int num_pages);
+int CTIFFSetDirectIO(CTIFF ctiff, bool direct);
+int CTIFFSetWriteQueueDepth(CTIFF ctiff, unsigned int depth);
 #endif /* end of include guard: CTIFF_SETTINGS_H */
@@ -0,0 +1,113 @@
+/**
+ * @file ctiff_thread.h
+ * @description Minimal portable threading primitives.
+ *
+ * Thin wrappers around pthreads, or the native Win32 API on Windows, so that
+ * the rest of CamTIFF does not need to care which one is in use.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_THREAD_H
+
+#define CTIFF_THREAD_H
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+
+#ifdef __WIN32
+
+typedef HANDLE             CTIFF_thread;
+typedef CRITICAL_SECTION   CTIFF_mutex;
+typedef CONDITION_VARIABLE CTIFF_cond;
+
+#define CTIFF_THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define CTIFF_THREAD_RETURN          return 0
+
+typedef DWORD (WINAPI *CTIFF_thread_func)(LPVOID);
+
+static inline int __CTIFFThreadCreate(CTIFF_thread *thread,
+                                      CTIFF_thread_func func, void *arg)
+{
+  *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+  return (*thread == NULL);
+}
+
+static inline void __CTIFFThreadJoin(CTIFF_thread *thread)
+{
+  WaitForSingleObject(*thread, INFINITE);
+  CloseHandle(*thread);
+}
+
+static inline void __CTIFFMutexInit(CTIFF_mutex *m) {InitializeCriticalSection(m);}
+static inline void __CTIFFMutexDestroy(CTIFF_mutex *m) {DeleteCriticalSection(m);}
+static inline void __CTIFFMutexLock(CTIFF_mutex *m) {EnterCriticalSection(m);}
+static inline void __CTIFFMutexUnlock(CTIFF_mutex *m) {LeaveCriticalSection(m);}
+
+static inline void __CTIFFCondInit(CTIFF_cond *c) {InitializeConditionVariable(c);}
+static inline void __CTIFFCondDestroy(CTIFF_cond *c) {(void) c;}
+static inline void __CTIFFCondSignal(CTIFF_cond *c) {WakeConditionVariable(c);}
+static inline void __CTIFFCondBroadcast(CTIFF_cond *c)
+{
+  WakeAllConditionVariable(c);
+}
+static inline void __CTIFFCondWait(CTIFF_cond *c, CTIFF_mutex *m)
+{
+  SleepConditionVariableCS(c, m, INFINITE);
+}
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_t       CTIFF_thread;
+typedef pthread_mutex_t CTIFF_mutex;
+typedef pthread_cond_t  CTIFF_cond;
+
+#define CTIFF_THREAD_FUNC(name, arg) void* name(void *arg)
+#define CTIFF_THREAD_RETURN          return NULL
+
+typedef void* (*CTIFF_thread_func)(void*);
+
+static inline int __CTIFFThreadCreate(CTIFF_thread *thread,
+                                      CTIFF_thread_func func, void *arg)
+{
+  return pthread_create(thread, NULL, func, arg);
+}
+
+static inline void __CTIFFThreadJoin(CTIFF_thread *thread)
+{
+  pthread_join(*thread, NULL);
+}
+
+static inline void __CTIFFMutexInit(CTIFF_mutex *m) {pthread_mutex_init(m, NULL);}
+static inline void __CTIFFMutexDestroy(CTIFF_mutex *m) {pthread_mutex_destroy(m);}
+static inline void __CTIFFMutexLock(CTIFF_mutex *m) {pthread_mutex_lock(m);}
+static inline void __CTIFFMutexUnlock(CTIFF_mutex *m) {pthread_mutex_unlock(m);}
+
+static inline void __CTIFFCondInit(CTIFF_cond *c) {pthread_cond_init(c, NULL);}
+static inline void __CTIFFCondDestroy(CTIFF_cond *c) {pthread_cond_destroy(c);}
+static inline void __CTIFFCondSignal(CTIFF_cond *c) {pthread_cond_signal(c);}
+static inline void __CTIFFCondBroadcast(CTIFF_cond *c)
+{
+  pthread_cond_broadcast(c);
+}
+static inline void __CTIFFCondWait(CTIFF_cond *c, CTIFF_mutex *m)
+{
+  pthread_cond_wait(c, m);
+}
+
+#endif
+
+#endif /* end of include guard: CTIFF_THREAD_H */
@@ -41,9 +41,27 @@
   #include <stdbool.h> // bool type
 #endif
 
+#include <stddef.h> // size_t
+
 // Alleviates need to import libTIFF here.
 struct tiff;
 
+// Asynchronous writer state, private to ctiff_async.c.
+struct CTIFF_async_s;
+
+// Recycled page buffers, private to ctiff_pool.c.
+struct CTIFF_pool_s;
+
+// Compression threads, private to ctiff_workers.c.
+struct CTIFF_workers_s;
+struct CTIFF_rollover_s;
+struct CTIFF_meta_stream_s;
+struct CTIFF_meta_cache_s;
+struct CTIFF_dedup_s;
+struct CTIFF_cbor_s;
+struct CTIFF_meta_builder_s;
+struct CTIFF_membuf_s;
+
 #define CTIFF_PIXEL_TYPE_MIN 1
 #define CTIFF_PIXEL_TYPE_MAX 3
 /** The pixel types for CamTIFF.
@@ -66,6 +84,61 @@ enum pixel_type_e {           // LibTIFF tags
   CTIFF_PIXEL_FLOAT32 = 0x33, // SAMPLEFORMAT_IEEEFP = 3
   CTIFF_PIXEL_FLOAT64 = 0x37
 };
+
+/** The compression schemes for pages. The values are the libTIFF tags. */
+enum compression_e {                  // LibTIFF tags
+  CTIFF_COMPRESSION_NONE     = 1,     // COMPRESSION_NONE
+  CTIFF_COMPRESSION_LZW      = 5,     // COMPRESSION_LZW
+  CTIFF_COMPRESSION_DEFLATE  = 8,     // COMPRESSION_ADOBE_DEFLATE
+  CTIFF_COMPRESSION_PACKBITS = 32773  // COMPRESSION_PACKBITS
+};
+
+/** The predictors applied to pixels before compression.
+ *
+ *  A predictor stores each pixel as its difference from the previous pixel
+ *  in the row, which makes smooth images compress much better. The values
+ *  are the libTIFF predictor tags.
+ */
+enum predictor_e {            // LibTIFF tags
+  CTIFF_PREDICTOR_NONE          = 1, // PREDICTOR_NONE
+  CTIFF_PREDICTOR_HORIZONTAL    = 2, // PREDICTOR_HORIZONTAL
+  CTIFF_PREDICTOR_FLOATINGPOINT = 3  // PREDICTOR_FLOATINGPOINT
+};
+
+/** Default size of a strip when rows per strip is not set explicitly.
+ *
+ *  Each strip is compressed separately, so larger strips compress better
+ *  and need fewer StripOffsets/StripByteCounts entries and writes.
+ * @see CTIFFSetStripBytes
+ */
+#define CTIFF_DEFAULT_STRIP_BYTES (64*1024)
+
+/** Default maximum nesting of objects and arrays in metadata.
+ * @see CTIFFSetMetaDepth
+ */
+#define CTIFF_DEFAULT_META_DEPTH 19
+#define CTIFF_MAX_META_DEPTH     65535
+
+/** How page metadata is stored.
+ * @see CTIFFSetMetaEncoding
+ */
+enum meta_encoding_e {
+  CTIFF_META_JSON, // JSON text in TIFFTAG_XMLPACKET.
+  CTIFF_META_CBOR  // CBOR in CTIFFTAG_CBORMETA.
+};
+
+/** Private tag holding CBOR metadata, from the reusable private range. */
+#define CTIFFTAG_CBORMETA 65100
+
+/** Private ASCII tag holding the time a page was added, in nanoseconds.
+ *
+ *  Two numbers separated by a space: the time since 1970-01-01 00:00:00 UTC,
+ *  and the time on a monotonic clock with an arbitrary start. Differences
+ *  of the second give the time between pages, unaffected by changes to the
+ *  system clock.
+ */
+#define CTIFFTAG_TIMESTAMP 65101
+
 /* TODO: Support the complex pixel data types.
  *   SAMPLEFORMAT_VOID          = 4 // Does not reflect real life signals
  *   SAMPLEFORMAT_COMPLEXINT    = 5
@@ -73,6 +146,30 @@ enum pixel_type_e {           // LibTIFF tags
  */
 
 
+/** What CTIFFAddNewPage does when the asynchronous write queue is full.
+ * @see CTIFFSetAsync
+ */
+enum async_policy_e {
+  CTIFF_ASYNC_BLOCK,       // Wait for the writer thread to make space.
+  CTIFF_ASYNC_DROP_OLDEST, // Discard the oldest page not yet written.
+  CTIFF_ASYNC_ERROR        // Return ECTIFFQUEUEFULL without adding the page.
+};
+
+/** Callbacks a CamTIFF file is written through, see CTIFFNewWithIO.
+ *
+ *  Each works like the POSIX call it is named after and is passed the
+ *  handle given to CTIFFNewWithIO. read and write return the number of
+ *  bytes transferred, seek the new offset and size the size of the file, or
+ *  -1 on error. close is called by CTIFFClose and may be NULL.
+ */
+typedef struct CTIFF_io_procs_s {
+  long long (*read)(void *handle, void *data, size_t size);
+  long long (*write)(void *handle, const void *data, size_t size);
+  long long (*seek)(void *handle, long long offset, int whence);
+  long long (*size)(void *handle);
+        int (*close)(void *handle);
+} CTIFF_io_procs;
+
 /** Structure for holding basic metadata about an image. */
 typedef struct {
   const char *artist;
@@ -99,42 +196,37 @@ typedef struct CTIFF_dir_style_s {
   unsigned  int height;
   unsigned  int bps;
   unsigned char pixel_data_type;
+  unsigned char predictor;
+  unsigned short compression;
+            int compression_level; // 0 for the codec's default
            bool in_color;
            bool black_is_min;
   unsigned  int x_res;
   unsigned  int y_res;
+  unsigned  int rows_per_strip; // 0 to size strips using strip_bytes
+  unsigned  int strip_bytes;
+  unsigned  int tile_width;     // 0 to write strips instead of tiles
+  unsigned  int tile_height;
 } CTIFF_dir_style;
 
 /** Structure for holding an image and its associated metadata.
  *
- *  This structure is usually created dynamically, and should be freed with
- *  __CTIFFFreeDir
- * @see __CTIFFFreeDir
+ *  This structure is usually held in the ring of a CTIFF, and what it owns
+ *  should be freed with __CTIFFClearDir.
+ * @see __CTIFFClearDir
  */
 typedef struct CTIFF_dir_s {
           CTIFF_dir_style  style;
      CTIFF_basic_metadata  basic_meta;
   CTIFF_extended_metadata  ext_meta;
-               const char *timestamp;
+                long long  time_ns;      // Nanoseconds since 1970 (UTC).
+                long long  monotonic_ns; // For the time between pages.
                const void *data;
+                     bool  data_owned; // data is a copy from the page pool
                       int  write_count;
-                      int  refs;
+                   size_t  bytes;      // Metadata and copied page held.
 } CTIFF_dir;
 
-/** Structure for linking CTIFF_dirs together
- *
- * This is implemented outside of CTIFF_dir to separate the data from its
- * linking structure. This allows for one to easily build other data
- * structures (like doubly linked lists) in the future.
- *
- * @see __CTIFFFreeNode
- */
-typedef struct CTIFF_node_s {
-            CTIFF_dir *dir;
-  struct CTIFF_node_s *next_node;
-                  int  refs;
-} * CTIFF_node;
-
 /** Structure for holding a set of CamTIFF directories.
  *
  *  This structure is usually created dynamically, and should be freed with
@@ -144,17 +236,41 @@ typedef struct CTIFF_node_s {
 typedef struct CTIFF_s {
   struct tiff  *tiff;
   const char   *output_file;
+  const char   *open_mode;
   unsigned int  num_dirs;
   unsigned int  num_page_styles;
   bool          strict;
   bool          strict_lock;
+  unsigned int  meta_depth;      // Size of the JSON checker's mode stack.
   unsigned int  write_every_num;
   unsigned int  num_unwritten;
 
   CTIFF_dir    *def_dir;
-  CTIFF_node    first_node;
-  CTIFF_node    last_node;
-  CTIFF_node    write_ptr;
+  CTIFF_dir    *ring;       // Directories not yet written, reused in turn.
+  unsigned int  ring_size;
+  unsigned int  ring_head;  // Slot of the oldest unwritten directory.
+  CTIFF_dir_style last_style; // Style of the last page added.
+  unsigned int  live_dirs;  // Directories added and not yet released.
+  size_t        held_bytes; // Held by those directories and the ring.
+  size_t        peak_bytes;
+
+  bool          copy_pages;
+  bool          custom_io;   // Written through CTIFFNewWithIO callbacks.
+  unsigned int  expected_pages; // Expected pages of each file, or 0.
+  unsigned long long expected_bytes; // Expected size of each file, or 0.
+  bool          direct_io;   // Image data written past the page cache.
+  unsigned int  write_depth; // Writes kept in flight, 0 to write in turn.
+
+  struct CTIFF_async_s *async; // NULL unless writing asynchronously.
+  struct CTIFF_pool_s  *pool;  // NULL until pages are first copied.
+  struct CTIFF_workers_s *workers; // NULL to compress on one thread.
+  struct CTIFF_rollover_s *rollover; // NULL to write a single file.
+  struct CTIFF_meta_stream_s *meta_stream; // NULL until metadata is streamed.
+  struct CTIFF_meta_cache_s *meta_cache;   // NULL until metadata is added.
+  struct CTIFF_dedup_s *dedup;             // NULL unless sharing metadata.
+  struct CTIFF_cbor_s  *cbor;              // NULL to store metadata as JSON.
+  struct CTIFF_meta_builder_s *meta_builder; // NULL until metadata is built.
+  struct CTIFF_membuf_s *membuf;           // NULL unless written to memory.
 
 } * CTIFF;
 
@@ -18,39 +18,227 @@
  */
 
 #include <time.h>
-#include <stdlib.h> // malloc
+#include <stdio.h>  // sprintf
+#include <stdlib.h> // malloc, strtod
+#include <string.h> // strlen, memset
+#ifdef __WIN32
+#include <windows.h> // GetSystemTimeAsFileTime, QueryPerformanceCounter
+#endif
 
 #include "ctiff_util.h"
+#include "ctiff_error.h"
 
 
-/** Get the current time of the local machine in UTC.
+/** Get the current time in nanoseconds.
  *
- *  @return New malloced time string on success, NULL on failure.
+ *  Does not allocate, and is safe to call from any thread.
+ *
+ * @param real_ns Set to the time since 1970-01-01 00:00:00 UTC.
+ * @param mono_ns Set to the time on a clock that only moves forward, from
+ *                an arbitrary start, for measuring the time between pages.
  */
-const char* __CTIFFGetTime()
+void __CTIFFGetTime(long long *real_ns, long long *mono_ns)
 {
-  time_t local_current_time;
-  char  *time_str = (char*) malloc(20*sizeof(char));
-
 #ifdef __WIN32
-  int retval;
-  struct tm gmt_current_time;
+  FILETIME file_time;
+  ULARGE_INTEGER ticks;
+  LARGE_INTEGER count, freq;
 
-  // Get time of slice
-  time(&local_current_time);
+  // 100 ns ticks since 1601.
+  GetSystemTimeAsFileTime(&file_time);
+  ticks.LowPart  = file_time.dwLowDateTime;
+  ticks.HighPart = file_time.dwHighDateTime;
+  *real_ns = (long long) (ticks.QuadPart - 116444736000000000ULL) * 100;
 
-  retval = gmtime_s(&gmt_current_time, &local_current_time);
-  if (retval) return NULL;
-
-  strftime(time_str, 20, "%Y:%m:%d %H:%M:%S", &gmt_current_time);
+  // Split to avoid overflowing when converting to nanoseconds.
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  *mono_ns = count.QuadPart / freq.QuadPart * 1000000000LL +
+             count.QuadPart % freq.QuadPart * 1000000000LL / freq.QuadPart;
 #else
-  struct tm* gmt_current_time;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  *real_ns = (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
 
-  // Get time of slice
-  time(&local_current_time);
-  gmt_current_time = gmtime(&local_current_time);
-  strftime(time_str, 20, "%Y:%m:%d %H:%M:%S", gmt_current_time);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  *mono_ns = (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
 #endif
+}
+
+/** Format a time as a TIFF date and time, YYYY:MM:DD HH:MM:SS, in UTC.
+ *
+ *  Safe to call from any thread.
+ *
+ * @param buf     Where to write, with room for CTIFF_DATETIME_SIZE characters.
+ * @param real_ns The time, as from __CTIFFGetTime.
+ */
+void __CTIFFFormatTime(char *buf, long long real_ns)
+{
+  time_t seconds = (time_t) (real_ns / 1000000000LL);
+  struct tm gmt;
+
+#ifdef __WIN32
+  if (gmtime_s(&gmt, &seconds) != 0) memset(&gmt, 0, sizeof(gmt));
+#else
+  if (gmtime_r(&seconds, &gmt) == NULL) memset(&gmt, 0, sizeof(gmt));
+#endif
+
+  strftime(buf, CTIFF_DATETIME_SIZE, "%Y:%m:%d %H:%M:%S", &gmt);
+}
+
+/** Make sure a reusable buffer can hold a number of characters.
+ *
+ *  The buffer grows by doubling, so repeatedly filling it costs amortised
+ *  constant time per character and no allocations once it is large enough.
+ *
+ * @param buf  The buffer, reallocated if needed. May start as NULL.
+ * @param cap  The capacity of the buffer, updated if reallocated.
+ * @param need The number of characters the buffer must hold.
+ * @return     CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFReserve(char **buf, size_t *cap, size_t need)
+{
+  size_t new_cap = (*cap != 0) ? *cap : 4096;
+  char *new_buf;
+
+  if (need <= *cap) return CTIFFSUCCESS;
+
+  while (new_cap < need) new_cap *= 2;
+
+  if ((new_buf = (char*) realloc(*buf, new_cap)) == NULL) return ECTIFFMEMORY;
+
+  *buf = new_buf;
+  *cap = new_cap;
+  return CTIFFSUCCESS;
+}
+
+/** Write an integer in decimal, without the cost of sprintf.
+ *
+ * @param buf Where to write, with room for at least 20 characters.
+ * @param val The integer.
+ * @return    The number of characters written. No NUL is added.
+ */
+size_t __CTIFFPrintInt(char *buf, long long val)
+{
+  unsigned long long u = (unsigned long long) val;
+  char digits[20];
+  size_t n = 0, len = 0;
+
+  if (val < 0){
+    buf[len++] = '-';
+    u = 0ULL - u;
+  }
+
+  do {
+    digits[n++] = (char) ('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+
+  while (n > 0) buf[len++] = digits[--n];
+  return len;
+}
+
+/** Write a number with few decimals, if it reads back exactly.
+ *
+ *  Looks for the fewest decimals p such that d is the double nearest to
+ *  r / 10^p for an integer r below 2^53. Such r and 10^p are exact doubles,
+ *  so their division rounds to the same double that reading the decimal
+ *  r / 10^p does. This covers most measured values without sprintf.
+ *
+ * @param buf    Where to write.
+ * @param d      The number, not a whole number.
+ * @param single Whether only the nearest float has to match.
+ * @return       The number of characters written, or 0 if there is no such
+ *               short form.
+ */
+static size_t __CTIFFPrintDecimal(char *buf, double d, bool single)
+{
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                  1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+                                  1e15, 1e16 };
+  double mag = (d < 0) ? -d : d, scaled, r;
+  char digits[20];
+  size_t n, len = 0;
+  int p;
+
+  // Very small numbers are shorter with an exponent.
+  if (mag < 1e-5) return 0;
+
+  for (p = 1; p <= 16; p++) {
+    scaled = mag * pow10[p];
+    if (scaled >= 9007199254740992.0) return 0; // 2^53
+
+    r = (double) (long long) (scaled + 0.5);
+    if (single ? (float) (r / pow10[p]) == (float) mag
+               : r / pow10[p] == mag) break;
+  }
+  if (p > 16) return 0;
+
+  n = __CTIFFPrintInt(digits, (long long) r);
+  if (d < 0) buf[len++] = '-';
+
+  if (n <= (size_t) p){
+    buf[len++] = '0';
+    buf[len++] = '.';
+    memset(buf + len, '0', p - n);
+    len += p - n;
+    memcpy(buf + len, digits, n);
+    len += n;
+  } else {
+    memcpy(buf + len, digits, n - p);
+    len += n - p;
+    buf[len++] = '.';
+    memcpy(buf + len, digits + n - p, p);
+    len += p;
+  }
+
+  buf[len] = '\0';
+  return len;
+}
+
+/** Write a number as a short JSON number that reads back the same.
+ *
+ *  Whole numbers are written as integers, and numbers with few decimals
+ *  without sprintf. Very large and small numbers are written with the
+ *  fewest significant digits that read back the same, and other numbers
+ *  with 17 (9 for single precision), which always do. JSON has no
+ *  infinities or NaN, so they are written as null.
+ *
+ * @param buf    Where to write, with room for at least 32 characters.
+ * @param d      The number.
+ * @param single Whether d is a single precision float, which is then
+ *               written with as few digits as read back that float.
+ * @return       The number of characters written, followed by a NUL.
+ */
+size_t __CTIFFPrintDouble(char *buf, double d, bool single)
+{
+  int precision = single ? 9 : 17, min_precision;
+  size_t len;
+
+  if (d != d || d - d != 0){
+    memcpy(buf, "null", 5);
+    return 4;
+  }
+
+  if (d > -1e15 && d < 1e15 && d == (double) (long long) d){
+    len = __CTIFFPrintInt(buf, (long long) d);
+    buf[len] = '\0';
+    return len;
+  }
+
+  if ((len = __CTIFFPrintDecimal(buf, d, single)) != 0) return len;
+
+  // Numbers in the range of __CTIFFPrintDecimal that it cannot write need
+  // nearly all the digits, so searching for fewer is not worth the time.
+  // Very large or small numbers may need any number of digits.
+  if ((d > -1e-5 && d < 1e-5) || d <= -1e15 || d >= 1e15){
+    for (min_precision = 1; min_precision < precision; min_precision++) {
+      sprintf(buf, "%.*g", min_precision, d);
+      if (single ? (float) strtod(buf, NULL) == (float) d
+                 : strtod(buf, NULL) == d) return strlen(buf);
+    }
+  }
 
-  return time_str;
+  return sprintf(buf, "%.*g", precision, d);
 }
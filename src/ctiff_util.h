@@ -21,6 +21,10 @@
 
 #define CTIFF_UTIL_H
 
+#include <stddef.h> // size_t
+
+#include "ctiff_types.h"
+
 #ifdef WIN32
 #define inline __inline // Microsoft, I hate you (uses C89).
 #endif
@@ -34,6 +38,20 @@ static inline const void* __movePtr(const void* const ptr,
   return (void *) (((char *) ptr)+(dist*size/8));
 }
 
-const char* __CTIFFGetTime();
+/** Size in bytes of the image data of a page with the given style. */
+static inline size_t __CTIFFPageSize(const CTIFF_dir_style *style)
+{
+  return (size_t) style->width * style->height *
+                  (style->in_color ? 3 : 1) * style->bps / 8;
+}
+
+/** Size of a TIFF date and time string, including the NUL. */
+#define CTIFF_DATETIME_SIZE 20
+
+void __CTIFFGetTime(long long *real_ns, long long *mono_ns);
+void __CTIFFFormatTime(char *buf, long long real_ns);
+int __CTIFFReserve(char **buf, size_t *cap, size_t need);
+size_t __CTIFFPrintInt(char *buf, long long val);
+size_t __CTIFFPrintDouble(char *buf, double d, bool single);
 
 #endif /* end of include guard: CTIFF_UTIL_H */
@@ -0,0 +1,224 @@
+/**
+ * @file ctiff_workers.c
+ * @description A pool of worker threads for compressing image data.
+ *
+ * The workers of a CTIFF run a batch of numbered tasks (for example, one per
+ * strip of a page) in parallel. The thread that starts the batch takes tasks
+ * as well, and returns once every task has finished.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h> // malloc
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_thread.h"
+
+#include "ctiff_workers.h"
+
+/** A set of threads waiting for batches of tasks. */
+typedef struct CTIFF_workers_s {
+  CTIFF_mutex    lock;
+  CTIFF_cond     start;      // Signalled when a batch is started or on stop.
+  CTIFF_cond     done;       // Signalled when the last task of a batch ends.
+  CTIFF_thread  *threads;
+  unsigned int   num_threads;
+
+  CTIFF_task     task;
+  void          *arg;
+  unsigned int   num_tasks;
+  unsigned int   next_task;
+  unsigned int   num_done;
+  unsigned long  batch;      // Incremented for every batch.
+  bool           stop;
+} CTIFF_workers;
+
+
+/** Run tasks of the current batch until none are left.
+ *
+ *  The workers must be locked, and are locked again on return.
+ *
+ * @param workers The workers running the batch.
+ */
+static void __CTIFFWorkersTake(CTIFF_workers *workers)
+{
+  unsigned int task_num;
+
+  while (workers->next_task < workers->num_tasks){
+    task_num = workers->next_task++;
+
+    __CTIFFMutexUnlock(&workers->lock);
+    workers->task(workers->arg, task_num);
+    __CTIFFMutexLock(&workers->lock);
+
+    if (++workers->num_done == workers->num_tasks){
+      __CTIFFCondBroadcast(&workers->done);
+    }
+  }
+}
+
+/** Body of a worker thread.
+ *
+ * @param arg The workers the thread belongs to.
+ */
+static CTIFF_THREAD_FUNC(__CTIFFWorker, arg)
+{
+  CTIFF_workers *workers = (CTIFF_workers*) arg;
+  unsigned long  batch = 0;
+
+  __CTIFFMutexLock(&workers->lock);
+
+  for (;;) {
+    while (!workers->stop && workers->batch == batch){
+      __CTIFFCondWait(&workers->start, &workers->lock);
+    }
+    if (workers->stop) break;
+
+    batch = workers->batch;
+    __CTIFFWorkersTake(workers);
+  }
+
+  __CTIFFMutexUnlock(&workers->lock);
+  CTIFF_THREAD_RETURN;
+}
+
+/** Run a batch of tasks on the workers and wait for all of them to finish.
+ *
+ *  If there are no workers, the tasks are run in order on the calling
+ *  thread.
+ *
+ * @param workers   The workers, or NULL.
+ * @param task      The function to run for each task.
+ * @param arg       Passed to every task.
+ * @param num_tasks The number of tasks, numbered from 0.
+ */
+void __CTIFFWorkersRun(CTIFF_workers *workers, CTIFF_task task,
+                       void *arg, unsigned int num_tasks)
+{
+  unsigned int i;
+
+  if (workers == NULL || num_tasks < 2){
+    for (i = 0; i < num_tasks; i++) task(arg, i);
+    return;
+  }
+
+  __CTIFFMutexLock(&workers->lock);
+
+  workers->task      = task;
+  workers->arg       = arg;
+  workers->num_tasks = num_tasks;
+  workers->next_task = 0;
+  workers->num_done  = 0;
+  workers->batch++;
+  __CTIFFCondBroadcast(&workers->start);
+
+  __CTIFFWorkersTake(workers);
+
+  while (workers->num_done < workers->num_tasks){
+    __CTIFFCondWait(&workers->done, &workers->lock);
+  }
+
+  __CTIFFMutexUnlock(&workers->lock);
+}
+
+/** Stop and free the workers of a CTIFF.
+ *
+ * @param ctiff The CTIFF whose workers to free.
+ */
+void __CTIFFWorkersFree(CTIFF ctiff)
+{
+  CTIFF_workers *workers = ctiff->workers;
+  unsigned int i;
+
+  if (workers == NULL) return;
+
+  __CTIFFMutexLock(&workers->lock);
+  workers->stop = true;
+  __CTIFFCondBroadcast(&workers->start);
+  __CTIFFMutexUnlock(&workers->lock);
+
+  for (i = 0; i < workers->num_threads; i++){
+    __CTIFFThreadJoin(&workers->threads[i]);
+  }
+
+  __CTIFFCondDestroy(&workers->done);
+  __CTIFFCondDestroy(&workers->start);
+  __CTIFFMutexDestroy(&workers->lock);
+  FREE(workers->threads);
+  FREE(ctiff->workers);
+}
+
+/** Set the number of threads used to compress each page.
+ *
+ *  The strips of a page are compressed independently, so with more than one
+ *  thread they are compressed in parallel and then written in order. The
+ *  resulting file is identical to the one written with a single thread.
+ *  One thread (the default) compresses every strip on the thread that
+ *  writes the page.
+ *
+ *  Should not be called while pages are being written asynchronously.
+ * @see CTIFFSetRowsPerStrip
+ *
+ * @param ctiff       The CamTIFF file to set the parameter for.
+ * @param num_threads The number of threads compressing a page, or 0 for one.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int CTIFFSetThreads(CTIFF ctiff, unsigned int num_threads)
+{
+  CTIFF_workers *workers;
+
+  if (ctiff == NULL) return ECTIFFNULL;
+
+  __CTIFFWorkersFree(ctiff);
+  if (num_threads <= 1) return CTIFFSUCCESS;
+
+  workers = (CTIFF_workers*) malloc(sizeof(CTIFF_workers));
+  if (workers == NULL) return ECTIFFMEMORY;
+
+  // The thread starting a batch also runs tasks.
+  workers->num_threads = 0;
+  workers->threads = (CTIFF_thread*) malloc((num_threads - 1) *
+                                            sizeof(CTIFF_thread));
+  if (workers->threads == NULL){
+    FREE(workers);
+    return ECTIFFMEMORY;
+  }
+
+  workers->task      = NULL;
+  workers->arg       = NULL;
+  workers->num_tasks = 0;
+  workers->next_task = 0;
+  workers->num_done  = 0;
+  workers->batch     = 0;
+  workers->stop      = false;
+
+  __CTIFFMutexInit(&workers->lock);
+  __CTIFFCondInit(&workers->start);
+  __CTIFFCondInit(&workers->done);
+
+  ctiff->workers = workers;
+
+  while (workers->num_threads < num_threads - 1){
+    if (__CTIFFThreadCreate(&workers->threads[workers->num_threads],
+                            __CTIFFWorker, workers) != 0){
+      __CTIFFWorkersFree(ctiff);
+      return ECTIFFTHREAD;
+    }
+    workers->num_threads++;
+  }
+
+  return CTIFFSUCCESS;
+}
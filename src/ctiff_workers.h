@@ -0,0 +1,34 @@
+/**
+ * @file ctiff_workers.h
+ * @description A pool of worker threads for compressing image data.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_WORKERS_H
+
+#define CTIFF_WORKERS_H
+
+#include "ctiff_types.h"
+
+/** A task run by the workers, called once for each task number. */
+typedef void (*CTIFF_task)(void *arg, unsigned int task_num);
+
+int CTIFFSetThreads(CTIFF ctiff, unsigned int num_threads);
+
+void __CTIFFWorkersRun(struct CTIFF_workers_s *workers, CTIFF_task task,
+                       void *arg, unsigned int num_tasks);
+void __CTIFFWorkersFree(CTIFF ctiff);
+
+#endif /* end of include guard: CTIFF_WORKERS_H */
@@ -25,18 +25,85 @@
 #include "ctiff_types.h"
 #include "ctiff_util.h"
 #include "ctiff_error.h"
+#include "ctiff_async.h"
+#include "ctiff_pool.h"
+#include "ctiff_memio.h"
+#include "ctiff_workers.h"
+#include "ctiff_rollover.h"
+#include "ctiff_dedup.h"
+#include "ctiff_cbor.h"
+#include "ctiff_data.h"
+#include "ctiff_bufio.h"
 
 #include "ctiff_write.h"
 
+/** The private tags CamTIFF writes. */
+static const TIFFFieldInfo __CTIFFFieldInfo[] = {
+  { CTIFFTAG_CBORMETA, TIFF_VARIABLE2, TIFF_VARIABLE2, TIFF_UNDEFINED,
+    FIELD_CUSTOM, 1, 1, "CamTIFFMetadata" },
+  { CTIFFTAG_TIMESTAMP, TIFF_VARIABLE, TIFF_VARIABLE, TIFF_ASCII,
+    FIELD_CUSTOM, 1, 0, "CamTIFFTimestamp" }
+};
+
+/** Make the private CamTIFF tags known to libTIFF for a file.
+ *
+ * @param tiff The file to read or write the tags.
+ */
+void __CTIFFRegisterTags(TIFF *tiff)
+{
+  if (TIFFFindFieldInfo(tiff, CTIFFTAG_TIMESTAMP, TIFF_ANY) == NULL){
+    TIFFMergeFieldInfo(tiff, __CTIFFFieldInfo,
+                       sizeof(__CTIFFFieldInfo) / sizeof(TIFFFieldInfo));
+  }
+}
+
+/** Write the time a page was added to the TIFF file.
+ *
+ *  The time to the second goes in TIFFTAG_DATETIME, and the times in
+ *  nanoseconds in CTIFFTAG_TIMESTAMP. Both are formatted here rather than
+ *  when the page is added, into buffers on the stack.
+ * @see CTIFFTAG_TIMESTAMP
+ *
+ * @param dir  The directory being written.
+ * @param tiff The CamTIFF file to add the time to.
+ */
+void __CTIFFWriteTime(CTIFF_dir *dir, TIFF *tiff)
+{
+  char datetime[CTIFF_DATETIME_SIZE];
+  char timestamp[2*20 + 2];
+  size_t len;
+
+  __CTIFFFormatTime(datetime, dir->time_ns);
+  TIFFSetField(tiff, TIFFTAG_DATETIME, datetime);
+
+  len = __CTIFFPrintInt(timestamp, dir->time_ns);
+  timestamp[len++] = ' ';
+  len += __CTIFFPrintInt(timestamp + len, dir->monotonic_ns);
+  timestamp[len] = '\0';
+
+  __CTIFFRegisterTags(tiff);
+  TIFFSetField(tiff, CTIFFTAG_TIMESTAMP, timestamp);
+}
+
 /** Write the extended metadata to the TIFF file.
  *
+ *  If metadata is shared between pages, only what differs from the shared
+ *  metadata is written.
+ * @see CTIFFSetMetaDedup
+ *
+ * @param ctiff    The CamTIFF file being written.
  * @param ext_meta The extended metadata struct to add.
  * @param tiff     The CamTIFF file to add the metadata to.
  */
-void __CTIFFWriteExtMeta(CTIFF_extended_metadata *ext_meta, TIFF *tiff)
+void __CTIFFWriteExtMeta(CTIFF ctiff, CTIFF_extended_metadata *ext_meta,
+                         TIFF *tiff)
 {
-  TIFFSetField(tiff, TIFFTAG_XMLPACKET, strlen(ext_meta->data),
-                                        ext_meta->data);
+  const char *data = __CTIFFDedupExtMeta(ctiff, ext_meta->data);
+
+  if (data == NULL) return;
+  if (__CTIFFWriteCborMeta(ctiff, data, tiff)) return;
+
+  TIFFSetField(tiff, TIFFTAG_XMLPACKET, strlen(data), data);
 }
 
 /** Write the basic metadata to the TIFF File.
@@ -74,6 +141,67 @@ void __CTIFFWriteBasicMeta(CTIFF_basic_metadata *basic_meta, TIFF *tiff)
   }
 }
 
+/** Calculate the number of rows in each strip of a directory.
+ *
+ *  The explicit rows per strip of the style are used if set. Otherwise as
+ *  many rows as fit into the style's strip_bytes are used, with a minimum of
+ *  one row. If neither is set, libTIFF chooses its default strip size.
+ *
+ *  The image layout tags must already be set on the TIFF.
+ *
+ * @param style The style of the directory being written.
+ * @param tiff  The CamTIFF file the directory is written to.
+ * @return      The number of rows per strip.
+ */
+uint32 __CTIFFRowsPerStrip(CTIFF_dir_style *style, TIFF *tiff)
+{
+  uint32  rows = style->rows_per_strip;
+  tsize_t scanline;
+
+  if (rows == 0 && style->strip_bytes != 0){
+    scanline = TIFFScanlineSize(tiff);
+    rows = (scanline > 0) ? style->strip_bytes / scanline : 1;
+    if (rows == 0) rows = 1;
+  }
+
+  if (rows > style->height && style->height != 0) rows = style->height;
+
+  // Returns rows if non-zero, libTIFF's default otherwise.
+  return TIFFDefaultStripSize(tiff, rows);
+}
+
+/** Find the predictor a style can be written with.
+ *
+ *  Horizontal differencing needs 8, 16 or 32 bit samples and the floating
+ *  point predictor needs floating point samples. Only LZW and Deflate
+ *  support predictors. Otherwise no predictor is used.
+ *
+ * @param style The style of the directory being written.
+ * @return      The libTIFF predictor to use.
+ */
+uint16 __CTIFFPredictor(CTIFF_dir_style *style)
+{
+  if (style->compression != COMPRESSION_LZW &&
+      style->compression != COMPRESSION_ADOBE_DEFLATE){
+    return PREDICTOR_NONE;
+  }
+
+  switch (style->predictor) {
+    case CTIFF_PREDICTOR_HORIZONTAL:
+      if (style->bps == 8 || style->bps == 16 || style->bps == 32){
+        return PREDICTOR_HORIZONTAL;
+      }
+      break;
+    case CTIFF_PREDICTOR_FLOATINGPOINT:
+      if (style->pixel_data_type == SAMPLEFORMAT_IEEEFP){
+        return PREDICTOR_FLOATINGPOINT;
+      }
+      break;
+  }
+
+  return PREDICTOR_NONE;
+}
+
 /** Write style information to a CamTIFF file.
  *
  * @param style The style to write to the CamTIFF file.
@@ -83,6 +211,7 @@ void __CTIFFWriteBasicMeta(CTIFF_basic_metadata *basic_meta, TIFF *tiff)
 int __CTIFFWriteStyle(CTIFF_dir_style *style, TIFF *tiff)
 {
   int retval = CTIFFSUCCESS;
+  uint16 predictor;
   // Required for image viewing.
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, style->width));
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, style->height));
@@ -91,10 +220,18 @@ int __CTIFFWriteStyle(CTIFF_dir_style *style, TIFF *tiff)
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL,
                                 style->in_color ? 3 : 1));
 
-  // TODO: Create more optimal ROWSPERSTRIP defined by 8KB segments.
-  RETNONZERO(TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, 1));
+  RETNONZERO(TIFFSetField(tiff, TIFFTAG_COMPRESSION, style->compression));
+
+  if (style->compression == COMPRESSION_ADOBE_DEFLATE &&
+      style->compression_level != 0){
+    RETNONZERO(TIFFSetField(tiff, TIFFTAG_ZIPQUALITY,
+                                  style->compression_level));
+  }
 
-  RETNONZERO(TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_LZW));
+  // Only written when used, so plain pages keep their old tag set.
+  if ((predictor = __CTIFFPredictor(style)) != PREDICTOR_NONE){
+    RETNONZERO(TIFFSetField(tiff, TIFFTAG_PREDICTOR, predictor));
+  }
 
   // Black as min is default.
   if (style->in_color) {
@@ -109,6 +246,15 @@ int __CTIFFWriteStyle(CTIFF_dir_style *style, TIFF *tiff)
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB));
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG));
 
+  if (style->tile_width != 0){
+    RETNONZERO(TIFFSetField(tiff, TIFFTAG_TILEWIDTH, style->tile_width));
+    RETNONZERO(TIFFSetField(tiff, TIFFTAG_TILELENGTH, style->tile_height));
+  } else {
+    // Needs the layout above to know the size of a scanline.
+    RETNONZERO(TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP,
+                                  __CTIFFRowsPerStrip(style, tiff)));
+  }
+
   // These values do not impact image reading
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_XRESOLUTION, style->x_res));
   RETNONZERO(TIFFSetField(tiff, TIFFTAG_YRESOLUTION, style->y_res));
@@ -117,48 +263,316 @@ int __CTIFFWriteStyle(CTIFF_dir_style *style, TIFF *tiff)
   return retval;
 }
 
+/** A page whose strips or tiles are being compressed. */
+typedef struct CTIFF_strip_job_s {
+  CTIFF_dir  *dir;
+  const char *image;
+  uint32      height;
+  uint32      rows_per_strip;
+  tsize_t     scanline;
+
+  // Used when writing tiles.
+  bool        tiled;
+  uint32      width;
+  uint32      tile_width;
+  uint32      tile_height;
+  uint32      tiles_across;
+  tsize_t     pixel;     // Bytes per pixel.
+  tsize_t     tile_size; // Bytes of image data in a tile, with padding.
+
+  // Used when compressing on the workers, one per strip or tile.
+  CTIFF_membuf *bufs;   // In-memory TIFF holding the compressed strip.
+  toff_t       *offset; // Offset of the compressed strip in its buffer.
+  tsize_t      *size;   // Size of the compressed strip, -1 on error.
+} CTIFF_strip_job;
+
+/** Find the image data of a strip.
+ *
+ * @param job   The page being written.
+ * @param strip The strip number.
+ * @param size  Set to the size in bytes of the strip's image data.
+ * @return      The start of the strip's image data.
+ */
+const char* __CTIFFStripData(CTIFF_strip_job *job, tstrip_t strip,
+                             tsize_t *size)
+{
+  uint32 row  = strip*job->rows_per_strip;
+  uint32 rows = (job->height - row < job->rows_per_strip) ?
+                 job->height - row : job->rows_per_strip;
+
+  *size = rows*job->scanline;
+  return job->image + (size_t) row*job->scanline;
+}
+
+/** Copy the image data of a tile.
+ *
+ *  Tiles on the right and bottom edges of the page are padded with zeros.
+ *
+ * @param job  The page being written.
+ * @param tile The tile number.
+ * @param buf  Set to the tile's image data, job->tile_size bytes.
+ */
+void __CTIFFTileData(CTIFF_strip_job *job, ttile_t tile, char *buf)
+{
+  uint32 x = (tile % job->tiles_across)*job->tile_width;
+  uint32 y = (tile / job->tiles_across)*job->tile_height;
+  uint32 cols = (job->width - x < job->tile_width) ?
+                 job->width - x : job->tile_width;
+  uint32 rows = (job->height - y < job->tile_height) ?
+                 job->height - y : job->tile_height;
+  size_t row_size = (size_t) job->tile_width*job->pixel;
+  size_t copy     = (size_t) cols*job->pixel;
+  const char *src = job->image + (size_t) y*job->scanline +
+                    (size_t) x*job->pixel;
+  uint32 row;
+
+  for (row = 0; row < rows; row++){
+    memcpy(buf + row*row_size, src + row*job->scanline, copy);
+    if (copy < row_size) memset(buf + row*row_size + copy, 0, row_size - copy);
+  }
+
+  if (rows < job->tile_height){
+    memset(buf + rows*row_size, 0, (job->tile_height - rows)*row_size);
+  }
+}
+
+/** Compress one strip of a page into its own in-memory TIFF.
+ *
+ *  The in-memory TIFF is given the style of the page, with the strip as its
+ *  only strip, so libTIFF produces exactly the bytes it would have written
+ *  to the real file. Run on the workers.
+ * @see __CTIFFWorkersRun
+ *
+ * @param arg   The CTIFF_strip_job of the page.
+ * @param strip The strip number.
+ */
+void __CTIFFEncodeStrip(void *arg, unsigned int strip)
+{
+  CTIFF_strip_job *job = (CTIFF_strip_job*) arg;
+  const char *strip_buffer;
+  tsize_t strip_size;
+  toff_t *offsets, *byte_counts;
+  TIFF *tmp;
+
+  job->size[strip] = -1;
+  strip_buffer = __CTIFFStripData(job, strip, &strip_size);
+
+  if ((tmp = __CTIFFMemOpen(&job->bufs[strip], "w")) == NULL) return;
+
+  __CTIFFWriteStyle(&job->dir->style, tmp);
+  TIFFSetField(tmp, TIFFTAG_IMAGELENGTH, strip_size/job->scanline);
+  TIFFSetField(tmp, TIFFTAG_ROWSPERSTRIP, strip_size/job->scanline);
+
+  if (TIFFWriteEncodedStrip(tmp, 0, (void*)strip_buffer, strip_size) != -1 &&
+      TIFFGetField(tmp, TIFFTAG_STRIPOFFSETS, &offsets) &&
+      TIFFGetField(tmp, TIFFTAG_STRIPBYTECOUNTS, &byte_counts)){
+    job->offset[strip] = offsets[0];
+    job->size[strip]   = (tsize_t) byte_counts[0];
+  }
+
+  TIFFClose(tmp);
+}
+
+/** Compress one tile of a page into its own in-memory TIFF.
+ *
+ *  Like __CTIFFEncodeStrip, the in-memory TIFF holds the tile as its only
+ *  tile. Run on the workers.
+ * @see __CTIFFEncodeStrip
+ *
+ * @param arg  The CTIFF_strip_job of the page.
+ * @param tile The tile number.
+ */
+void __CTIFFEncodeTile(void *arg, unsigned int tile)
+{
+  CTIFF_strip_job *job = (CTIFF_strip_job*) arg;
+  char *tile_buffer;
+  toff_t *offsets, *byte_counts;
+  TIFF *tmp;
+
+  job->size[tile] = -1;
+
+  if ((tile_buffer = (char*) malloc(job->tile_size)) == NULL) return;
+  __CTIFFTileData(job, tile, tile_buffer);
+
+  if ((tmp = __CTIFFMemOpen(&job->bufs[tile], "w")) == NULL){
+    free(tile_buffer);
+    return;
+  }
+
+  __CTIFFWriteStyle(&job->dir->style, tmp);
+  TIFFSetField(tmp, TIFFTAG_IMAGEWIDTH, job->tile_width);
+  TIFFSetField(tmp, TIFFTAG_IMAGELENGTH, job->tile_height);
+
+  if (TIFFWriteEncodedTile(tmp, 0, tile_buffer, job->tile_size) != -1 &&
+      TIFFGetField(tmp, TIFFTAG_TILEOFFSETS, &offsets) &&
+      TIFFGetField(tmp, TIFFTAG_TILEBYTECOUNTS, &byte_counts)){
+    job->offset[tile] = offsets[0];
+    job->size[tile]   = (tsize_t) byte_counts[0];
+  }
+
+  TIFFClose(tmp);
+  free(tile_buffer);
+}
+
+/** Compress the strips or tiles of a page in parallel and write them in
+ *  order.
+ *
+ * @param workers    The workers to compress the strips on.
+ * @param job        The page being written.
+ * @param num_strips The number of strips, or tiles, in the page.
+ * @param tiff       The CamTIFF file to write the strips to.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFWriteStripsParallel(struct CTIFF_workers_s *workers,
+                               CTIFF_strip_job *job, tstrip_t num_strips,
+                               TIFF *tiff)
+{
+  int retval = CTIFFSUCCESS;
+  tstrip_t strip;
+  tsize_t written;
+
+  job->bufs   = (CTIFF_membuf*) calloc(num_strips, sizeof(CTIFF_membuf));
+  job->offset = (toff_t*) malloc(num_strips*sizeof(toff_t));
+  job->size   = (tsize_t*) malloc(num_strips*sizeof(tsize_t));
+
+  if (job->bufs == NULL || job->offset == NULL || job->size == NULL){
+    retval = ECTIFFMEMORY;
+  } else {
+    __CTIFFWorkersRun(workers,
+                      job->tiled ? __CTIFFEncodeTile : __CTIFFEncodeStrip,
+                      job, num_strips);
+  }
+
+  for (strip = 0; strip < num_strips && retval == CTIFFSUCCESS; strip++){
+    written = -1;
+    if (job->size[strip] != -1){
+      written = (job->tiled ? TIFFWriteRawTile : TIFFWriteRawStrip)
+                  (tiff, strip, job->bufs[strip].data + job->offset[strip],
+                   job->size[strip]);
+    }
+    if (written == -1){
+      retval = job->tiled ? ECTIFFWRITETILE : ECTIFFWRITESTRIP;
+    }
+  }
+
+  if (job->bufs != NULL){
+    for (strip = 0; strip < num_strips; strip++) free(job->bufs[strip].data);
+  }
+  FREE(job->bufs);
+  FREE(job->offset);
+  FREE(job->size);
+
+  return retval;
+}
+
+/** Write the tiles of a page in order.
+ *
+ * @param job       The page being written.
+ * @param num_tiles The number of tiles in the page.
+ * @param tiff      The CamTIFF file to write the tiles to.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFWriteTiles(CTIFF_strip_job *job, ttile_t num_tiles, TIFF *tiff)
+{
+  int retval = CTIFFSUCCESS;
+  char *tile_buffer;
+  ttile_t tile;
+
+  if ((tile_buffer = (char*) malloc(job->tile_size)) == NULL){
+    return ECTIFFMEMORY;
+  }
+
+  for (tile = 0; tile < num_tiles && retval == CTIFFSUCCESS; tile++){
+    __CTIFFTileData(job, tile, tile_buffer);
+
+    if (TIFFWriteEncodedTile(tiff, tile, tile_buffer, job->tile_size) == -1){
+      retval = ECTIFFWRITETILE;
+    }
+  }
+
+  free(tile_buffer);
+  return retval;
+}
+
 /** Write a directory to a CamTIFF file.
  *
+ *  If the CTIFF has workers, the strips or tiles of the page are compressed
+ *  in parallel.
+ * @see CTIFFSetThreads
+ *
+ * @param ctiff The CamTIFF file to write the directory to.
  * @param dir   The directory to write to the CamTIFF file.
- * @param tiff  The CamTIFF file to add the metadata to.
  * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
  */
-int __CTIFFWriteDir(CTIFF_dir *dir, TIFF *tiff)
+int __CTIFFWriteDir(CTIFF ctiff, CTIFF_dir *dir)
 {
   int retval = CTIFFSUCCESS;
-  unsigned int i;
-  unsigned int height, width, bps;
-  const void *strip_buffer, *image;
+  TIFF *tiff = ctiff->tiff;
+  CTIFF_strip_job job;
+  tstrip_t strip, num_strips;
+  tsize_t strip_size;
+  const char *strip_buffer;
 
   if (dir == NULL) return ECTIFFNULLDIR;
 
-  height = dir->style.height;
-  width  = dir->style.width;
-  bps    = dir->style.bps;
-  image  = dir->data;
+  if (ctiff->rollover != NULL){
+    if ((retval = __CTIFFRolloverNext(ctiff)) != CTIFFSUCCESS) return retval;
+    tiff = ctiff->tiff;
+  }
 
-  TIFFSetField(tiff, TIFFTAG_DATETIME, dir->timestamp);
+  __CTIFFWriteTime(dir, tiff);
 
   __CTIFFWriteStyle(&dir->style, tiff);
   __CTIFFWriteBasicMeta(&dir->basic_meta, tiff);
-  __CTIFFWriteExtMeta(&dir->ext_meta, tiff);
-
-
-  // Write the information to the file -1 on error, strip length on success.
-  for (i=0; i < height; i++) {
-    strip_buffer = __movePtr(image, i*width, bps);
+  __CTIFFWriteExtMeta(ctiff, &dir->ext_meta, tiff);
+
+  job.dir    = dir;
+  job.image  = (const char*) dir->data;
+  job.height = dir->style.height;
+  job.scanline = TIFFScanlineSize(tiff);
+
+  job.tiled = (dir->style.tile_width != 0);
+  if (job.tiled){
+    job.width        = dir->style.width;
+    job.tile_width   = dir->style.tile_width;
+    job.tile_height  = dir->style.tile_height;
+    job.tiles_across = (job.width + job.tile_width - 1) / job.tile_width;
+    job.pixel        = (job.width > 0) ? job.scanline / job.width : 0;
+    job.tile_size    = TIFFTileSize(tiff);
+    num_strips       = TIFFNumberOfTiles(tiff);
+  } else {
+    TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &job.rows_per_strip);
+    num_strips = TIFFNumberOfStrips(tiff);
+  }
 
-    if (TIFFWriteEncodedStrip(tiff,i,(void*)strip_buffer,width*bps/8) == -1){
-      // TODO: Is it possible to flush a partial directory?
-      return ECTIFFWRITESTRIP;
+  // Uncompressed strips are just copied, so there is nothing to parallelise.
+  if (ctiff->workers != NULL && num_strips > 1 &&
+      dir->style.compression != COMPRESSION_NONE){
+    retval = __CTIFFWriteStripsParallel(ctiff->workers, &job, num_strips, tiff);
+    if (retval != CTIFFSUCCESS) return retval;
+  } else if (job.tiled){
+    retval = __CTIFFWriteTiles(&job, num_strips, tiff);
+    if (retval != CTIFFSUCCESS) return retval;
+  } else {
+    // Write the information to the file -1 on error, strip length on success.
+    for (strip = 0; strip < num_strips; strip++) {
+      strip_buffer = __CTIFFStripData(&job, strip, &strip_size);
+
+      if (TIFFWriteEncodedStrip(tiff, strip, (void*)strip_buffer,
+                                strip_size) == -1){
+        // TODO: Is it possible to flush a partial directory?
+        return ECTIFFWRITESTRIP;
+      }
     }
   }
 
   // 1 on success, 0 on error
+  __CTIFFBufMarkDir(tiff);
   if (TIFFWriteDirectory(tiff) != 1) return ECTIFFWRITEDIR;
 
   // The write has succeeded.
   dir->write_count++;
+  if (ctiff->rollover != NULL) __CTIFFRolloverCount(ctiff);
   return retval;
 }
 
@@ -175,8 +589,12 @@ int __CTIFFWriteDir(CTIFF_dir *dir, TIFF *tiff)
  *  function close just to ensure that all of the information inside the
  *  CamTIFF file has been written out to disk.
  *
+ *  If the CamTIFF file writes asynchronously, this function instead blocks
+ *  until the writer thread has written every page added so far.
+ *
  * @see CTIFFAddNewPage
  * @see CTIFFWriteEvery
+ * @see CTIFFSetAsync
  * @see CTIFFClose
  *
  * @param ctiff The CamTIFF file to write to disk.
@@ -185,31 +603,24 @@ int __CTIFFWriteDir(CTIFF_dir *dir, TIFF *tiff)
 int CTIFFWrite(CTIFF ctiff)
 {
   int retval = 0;
-  unsigned int *num_unwritten;
-  CTIFF_node node, prev_node;
+  CTIFF_dir *dir;
 
   if (ctiff == NULL) return ECTIFFNULL;
 
   // Now that we have started writing, lock the strict parameter.
   ctiff->strict_lock = true;
 
-  prev_node = ctiff->write_ptr;
-  if (ctiff->write_ptr == NULL){
-    node = ctiff->first_node;
-  } else {
-    node = ctiff->write_ptr->next_node;
-  }
-
-  num_unwritten = &ctiff->num_unwritten;
+  // The writer thread owns the TIFF, so just wait for it to catch up.
+  if (ctiff->async != NULL) return __CTIFFAsyncFlush(ctiff);
 
-  while (node != NULL && *num_unwritten > 0) {
-    if ((retval = __CTIFFWriteDir(node->dir, ctiff->tiff)) != 0) return retval;
+  // Written directories are released at once so their slots can be reused.
+  while (ctiff->num_unwritten > 0) {
+    dir = __CTIFFRingFront(ctiff);
+    if ((retval = __CTIFFWriteDir(ctiff, dir)) != 0) return retval;
 
-    prev_node = node;
-    node = node->next_node;
-    (*num_unwritten)--;
+    __CTIFFReleaseDir(ctiff, dir);
+    __CTIFFRingPop(ctiff);
   }
 
-  ctiff->write_ptr = prev_node;
   return 0;
 }
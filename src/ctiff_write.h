@@ -25,5 +25,7 @@
 #include "ctiff_types.h"
 
 int CTIFFWrite(CTIFF ctiff);
+int __CTIFFWriteDir(CTIFF ctiff, CTIFF_dir *dir);
+void __CTIFFRegisterTags(struct tiff *tiff);
 
 #endif /* end of include guard: CTIFF_WRITE_H */
@@ -0,0 +1,366 @@
+/**
+ * @file ctiff_writeq.c
+ * @description Writes to a file kept in flight on a set of threads.
+ *
+ * A buffer of bytes for a given offset is handed to the queue in exchange
+ * for a free buffer of the same size, and written by one of the threads
+ * with a positional write, so the file offset is never moved. Up to depth
+ * writes are in flight at once. Before a range of the file is read or
+ * written by other means, the writes overlapping it are waited for.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h> // malloc
+
+#ifdef __WIN32
+#include <string.h> // memset
+#include <io.h>     // _get_osfhandle
+#else
+#include <unistd.h> // pwrite
+#endif
+
+#include "ctiff_types.h"
+#include "ctiff_util.h"
+#include "ctiff_error.h"
+#include "ctiff_thread.h"
+
+#include "ctiff_writeq.h"
+
+/** A buffer of the queue and the write it is used for. */
+typedef enum {
+  CTIFF_WRITE_FREE = 0,
+  CTIFF_WRITE_QUEUED,
+  CTIFF_WRITE_ACTIVE
+} CTIFF_write_state;
+
+typedef struct CTIFF_write_s {
+  char               *buf;
+  int                 fd;
+  unsigned long long  offset;
+  size_t              len;
+  CTIFF_write_state   state;
+} CTIFF_write;
+
+/** Writes in flight and the threads writing them. */
+struct CTIFF_writeq_s {
+  CTIFF_mutex    lock;
+  CTIFF_cond     queued;     // Signalled when a write is queued or on stop.
+  CTIFF_cond     done;       // Signalled when a write finishes.
+  CTIFF_thread  *threads;
+  unsigned int   num_threads;
+
+  CTIFF_write   *writes;
+  unsigned int   depth;
+  bool           error;      // Set once any write has failed.
+  bool           stop;
+};
+
+
+/** Write all of a buffer at an offset of a file.
+ *
+ * @param fd     The file.
+ * @param data   The bytes.
+ * @param len    The number of bytes.
+ * @param offset Where to write.
+ * @return       0 on success, -1 on failure.
+ */
+int __CTIFFWriteAt(int fd, const char *data, size_t len,
+                   unsigned long long offset)
+{
+#ifdef __WIN32
+  HANDLE file = (HANDLE) _get_osfhandle(fd);
+  OVERLAPPED at;
+  DWORD written;
+
+  while (len > 0){
+    memset(&at, 0, sizeof(at));
+    at.Offset     = (DWORD) offset;
+    at.OffsetHigh = (DWORD) (offset >> 32);
+
+    if (!WriteFile(file, data, (DWORD) len, &written, &at) || written == 0){
+      return -1;
+    }
+    data   += written;
+    len    -= written;
+    offset += written;
+  }
+#else
+  ssize_t written;
+
+  while (len > 0){
+    if ((written = pwrite(fd, data, len, (off_t) offset)) <= 0) return -1;
+    data   += written;
+    len    -= (size_t) written;
+    offset += (unsigned long long) written;
+  }
+#endif
+
+  return 0;
+}
+
+/** Check whether a write in flight overlaps a range of a file.
+ *
+ *  The queue must be locked.
+ *
+ * @param queue  The queue.
+ * @param offset The start of the range.
+ * @param len    The length of the range.
+ * @return       true if a queued or active write overlaps the range.
+ */
+static bool __CTIFFWriteQueueBusy(CTIFF_writeq *queue,
+                                  unsigned long long offset, size_t len)
+{
+  CTIFF_write *write;
+  unsigned int i;
+
+  for (i = 0; i < queue->depth; i++){
+    write = &queue->writes[i];
+    if (write->state != CTIFF_WRITE_FREE &&
+        write->offset < offset + len && offset < write->offset + write->len){
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/** Body of a writer thread.
+ *
+ * @param arg The queue the thread belongs to.
+ */
+static CTIFF_THREAD_FUNC(__CTIFFWriter, arg)
+{
+  CTIFF_writeq *queue = (CTIFF_writeq*) arg;
+  CTIFF_write  *write;
+  unsigned int i;
+  int retval;
+
+  __CTIFFMutexLock(&queue->lock);
+
+  for (;;) {
+    write = NULL;
+    for (i = 0; i < queue->depth && write == NULL; i++){
+      if (queue->writes[i].state == CTIFF_WRITE_QUEUED){
+        write = &queue->writes[i];
+      }
+    }
+
+    if (write == NULL){
+      if (queue->stop) break;
+      __CTIFFCondWait(&queue->queued, &queue->lock);
+      continue;
+    }
+
+    write->state = CTIFF_WRITE_ACTIVE;
+    __CTIFFMutexUnlock(&queue->lock);
+
+    retval = __CTIFFWriteAt(write->fd, write->buf, write->len, write->offset);
+
+    __CTIFFMutexLock(&queue->lock);
+    if (retval != 0) queue->error = true;
+    write->state = CTIFF_WRITE_FREE;
+    __CTIFFCondBroadcast(&queue->done);
+  }
+
+  __CTIFFMutexUnlock(&queue->lock);
+  CTIFF_THREAD_RETURN;
+}
+
+/** Allocate a buffer for the queue.
+ *
+ * @param cap   The size of the buffer.
+ * @param align The alignment of the buffer, 0 for any.
+ * @return      The buffer, to be freed with free, or NULL.
+ */
+static char* __CTIFFWriteQueueAlloc(size_t cap, size_t align)
+{
+#ifndef __WIN32
+  void *buf;
+
+  if (align > 0) return (posix_memalign(&buf, align, cap) == 0) ?
+                        (char*) buf : NULL;
+#endif
+  (void) align;
+  return (char*) malloc(cap);
+}
+
+/** Create a queue of writes and start its threads.
+ *
+ *  Each buffer given to the queue must have been allocated in the same way
+ *  as its own buffers, as they are exchanged.
+ *
+ * @param queue Set to the new queue.
+ * @param depth The number of writes to keep in flight.
+ * @param cap   The size of each buffer.
+ * @param align The alignment of each buffer, 0 for any.
+ * @return      CTIFFSUCCESS (0) on success, non-zero CamTIFF error on failure.
+ */
+int __CTIFFWriteQueueNew(CTIFF_writeq **queue, unsigned int depth,
+                         size_t cap, size_t align)
+{
+  CTIFF_writeq *q;
+  unsigned int i;
+
+  if ((q = (CTIFF_writeq*) malloc(sizeof(CTIFF_writeq))) == NULL){
+    return ECTIFFMEMORY;
+  }
+
+  q->num_threads = 0;
+  q->depth  = 0;
+  q->error  = false;
+  q->stop   = false;
+  q->writes = (CTIFF_write*) malloc(depth * sizeof(CTIFF_write));
+  q->threads = (CTIFF_thread*) malloc(depth * sizeof(CTIFF_thread));
+
+  __CTIFFMutexInit(&q->lock);
+  __CTIFFCondInit(&q->queued);
+  __CTIFFCondInit(&q->done);
+
+  if (q->writes == NULL || q->threads == NULL){
+    __CTIFFWriteQueueFree(q);
+    return ECTIFFMEMORY;
+  }
+
+  while (q->depth < depth){
+    CTIFF_write *write = &q->writes[q->depth];
+
+    if ((write->buf = __CTIFFWriteQueueAlloc(cap, align)) == NULL){
+      __CTIFFWriteQueueFree(q);
+      return ECTIFFMEMORY;
+    }
+    write->fd     = -1;
+    write->offset = 0;
+    write->len    = 0;
+    write->state  = CTIFF_WRITE_FREE;
+    q->depth++;
+  }
+
+  for (i = 0; i < depth; i++){
+    if (__CTIFFThreadCreate(&q->threads[i], __CTIFFWriter, q) != 0){
+      __CTIFFWriteQueueFree(q);
+      return ECTIFFTHREAD;
+    }
+    q->num_threads++;
+  }
+
+  *queue = q;
+  return CTIFFSUCCESS;
+}
+
+/** Queue a buffer to be written, in exchange for a free one.
+ *
+ *  Waits for a free buffer, and for any write in flight that overlaps the
+ *  range, so that writes to the same bytes land in order.
+ *
+ * @param queue  The queue.
+ * @param fd     The file to write to.
+ * @param buf    The buffer to write, set to a free buffer of the queue.
+ * @param len    The number of bytes to write.
+ * @param offset Where to write them.
+ * @return       0 on success, -1 if this or an earlier write failed.
+ */
+int __CTIFFWriteQueueSubmit(CTIFF_writeq *queue, int fd, char **buf,
+                            size_t len, unsigned long long offset)
+{
+  CTIFF_write *write = NULL;
+  unsigned int i;
+  char *free_buf;
+  bool error;
+
+  __CTIFFMutexLock(&queue->lock);
+
+  for (;;) {
+    if (!__CTIFFWriteQueueBusy(queue, offset, len)){
+      for (i = 0; i < queue->depth && write == NULL; i++){
+        if (queue->writes[i].state == CTIFF_WRITE_FREE){
+          write = &queue->writes[i];
+        }
+      }
+    }
+    if (write != NULL || queue->error) break;
+    __CTIFFCondWait(&queue->done, &queue->lock);
+  }
+
+  if (write != NULL){
+    free_buf      = write->buf;
+    write->buf    = *buf;
+    write->fd     = fd;
+    write->offset = offset;
+    write->len    = len;
+    write->state  = CTIFF_WRITE_QUEUED;
+    *buf = free_buf;
+    __CTIFFCondSignal(&queue->queued);
+  }
+
+  error = queue->error;
+  __CTIFFMutexUnlock(&queue->lock);
+
+  return error ? -1 : 0;
+}
+
+/** Wait for the writes in flight that overlap a range of the file.
+ *
+ * @param queue  The queue.
+ * @param offset The start of the range.
+ * @param len    The length of the range, (size_t) -1 for every write.
+ * @return       0 on success, -1 if any write has failed.
+ */
+int __CTIFFWriteQueueWait(CTIFF_writeq *queue, unsigned long long offset,
+                          size_t len)
+{
+  bool error;
+
+  if (len == (size_t) -1) offset = 0;
+
+  __CTIFFMutexLock(&queue->lock);
+  while (__CTIFFWriteQueueBusy(queue, offset, len)){
+    __CTIFFCondWait(&queue->done, &queue->lock);
+  }
+  error = queue->error;
+  __CTIFFMutexUnlock(&queue->lock);
+
+  return error ? -1 : 0;
+}
+
+/** Stop the threads of a queue and free it.
+ *
+ *  Writes still queued are written first.
+ *
+ * @param queue The queue, or NULL.
+ */
+void __CTIFFWriteQueueFree(CTIFF_writeq *queue)
+{
+  unsigned int i;
+
+  if (queue == NULL) return;
+
+  __CTIFFMutexLock(&queue->lock);
+  queue->stop = true;
+  __CTIFFCondBroadcast(&queue->queued);
+  __CTIFFMutexUnlock(&queue->lock);
+
+  for (i = 0; i < queue->num_threads; i++){
+    __CTIFFThreadJoin(&queue->threads[i]);
+  }
+
+  for (i = 0; i < queue->depth; i++) FREE(queue->writes[i].buf);
+
+  __CTIFFCondDestroy(&queue->done);
+  __CTIFFCondDestroy(&queue->queued);
+  __CTIFFMutexDestroy(&queue->lock);
+  FREE(queue->writes);
+  FREE(queue->threads);
+  FREE(queue);
+}
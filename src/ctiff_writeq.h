@@ -0,0 +1,40 @@
+/**
+ * @file ctiff_writeq.h
+ * @description Writes to a file kept in flight on a set of threads.
+ *
+ * Copyright (GPL V3): This program is free software: you can redistribute it
+ * and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTIFF_WRITEQ_H
+
+#define CTIFF_WRITEQ_H
+
+#include <stddef.h> // size_t
+
+/** The most writes that can be kept in flight. */
+#define CTIFF_MAX_WRITE_DEPTH 32
+
+typedef struct CTIFF_writeq_s CTIFF_writeq;
+
+int __CTIFFWriteAt(int fd, const char *data, size_t len,
+                   unsigned long long offset);
+int __CTIFFWriteQueueNew(CTIFF_writeq **queue, unsigned int depth,
+                         size_t cap, size_t align);
+int __CTIFFWriteQueueSubmit(CTIFF_writeq *queue, int fd, char **buf,
+                            size_t len, unsigned long long offset);
+int __CTIFFWriteQueueWait(CTIFF_writeq *queue, unsigned long long offset,
+                          size_t len);
+void __CTIFFWriteQueueFree(CTIFF_writeq *queue);
+
+#endif /* end of include guard: CTIFF_WRITEQ_H */